@@ -0,0 +1,89 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * First touch of every page of a range, in order and shuffled, with
+ * and without readahead. The handler copies from an in-memory blob.
+ * Touches that find the page in place already count too.
+ */
+
+#define PAGES 16384
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * blob) {
+	return uffdw_copy(uffd, (char *)blob + page, page_original, size);
+}
+
+static void run(bool random, struct uffdw_range_options_t * options, const char * readahead, char * blob) {
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	char * addr = mmap(
+		NULL, PAGES * page_size,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map area");
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)addr, PAGES * page_size, 0,
+		handler, blob,
+		options
+	)) errx(EXIT_FAILURE, "failed to register");
+
+	size_t * order = malloc(sizeof(size_t) * PAGES);
+	uint64_t * latencies = malloc(sizeof(uint64_t) * PAGES);
+	if (order == NULL || latencies == NULL) err(EXIT_FAILURE, "failed to allocate");
+	for (size_t i = 0; i < PAGES; i ++) order[i] = i;
+	for (size_t i = PAGES - 1; random && i > 0; i --) {
+		size_t j = rand() % (i + 1);
+		size_t t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	volatile char sink = 0;
+	uint64_t start = bench_now();
+	for (size_t i = 0; i < PAGES; i ++) {
+		uint64_t t = bench_now();
+		sink += addr[order[i] * page_size];
+		latencies[i] = bench_now() - t;
+	}
+	uint64_t elapsed = bench_now() - start;
+	(void)sink;
+
+	printf("bench=access pattern=%s readahead=%s", random ? "random" : "sequential", readahead);
+	bench_report("touches", PAGES, elapsed, latencies);
+
+	uffdw_cancel(uffdw);
+	munmap(addr, PAGES * page_size);
+	free(latencies);
+	free(order);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+	char * blob = malloc(PAGES * page_size);
+	if (blob == NULL) err(EXIT_FAILURE, "failed to allocate");
+	memset(blob, 1, PAGES * page_size);
+
+	struct uffdw_range_options_t none = {0};
+	struct uffdw_range_options_t fixed = {.readahead = 16};
+	struct uffdw_range_options_t adaptive = {.readahead = 16, .readahead_adaptive = true};
+	for (int random = 0; random <= 1; random ++) {
+		run(random, &none, "none", blob);
+		run(random, &fixed, "16", blob);
+		run(random, &adaptive, "adaptive", blob);
+	}
+
+	free(blob);
+	return EXIT_SUCCESS;
+}
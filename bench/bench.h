@@ -0,0 +1,42 @@
+#ifndef UFFDW_BENCH_H
+#define UFFDW_BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Helpers of benchmarks. Every run prints a line of `key=value` pairs:
+ * `bench=<name>`, parameters of the run and then results from
+ * `bench_report()`, times in ns.
+ */
+
+static inline uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _bench_cmp(const void * _a, const void * _b) {
+	uint64_t a = *(const uint64_t *)_a;
+	uint64_t b = *(const uint64_t *)_b;
+	return a < b ? -1 : a > b;
+}
+
+/**
+ * Finish the line with rate of `count` operations named `what` (eg.
+ * "faults") done in `elapsed` ns, and percentiles of their latencies
+ * (which get sorted).
+ */
+static inline void bench_report(const char * what, size_t count, uint64_t elapsed, uint64_t * latencies) {
+	qsort(latencies, count, sizeof(uint64_t), _bench_cmp);
+	printf(
+		" %s=%zu %s_per_sec=%.0f p50_ns=%llu p99_ns=%llu\n",
+		what, count, what, count * 1e9 / elapsed,
+		(unsigned long long)latencies[count / 2], (unsigned long long)latencies[count * 99 / 100]
+	);
+	fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * Cost of `fork()` of a process with registered ranges, as a function
+ * of their number. Every child touches a page and exits. The next fork
+ * waits for it, since the reader may still be setting the previous
+ * child up in malloc while fork() holds its locks.
+ */
+
+#define CHILDREN 64
+#define MAX_RANGES 10000
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * the_page) {
+	(void)page;
+	(void)size;
+	return uffdw_copy(uffd, the_page, page_original, page_size);
+}
+
+static void run(size_t ranges, void * the_page) {
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	char * addr = mmap(
+		NULL, MAX_RANGES * page_size,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map area");
+	for (size_t i = 0; i < ranges; i ++) {
+		size_t begin = i * MAX_RANGES / ranges;
+		size_t end = (i + 1) * MAX_RANGES / ranges;
+		if (!uffdw_register(
+			uffdw,
+			(size_t)addr + begin * page_size, (end - begin) * page_size,
+			(begin + i) * page_size,
+			handler, the_page
+		)) errx(EXIT_FAILURE, "failed to register range %zu", i);
+	}
+
+	uint64_t latencies[CHILDREN];
+	uint64_t start = bench_now();
+	for (size_t c = 0; c < CHILDREN; c ++) {
+		uint64_t t = bench_now();
+		pid_t pid = fork();
+		if (pid < 0) err(EXIT_FAILURE, "failed to fork");
+		if (pid == 0) {
+			volatile char sink = addr[(c * 7919 % MAX_RANGES) * page_size];
+			(void)sink;
+			_exit(EXIT_SUCCESS);
+		}
+		latencies[c] = bench_now() - t;
+
+		int s;
+		if (waitpid(pid, &s, 0) != pid || !WIFEXITED(s) || WEXITSTATUS(s) != EXIT_SUCCESS) {
+			errx(EXIT_FAILURE, "child failed");
+		}
+	}
+	uint64_t elapsed = bench_now() - start;
+
+	printf("bench=fork ranges=%zu", ranges);
+	bench_report("forks", CHILDREN, elapsed, latencies);
+
+	uffdw_cancel(uffdw);
+	munmap(addr, MAX_RANGES * page_size);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+	void * the_page = calloc(1, page_size);
+	if (the_page == NULL) err(EXIT_FAILURE, "failed to allocate");
+
+	for (size_t ranges = 1; ranges <= MAX_RANGES; ranges *= 10) {
+		run(ranges, the_page);
+	}
+
+	free(the_page);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * Fault latency as a function of number of registered ranges. Every
+ * range has its own handler offset so that they can't be merged. Size
+ * of the area stays the same, so only the range table grows.
+ */
+
+#define FAULTS 4096
+#define MAX_RANGES 100000
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * the_page) {
+	(void)page;
+	(void)size;
+	return uffdw_copy(uffd, the_page, page_original, page_size);
+}
+
+static void run(size_t ranges, void * the_page) {
+	size_t pages = MAX_RANGES;
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	char * addr = mmap(
+		NULL, pages * page_size,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map area");
+
+	for (size_t i = 0; i < ranges; i ++) {
+		size_t begin = i * pages / ranges;
+		size_t end = (i + 1) * pages / ranges;
+		if (!uffdw_register(
+			uffdw,
+			(size_t)addr + begin * page_size, (end - begin) * page_size,
+			(begin + i) * page_size,
+			handler, the_page
+		)) errx(EXIT_FAILURE, "failed to register range %zu", i);
+	}
+
+	// touch pages in random order
+	size_t * order = malloc(sizeof(size_t) * pages);
+	if (order == NULL) err(EXIT_FAILURE, "failed to allocate");
+	for (size_t i = 0; i < pages; i ++) order[i] = i;
+	for (size_t i = pages - 1; i > 0; i --) {
+		size_t j = rand() % (i + 1);
+		size_t t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	uint64_t latencies[FAULTS];
+	volatile char sink = 0;
+	uint64_t start = bench_now();
+	for (size_t i = 0; i < FAULTS; i ++) {
+		uint64_t t = bench_now();
+		sink += addr[order[i] * page_size];
+		latencies[i] = bench_now() - t;
+	}
+	uint64_t elapsed = bench_now() - start;
+	(void)sink;
+
+	printf("bench=ranges ranges=%zu", ranges);
+	bench_report("faults", FAULTS, elapsed, latencies);
+
+	uffdw_cancel(uffdw);
+	munmap(addr, pages * page_size);
+	free(order);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+	void * the_page = calloc(1, page_size);
+
+	for (size_t ranges = 10; ranges <= MAX_RANGES; ranges *= 10) {
+		run(ranges, the_page);
+	}
+
+	return EXIT_SUCCESS;
+}
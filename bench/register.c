@@ -0,0 +1,82 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * Cost of registering and unregistering many adjacent single page
+ * ranges (that can't be merged in the table), as a function of how many
+ * of them are passed at once. Latencies are per range.
+ */
+
+#define SEGMENTS 8192
+#define MAX_BATCH 4096
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)page;
+	(void)_;
+	return uffdw_zeropage(uffd, page_original, size);
+}
+
+static void report(const char * op, size_t batch, uint64_t elapsed, uint64_t * latencies) {
+	printf("bench=register op=%s batch=%zu", op, batch);
+	bench_report("ranges", SEGMENTS, elapsed, latencies);
+}
+
+static void run(struct uffdw_t * uffdw, char * addr, size_t batch) {
+	static struct uffdw_registration_t registrations[SEGMENTS];
+	static uint64_t latencies[SEGMENTS];
+	for (size_t i = 0; i < SEGMENTS; i ++) {
+		registrations[i] = (struct uffdw_registration_t){
+			(size_t)addr + i * page_size, page_size, (SEGMENTS - i) * page_size,
+			handler, NULL,
+			NULL
+		};
+	}
+
+	uint64_t start = bench_now();
+	for (size_t i = 0; i < SEGMENTS; i += batch) {
+		uint64_t t = bench_now();
+		if (!uffdw_register_many(uffdw, &registrations[i], batch)) errx(EXIT_FAILURE, "failed to register");
+		uint64_t each = (bench_now() - t) / batch;
+		for (size_t j = i; j < i + batch; j ++) latencies[j] = each;
+	}
+	report("register", batch, bench_now() - start, latencies);
+
+	start = bench_now();
+	for (size_t i = 0; i < SEGMENTS; i += batch) {
+		uint64_t t = bench_now();
+		if (!uffdw_unregister_many(uffdw, &registrations[i], batch)) errx(EXIT_FAILURE, "failed to unregister");
+		uint64_t each = (bench_now() - t) / batch;
+		for (size_t j = i; j < i + batch; j ++) latencies[j] = each;
+	}
+	report("unregister", batch, bench_now() - start, latencies);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+	char * addr = mmap(
+		NULL, SEGMENTS * page_size,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map area");
+
+	for (size_t batch = 1; batch <= MAX_BATCH; batch *= 8) {
+		run(uffdw, addr, batch);
+	}
+
+	uffdw_cancel(uffdw);
+	munmap(addr, SEGMENTS * page_size);
+
+	return EXIT_SUCCESS;
+}
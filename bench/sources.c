@@ -0,0 +1,103 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * The same data faulted in from memory, from a file and from a packed
+ * image of it, in random order. The files are in page cache, so it's
+ * the cost of the source and not of the disk.
+ */
+
+#define PAGES 8192
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * blob) {
+	return uffdw_copy(uffd, (char *)blob + page, page_original, size);
+}
+
+static int temp_file(void) {
+	char path[] = "/tmp/uffdw-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create file");
+	if (unlink(path) != 0) err(EXIT_FAILURE, "failed to unlink file");
+	return fd;
+}
+
+static void run(const char * source, char * blob, int fd, int packed_fd) {
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	size_t size = PAGES * page_size;
+	char * addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map area");
+	bool ok;
+	if (strcmp(source, "memory") == 0) {
+		ok = uffdw_register(uffdw, (size_t)addr, size, 0, handler, blob);
+	} else if (strcmp(source, "file") == 0) {
+		ok = uffdw_register_file(uffdw, (size_t)addr, size, fd, 0);
+	} else {
+		ok = uffdw_register_packed(uffdw, (size_t)addr, size, packed_fd, 0);
+	}
+	if (!ok) errx(EXIT_FAILURE, "failed to register");
+
+	size_t * order = malloc(sizeof(size_t) * PAGES);
+	uint64_t * latencies = malloc(sizeof(uint64_t) * PAGES);
+	if (order == NULL || latencies == NULL) err(EXIT_FAILURE, "failed to allocate");
+	for (size_t i = 0; i < PAGES; i ++) order[i] = i;
+	for (size_t i = PAGES - 1; i > 0; i --) {
+		size_t j = rand() % (i + 1);
+		size_t t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	volatile char sink = 0;
+	uint64_t start = bench_now();
+	for (size_t i = 0; i < PAGES; i ++) {
+		uint64_t t = bench_now();
+		sink += addr[order[i] * page_size];
+		latencies[i] = bench_now() - t;
+	}
+	uint64_t elapsed = bench_now() - start;
+	(void)sink;
+
+	printf("bench=sources source=%s", source);
+	bench_report("touches", PAGES, elapsed, latencies);
+
+	uffdw_cancel(uffdw);
+	munmap(addr, size);
+	free(latencies);
+	free(order);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	// text-like data, so that packing has something to do
+	size_t size = PAGES * page_size;
+	char * blob = malloc(size);
+	if (blob == NULL) err(EXIT_FAILURE, "failed to allocate");
+	unsigned int seed = 1;
+	for (size_t i = 0; i < size; i ++) blob[i] = 'a' + rand_r(&seed) % 8;
+
+	int fd = temp_file();
+	if (write(fd, blob, size) != (ssize_t)size) err(EXIT_FAILURE, "failed to write file");
+	int packed_fd = temp_file();
+	if (!uffdw_pack(fd, packed_fd, UFFDW_PACK_BLOCK_MAX)) errx(EXIT_FAILURE, "failed to pack");
+
+	run("memory", blob, fd, packed_fd);
+	run("file", blob, fd, packed_fd);
+	run("packed", blob, fd, packed_fd);
+
+	close(packed_fd);
+	close(fd);
+	free(blob);
+	return EXIT_SUCCESS;
+}
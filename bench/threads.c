@@ -0,0 +1,98 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * Fault throughput as a function of number of threads faulting at
+ * once, for a single handling thread and for a pool. Every faulting
+ * thread touches its own pages in random order.
+ */
+
+#define PAGES_PER_THREAD 2048
+#define MAX_THREADS 16
+#define POOL 4
+
+static size_t page_size;
+static char * addr;
+static uint64_t * latencies;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * the_page) {
+	(void)page;
+	(void)size;
+	return uffdw_copy(uffd, the_page, page_original, page_size);
+}
+
+static void * touch(void * _thread) {
+	size_t thread = (size_t)_thread;
+	unsigned int seed = thread;
+	size_t order[PAGES_PER_THREAD];
+	for (size_t i = 0; i < PAGES_PER_THREAD; i ++) order[i] = i;
+	for (size_t i = PAGES_PER_THREAD - 1; i > 0; i --) {
+		size_t j = rand_r(&seed) % (i + 1);
+		size_t t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	char * pages = addr + thread * PAGES_PER_THREAD * page_size;
+	uint64_t * lat = latencies + thread * PAGES_PER_THREAD;
+	volatile char sink = 0;
+	for (size_t i = 0; i < PAGES_PER_THREAD; i ++) {
+		uint64_t t = bench_now();
+		sink += pages[order[i] * page_size];
+		lat[i] = bench_now() - t;
+	}
+	(void)sink;
+	return NULL;
+}
+
+static void run(size_t handlers, size_t threads, void * the_page) {
+	struct uffdw_t * uffdw = handlers == 1 ? uffdw_create() : uffdw_create_pool(handlers);
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	size_t size = threads * PAGES_PER_THREAD * page_size;
+	addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map area");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, size, 0,
+		handler, the_page
+	)) errx(EXIT_FAILURE, "failed to register");
+
+	pthread_t ts[MAX_THREADS];
+	uint64_t start = bench_now();
+	for (size_t i = 0; i < threads; i ++) {
+		if (pthread_create(&ts[i], NULL, touch, (void *)i) != 0) errx(EXIT_FAILURE, "failed to create thread");
+	}
+	for (size_t i = 0; i < threads; i ++) pthread_join(ts[i], NULL);
+	uint64_t elapsed = bench_now() - start;
+
+	printf("bench=threads handlers=%zu threads=%zu", handlers, threads);
+	bench_report("faults", threads * PAGES_PER_THREAD, elapsed, latencies);
+
+	uffdw_cancel(uffdw);
+	munmap(addr, size);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+	void * the_page = calloc(1, page_size);
+	latencies = malloc(sizeof(uint64_t) * MAX_THREADS * PAGES_PER_THREAD);
+	if (the_page == NULL || latencies == NULL) err(EXIT_FAILURE, "failed to allocate");
+
+	for (size_t handlers = 1; handlers <= POOL; handlers *= POOL) {
+		for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+			run(handlers, threads, the_page);
+		}
+	}
+
+	free(latencies);
+	free(the_page);
+	return EXIT_SUCCESS;
+}
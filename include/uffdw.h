@@ -2,27 +2,144 @@
 #define UFFDW_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Result of a handler. It's compatible with booleans, `true` stands for
+ * done.
+ */
+enum uffdw_status_t {
+	UFFDW_FAILED = 0,
+	UFFDW_DONE = 1,
+	/* the fault will be resolved later by `uffdw_complete()` */
+	UFFDW_PENDING = 2,
+};
 
 /**
  * Function to handle pagefaults. It should do its things (propably
- * call `uffdw_copy()`, `uffdw_zeropage()`, ...) and return boolean if
- * it was successful.
+ * call `uffdw_copy()`, `uffdw_zeropage()`, ...) and return if it was
+ * successful. Slow handlers can start fetching the page, return
+ * `UFFDW_PENDING` and finish with `uffdw_complete()` from any thread,
+ * so that other faults are not held up. Faults on a page that is being
+ * resolved don't reach the handler again.
  *
  * As arguments it takes two kinds of pagefault offsets (`page_offset`
  * and `real_page_offset`). The first one is page address calculated
  * taking remaps into account. Use it to figure out which pages should
  * go to faulting area. The second one is original page address. Use it
  * as argument to `uffdw_copy()` and similiar functions.
+ *
+ * Pages are of the size of the range (see `struct uffdw_range_options_t`),
+ * so on hugetlbfs both offsets are aligned to huge pages.
+ *
+ * `size` is length of the area (whole pages) that should be resolved,
+ * it's more than one page when readahead is on or when faults on
+ * adjacent pages came at once. Only the first page is mandatory, but
+ * resolving the rest with the same `uffdw_copy()` saves faults.
  */
-typedef bool (* uffdw_handler_t) (
+typedef enum uffdw_status_t (* uffdw_handler_t) (
 	int uffd,
-	size_t page_offset, size_t real_page_offset,
+	size_t page_offset, size_t real_page_offset, size_t size,
 	void * private_data
 );
 
+/* upper bound of readahead window, in pages */
+#define UFFDW_READAHEAD_MAX 1024
+
+/**
+ * Cache of pages copied in by handlers, keyed by handler data and the
+ * page offset handler sees. Later faults on the same page - in forked
+ * processes, remapped or otherwise aliased ranges - are served from it
+ * without calling the handler. Handlers are expected to give the same
+ * contents for the same page.
+ *
+ * It holds up to `budget` bytes, all allocated upfront, and evicts
+ * least recently used pages. It can be shared by ranges of many
+ * instances and must outlive them.
+ */
+struct uffdw_cache_t;
+
+struct uffdw_cache_t * uffdw_cache_create(size_t budget);
+void uffdw_cache_destroy(struct uffdw_cache_t * cache);
+
+/**
+ * Limit of memory taken by pages of ranges, for mapping more data than
+ * is to be kept in memory. Pages faulted in are tracked and once there
+ * are more than `size` bytes of them, pages faulted in longest ago
+ * (those faulted in again or written since the last look get another
+ * chance) are dropped by a thread of the budget. Next access faults
+ * them in through the handler again - anything written to them is lost.
+ *
+ * Unless `swap_fd` is -1, written pages are saved to that file before
+ * they are dropped and faulted in from it, so the budget works as
+ * swap. Pages are then faulted in write-protected (needs the kernel
+ * support, like `uffdw_track_dirty()`) to see the first write. Forked
+ * processes don't see what their parent had in swap - they get handler
+ * pages.
+ *
+ * Budget can be shared by ranges of many instances and must outlive
+ * them. Pages may take more than `size` for a while, faults don't wait
+ * for others to be dropped.
+ */
+struct uffdw_budget_t;
+
+struct uffdw_budget_t * uffdw_budget_create(size_t size, int swap_fd);
+void uffdw_budget_destroy(struct uffdw_budget_t * budget);
+/* bytes taken by pages of the budget now */
+size_t uffdw_budget_resident(struct uffdw_budget_t * budget);
+
+/**
+ * Optional properties of registered range. Zeroed structure gives the
+ * defaults.
+ */
+struct uffdw_range_options_t {
+	/* resolve up to this many pages with a single handler call */
+	size_t readahead;
+	/* start with one page and double the window while faults are
+	 * sequential, up to `readahead` pages (64 if it's 0) */
+	bool readahead_adaptive;
+	/* cache for pages of this range, see `struct uffdw_cache_t` (base pages only) */
+	struct uffdw_cache_t * cache;
+	/* limit of memory taken by pages of this range, see `struct
+	 * uffdw_budget_t` (base pages only) */
+	struct uffdw_budget_t * budget;
+	/* granularity of faults, 0 to take the one of the mapping (huge pages
+	 * of hugetlbfs) */
+	size_t pagesize;
+	/* fill the whole range in the background once it's registered, like
+	 * `uffdw_prefetch()` */
+	bool populate;
+	/* pages that handlers copy in and that are all zeroes get the shared
+	 * zero page instead of memory of their own, like with
+	 * `uffdw_zeropage()` (base pages that aren't write-protected only) */
+	bool detect_zeroes;
+};
+
 struct uffdw_t;
 
 struct uffdw_t * uffdw_create();
+
+/**
+ * Like `uffdw_create()`, but pagefaults are served by `threads` threads
+ * instead of one. Handlers may then run concurrently, also with
+ * `uffdw_register()`. Processes forked later get the same number of
+ * threads.
+ */
+struct uffdw_t * uffdw_create_pool(size_t threads);
+
+/* threads of the reactor shared by `uffdw_create_shared()` instances */
+#define UFFDW_REACTOR_THREADS 2
+
+/**
+ * Like `uffdw_create()`, but pagefaults are served by threads shared
+ * with all other instances created this way and with processes forked
+ * from them. Thread count stays `UFFDW_REACTOR_THREADS` (and one more
+ * for setting up forked processes) however many of them there are, so
+ * handlers should be quick (or defer, see `UFFDW_PENDING`). As in any
+ * handler that may see a fork, they shouldn't allocate memory.
+ */
+struct uffdw_t * uffdw_create_shared();
 void uffdw_cancel(struct uffdw_t * data);
 
 int _uffdw_get_uffd(struct uffdw_t *);
@@ -38,14 +155,346 @@ bool uffdw_register(
 	size_t offset, size_t size, size_t handler_offset,
 	uffdw_handler_t handler, void * private_data
 );
-//bool uffdw_unregister(int uffd, size_t offset, size_t size);
+bool uffdw_register_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size, size_t handler_offset,
+	uffdw_handler_t handler, void * private_data,
+	const struct uffdw_range_options_t * options
+);
+
+/**
+ * Stop handling memory range. Ranges registered over it are cut where
+ * it starts and ends, pages that are already there stay.
+ */
+bool uffdw_unregister(struct uffdw_t * uffdw, size_t offset, size_t size);
+
+/**
+ * Range for `uffdw_register_many()`, fields are the arguments of
+ * `uffdw_register_opts()`. NULL `options` give the defaults.
+ */
+struct uffdw_registration_t {
+	size_t offset;
+	size_t size;
+	size_t handler_offset;
+	uffdw_handler_t handler;
+	void * private_data;
+	const struct uffdw_range_options_t * options;
+};
+
+/**
+ * Register `count` ranges at once, with a single lock acquisition and
+ * a single syscall for each run of adjacent ones. Either all of them
+ * are registered, or none.
+ */
+bool uffdw_register_many(
+	struct uffdw_t * uffdw,
+	const struct uffdw_registration_t * registrations, size_t count
+);
+
+/**
+ * Unregister `count` ranges at once, with a single lock acquisition and
+ * a single syscall for each run of adjacent ones. Only `offset` and
+ * `size` are looked at, so the same array can be passed. Unlike
+ * registering it's not all or nothing: when a range fails, the others
+ * are unregistered anyway and false is returned.
+ */
+bool uffdw_unregister_many(
+	struct uffdw_t * uffdw,
+	const struct uffdw_registration_t * registrations, size_t count
+);
+
+/**
+ * Register memory range to be filled from file `fd`, starting at page
+ * aligned `file_offset`. Pages past the end of the file are zeroes.
+ *
+ * The file is mapped once, so faults are independent of `fd` position
+ * (and of `fd` itself, it can be closed right away). The mapping is
+ * kept until `uffdw_cancel()`.
+ */
+bool uffdw_register_file(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t file_offset
+);
+bool uffdw_register_file_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t file_offset,
+	const struct uffdw_range_options_t * options
+);
+
+/**
+ * Layout of ELF file loaded by `uffdw_load_elf()`.
+ */
+struct uffdw_elf_t {
+	/* address range reserved for the file, all segments are in it */
+	size_t base;
+	size_t size;
+	/* what to add to addresses in the file to get those in memory */
+	size_t bias;
+	/* entry point in memory, 0 if the file has none */
+	size_t entry;
+};
+
+/**
+ * Map `PT_LOAD` segments of ELF file `fd` with their layout and
+ * protections, filled lazily from the file like by
+ * `uffdw_register_file()` (and with zeroes past their file data, eg.
+ * `.bss`). Only pages that are touched get read.
+ *
+ * Position independent files go anywhere, others to their addresses.
+ * Nothing is relocated or run. Unmap `elf->size` bytes at `elf->base`
+ * to unload the file.
+ */
+bool uffdw_load_elf(struct uffdw_t * uffdw, int fd, struct uffdw_elf_t * elf);
+bool uffdw_load_elf_opts(
+	struct uffdw_t * uffdw,
+	int fd, struct uffdw_elf_t * elf,
+	const struct uffdw_range_options_t * options
+);
+
+/**
+ * Pack file `fd` into `packed_fd` as image made of `block_size` blocks
+ * (a power of two, from page size to `UFFDW_PACK_BLOCK_MAX`), each
+ * compressed on its own, so that any page can be faulted in by
+ * unpacking just its block. See also `uffdw-pack` tool.
+ */
+#define UFFDW_PACK_BLOCK_MAX (64 * 1024)
+bool uffdw_pack(int fd, int packed_fd, size_t block_size);
+
+/**
+ * Register memory range to be filled from packed image `fd`, starting
+ * at page aligned `data_offset` of the unpacked data. Otherwise it's
+ * like `uffdw_register_file()`. Readahead is at least a block.
+ */
+bool uffdw_register_packed(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset
+);
+bool uffdw_register_packed_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset,
+	const struct uffdw_range_options_t * options
+);
+
+/**
+ * Make sparse image of file `fd` in `image_fd`: an index of extents of
+ * data, and their pages. Holes and pages of zeroes are left out, so they
+ * take neither space nor reads. See also `uffdw-pack` tool.
+ */
+bool uffdw_make_sparse(int fd, int image_fd);
+
+/**
+ * Register memory range to be filled from sparse image `fd`, starting at
+ * page aligned `data_offset` of the data. Otherwise it's like
+ * `uffdw_register_file()`. Runs of data in a fault are copied with a
+ * single call each, runs of zeroes get the zero page the same way.
+ */
+bool uffdw_register_sparse(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset
+);
+bool uffdw_register_sparse_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset,
+	const struct uffdw_range_options_t * options
+);
+
+/**
+ * Register memory range to be filled by page server listening on UNIX
+ * socket `path` (like `uffdw_serve_pages()`), starting at page aligned
+ * `data_offset` of its data. A fault asks for its page and for the
+ * pages predicted to come next (the readahead window, which is
+ * `UFFDW_REMOTE_PREDICT` pages unless set) at once, and the faulting
+ * thread is woken as soon as its page arrives. Every handler running at
+ * once has a connection of its own. Give `pagesize` on hugetlbfs.
+ */
+#define UFFDW_REMOTE_PREDICT 16
+bool uffdw_register_remote(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	const char * path, size_t data_offset
+);
+bool uffdw_register_remote_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	const char * path, size_t data_offset,
+	const struct uffdw_range_options_t * options
+);
+
+/**
+ * Reference page server: answer clients connecting to listening UNIX
+ * socket `listen_fd` with data of file `fd` (zeroes past its end), each
+ * from a thread of its own. Returns once `listen_fd` is shut down, the
+ * clients are served until they disconnect. See also `uffdw-serve`
+ * tool.
+ */
+bool uffdw_serve_pages(int listen_fd, int fd);
+
+/**
+ * Track writes to memory range, for incremental snapshots. The range is
+ * write-protected and every first write to a page since the previous
+ * `uffdw_collect_dirty()` is noted. Range may overlap lazily filled
+ * ones - pages filled by handlers start clean.
+ *
+ * Needs kernel support for userfaultfd write protection (and for
+ * `UFFD_FEATURE_WP_UNPOPULATED` to see writes to never touched pages).
+ */
+bool uffdw_track_dirty(struct uffdw_t * uffdw, size_t offset, size_t size);
+
+/**
+ * Get pages of a tracked range written since the previous call (or
+ * since the tracking started) and protect them again. Bit `i` of
+ * `dirty` (a bit per page is needed) stands for page at
+ * `offset + i * pagesize`.
+ */
+bool uffdw_collect_dirty(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	unsigned long * dirty
+);
+
+/**
+ * Counters of faults resolved, for whole instance or a registration.
+ */
+struct uffdw_counters_t {
+	/* pagefaults read, several on the same page included */
+	size_t faults;
+	/* bytes filled by copying and with zeroes */
+	size_t bytes_copied;
+	size_t bytes_zeroed;
+	/* pages found in place already while filling them */
+	size_t eexist;
+	/* faults that failed to be resolved (eg. handler failed) */
+	size_t failures;
+};
+
+#define UFFDW_LATENCY_BUCKETS 32
+
+struct uffdw_stats_t {
+	struct uffdw_counters_t counters;
+	/* events of the process (forks counted in parent) */
+	size_t forks;
+	size_t remaps;
+	size_t removes;
+	size_t unmaps;
+	/* bucket `i` counts faults woken between 2^i and 2^(i+1) ns after
+	 * they were read, the last one also those woken later. Faults left
+	 * `UFFDW_PENDING` are not timed. */
+	size_t latency[UFFDW_LATENCY_BUCKETS];
+};
+
+/**
+ * Part of registered range. Counters are per registration, so parts of
+ * the same one (split by eg. `munmap()`) share them.
+ */
+struct uffdw_range_stats_t {
+	size_t offset;
+	size_t size;
+	struct uffdw_counters_t counters;
+};
+
+/**
+ * Get statistics of instance (forked children have their own) and of
+ * up to `max_ranges` of its ranges, in address order. Returns number of
+ * ranges there are.
+ *
+ * Counting is cheap, faults are counted by every thread on its own.
+ * A fault is counted as it's resolved, so just after the faulting
+ * thread may go on.
+ */
+size_t uffdw_get_stats(
+	struct uffdw_t * uffdw,
+	struct uffdw_stats_t * stats,
+	struct uffdw_range_stats_t * ranges, size_t max_ranges
+);
+
+/**
+ * Record order in which pages get faulted in to `fd`, to be replayed by
+ * `uffdw_replay()` on next start. Pages are told by number of their
+ * registration and by their offset as handler sees it, so the trace
+ * fits as long as the same things are registered in the same order.
+ * Recording goes on until `uffdw_record_stop()` (which tells if all
+ * of the trace got written) or `uffdw_cancel()`. Trace is written in
+ * chunks, and faults that come while one is still being written are
+ * left out of it.
+ */
+bool uffdw_record(struct uffdw_t * uffdw, int fd);
+bool uffdw_record_stop(struct uffdw_t * uffdw);
+
+/**
+ * Fault in pages in order of trace `fd` from a background thread, to be
+ * ahead of the process. Call it once the ranges are registered, pages
+ * of registrations that aren't there are skipped. The thread gives way
+ * to pagefaults, but handlers may be called by it at the same time as
+ * by threads serving them. Replay ends with the trace or with
+ * `uffdw_cancel()`.
+ */
+bool uffdw_replay(struct uffdw_t * uffdw, int fd);
+
+/**
+ * Fill missing pages of registered ranges from `addr` to `addr + len`
+ * ahead of time, from a background thread that runs only when nothing
+ * else does and gives way to pagefaults. Pages are filled by handlers,
+ * which may be called by it at the same time as by threads serving
+ * faults. Spans are filled in order of calls, until `uffdw_cancel()`.
+ */
+bool uffdw_prefetch(struct uffdw_t * uffdw, size_t addr, size_t len);
+
+/**
+ * Get number of bytes from `addr` to `addr + len` known to be in place:
+ * filled through `uffdw` or there when registered, and not dropped
+ * since. It's kept by the instance, so it's cheap and right for forked
+ * processes too, but pages put there behind its back aren't seen.
+ */
+size_t uffdw_resident(struct uffdw_t * uffdw, size_t addr, size_t len);
+
+/**
+ * Get address of first page from `addr` to `addr + len` that isn't
+ * known to be in place (see `uffdw_resident()`), `addr + len` if none.
+ */
+size_t uffdw_first_missing(struct uffdw_t * uffdw, size_t addr, size_t len);
+
+/**
+ * Set priority of faults of thread `tid` (see `gettid()`), 0 is the
+ * default. Of faults read at once, those of threads with higher
+ * priority are resolved first, so that latency critical threads don't
+ * wait behind fault storms of others. Priorities are shared by all
+ * instances, set it back to 0 when the thread is done. Needs kernel
+ * support for `UFFD_FEATURE_THREAD_ID`, without it all faults are equal.
+ */
+bool uffdw_set_thread_priority(pid_t tid, int priority);
 
 /**
  * Functions operating on raw userfault file descriptor.
+ *
+ * Pages that are already in place are not an error for `uffdw_copy()`,
+ * they are skipped - with many handling threads the same page may be
+ * asked for more than once.
  */
 bool uffdw_copy(int uffd, void * our_offset, size_t target_offset, size_t size);
 bool uffdw_copy_from_fd(int uffd, int fd, size_t offset, size_t size);
 bool uffdw_zeropage(int uffd, size_t offset, size_t size);
 bool uffdw_wake(int uffd, size_t offset, size_t size);
+bool uffdw_writeprotect(int uffd, size_t offset, size_t size, bool protect);
+
+/**
+ * Get page aligned scratch memory of at least `size` bytes, to assemble
+ * pages for `uffdw_copy()` in. Every thread has its own, valid until its
+ * next call. Threads running handlers have theirs mapped and faulted in
+ * upfront, so faults are handled without allocating; it's mapped again
+ * only when more is asked for. NULL if it can't be mapped.
+ */
+void * uffdw_scratch(size_t size);
+
+/**
+ * Resolve fault left pending by handler: fill the pages (with zeroes if
+ * `our_offset` is NULL) and then wake the threads that wait for them.
+ */
+bool uffdw_complete(int uffd, void * our_offset, size_t target_offset, size_t size);
 
 #endif
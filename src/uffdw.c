@@ -1,14 +1,29 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <link.h>
 #include <linux/userfaultfd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stropts.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <uffdw.h>
 
@@ -19,22 +34,471 @@
 	#define DEBUG false
 #endif
 
+// not yet in all kernel headers
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+	#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+
+#define ULONG_BITS (sizeof(unsigned long) * 8)
+
 #if DEBUG
 	#define LOG(format, ...) do { fprintf(stderr, format "\n", ##__VA_ARGS__); } while (0)
 #else
 	#define LOG(...)
 #endif
 
+/* number of access streams tracked for adaptive readahead */
+#define UFFDW_STREAMS 16
+/* pages adaptive readahead window grows up to, unless readahead is given */
+#define UFFDW_ADAPTIVE_MAX 64
+
+/* size of read-only zero mapping to copy zeroes from (see `_uffdw_zeroes()`) */
+#define UFFDW_ZEROES_SIZE (1UL << 30)
+
+/* most messages read at once */
+#define UFFDW_BATCH 64
+
+/* size of table of pages being resolved and how far a page is looked for */
+#define UFFDW_PENDING_SLOTS 1024
+#define UFFDW_PENDING_PROBES 16
+
+/* size of table of threads with priority and how far a thread is looked for */
+#define UFFDW_PRIORITY_SLOTS 1024
+#define UFFDW_PRIORITY_PROBES 16
+
+/* threads count statistics in this many slots, each in its own cache line */
+#define UFFDW_STATS_SLOTS 16
+
+/* trace being recorded is written in chunks of this size */
+#define UFFDW_TRACE_BUFFER 4096
+/* how long replay waits for demand faults to be served before looking again */
+#define UFFDW_REPLAY_BACKOFF_US 100
+/* most pages prefetch fills with a single handler call */
+#define UFFDW_PREFETCH_PAGES 64
+
+/* most pages dropped at once by budget's thread */
+#define UFFDW_EVICT_BATCH 64
+
+/* predicted pages are asked for in requests of this size (or a page) */
+#define UFFDW_REMOTE_CHUNK (64UL << 10)
+
+/* scratch memory threads running handlers start with, a batch of base
+ * pages (see `uffdw_scratch()`) */
+#define UFFDW_SCRATCH_SIZE (256UL << 10)
+
+/* range nodes are mapped in chunks of this size (see `_uffdw_range_alloc()`) */
+#define UFFDW_POOL_CHUNK (64UL << 10)
+
+/* words of residency bits mapped at once, a bit per base page, and size
+ * of table of them and how far a block is looked for */
+#define UFFDW_RESIDENCY_WORDS 512
+#define UFFDW_RESIDENCY_SLOTS 4096
+#define UFFDW_RESIDENCY_PROBES 16
+#define UFFDW_RESIDENCY_PAGES (UFFDW_RESIDENCY_WORDS * 64)
+
+/**
+ * Access stream that is expected to fault at `next` again. It's only a
+ * hint, so it's updated without any synchronization beyond atomicity.
+ */
+struct _uffdw_stream_t {
+	size_t _Atomic next;
+	size_t _Atomic window;
+};
+
+/**
+ * Residency bits of `UFFDW_RESIDENCY_PAGES` base pages, starting with
+ * page `block * UFFDW_RESIDENCY_PAGES`. Bits are only a hint - a page
+ * may be dropped before its event is read - so they are set and cleared
+ * atomically, without ordering them against anything else.
+ */
+struct _uffdw_residency_block_t {
+	size_t block;
+	uint64_t _Atomic bits[UFFDW_RESIDENCY_WORDS];
+};
+
+/**
+ * Pages of an instance known to be in place. Blocks are mapped when
+ * first page of theirs is filled and stay until the instance is gone,
+ * so they are looked up without locks. When the table is crowded, pages
+ * of blocks that don't fit are never known to be there.
+ */
+struct _uffdw_residency_t {
+	struct _uffdw_residency_block_t * _Atomic blocks[UFFDW_RESIDENCY_SLOTS];
+};
+
+/**
+ * Counters behind `struct uffdw_counters_t`, only ever added to.
+ */
+struct _uffdw_counters_t {
+	size_t _Atomic faults;
+	size_t _Atomic bytes_copied;
+	size_t _Atomic bytes_zeroed;
+	size_t _Atomic eexist;
+	size_t _Atomic failures;
+};
+
+struct _uffdw_stats_slot_t {
+	_Alignas(64) struct _uffdw_counters_t counters;
+	size_t _Atomic latency[UFFDW_LATENCY_BUCKETS];
+};
+
+/**
+ * Page source owned by the library (like the one behind
+ * `uffdw_register_file()`). Sources live as long as the uffdw that
+ * created them, forked children only borrow them.
+ */
+struct _uffdw_source_t {
+	void (* destroy)(struct _uffdw_source_t *);
+	struct _uffdw_source_t * next;
+};
+
+/**
+ * Read-only mapping of a file, served by `_uffdw_file_handler()`.
+ */
+struct _uffdw_file_t {
+	struct _uffdw_source_t source;
+
+	char * base;
+	/* file offset of `base` */
+	size_t offset;
+	/* bytes of the file that are mapped, rounded up to pages */
+	size_t size;
+	/* file offset the data ends at, the rest of its page is zeroes */
+	size_t end;
+};
+
+/**
+ * Counters of a registration, owned like a source.
+ */
+struct _uffdw_range_counters_t {
+	struct _uffdw_source_t source;
+	struct _uffdw_counters_t counters;
+};
+
+/**
+ * Header of packed image (see `uffdw_pack()`), followed by `blocks + 1`
+ * file offsets of compressed blocks. Block `i` takes bytes `index[i]` -
+ * `index[i + 1]`, it's stored as is if that's its whole size.
+ */
+struct _uffdw_pack_header_t {
+	char magic[8];
+	uint64_t size;
+	uint32_t block_size;
+	uint32_t blocks;
+};
+
+#define UFFDW_PACK_MAGIC "uffdwpk1"
+
+/**
+ * Header of sparse image (see `uffdw_make_sparse()`), followed by
+ * `extents` extents of data sorted by offset. The rest of the `size`
+ * bytes are zeroes, whether they were holes or zeroes in the original.
+ */
+struct _uffdw_sparse_header_t {
+	char magic[8];
+	uint64_t size;
+	/* extents are made of whole pages of this size */
+	uint32_t pagesize;
+	uint32_t extents;
+};
+
+/**
+ * Extent of sparse image, `length` bytes of data at `offset` stored at
+ * `data` of the image, both page aligned. Data of the last page past the
+ * image size are zeroes.
+ */
+struct _uffdw_extent_t {
+	uint64_t offset;
+	uint64_t length;
+	uint64_t data;
+};
+
+#define UFFDW_SPARSE_MAGIC "uffdwsp1"
+
+/**
+ * Header of fault trace (see `uffdw_record()`). Entries that follow are
+ * pairs of varints: registration number and the page (handler offset
+ * divided by `pagesize`) as zigzag encoded difference from the page of
+ * previous entry.
+ */
+struct _uffdw_trace_header_t {
+	char magic[8];
+	uint64_t pagesize;
+};
+
+#define UFFDW_TRACE_MAGIC "uffdwtr1"
+
+/**
+ * Trace being recorded.
+ */
+struct _uffdw_trace_t {
+	int fd;
+	/* false once a write failed */
+	bool ok;
+	/* last entry, the next one is not written if it's the same */
+	size_t registration;
+	size_t page;
+	/* entries go to `buffer`, a full one is swapped for `spare` */
+	uint8_t * buffer;
+	size_t length;
+	uint8_t * spare;
+	size_t spare_length;
+	/* held while `spare` is being written, out of `uffdw->mutex` */
+	pthread_mutex_t write_mutex;
+	uint8_t buffers[2][UFFDW_TRACE_BUFFER];
+};
+
+/**
+ * Read-only mapping of packed image, served by `_uffdw_packed_handler()`.
+ */
+struct _uffdw_packed_t {
+	struct _uffdw_source_t source;
+
+	char * base;
+	size_t map_size;
+	const struct _uffdw_pack_header_t * header;
+	const uint64_t * index;
+};
+
+/**
+ * Read-only mapping of sparse image, served by `_uffdw_sparse_handler()`.
+ */
+struct _uffdw_sparse_t {
+	struct _uffdw_source_t source;
+
+	char * base;
+	size_t map_size;
+	const struct _uffdw_sparse_header_t * header;
+	const struct _uffdw_extent_t * extents;
+};
+
+/**
+ * Request of page server (see `uffdw_serve_pages()`), for `size` bytes
+ * at `offset` of its data. Reply is the request itself followed by the
+ * data. Requests are answered in order, so several can be on the way.
+ */
+struct _uffdw_page_request_t {
+	uint64_t offset;
+	uint64_t size;
+};
+
+/**
+ * Connection to page server, in a mapping of its own.
+ */
+struct _uffdw_connection_t {
+	int fd;
+	size_t map_size;
+	struct _uffdw_connection_t * next;
+};
+
+/**
+ * Client of page server, served by `_uffdw_remote_handler()`. Every
+ * handler running at once takes a connection of its own.
+ */
+struct _uffdw_remote_t {
+	struct _uffdw_source_t source;
+
+	struct sockaddr_un address;
+	size_t pagesize;
+
+	pthread_mutex_t mutex;
+	/* connections no handler uses at the moment */
+	struct _uffdw_connection_t * idle;
+};
+
+#define UFFDW_CACHE_NONE SIZE_MAX
+
+/**
+ * Cached page, one of preallocated `uffdw_cache_t.entries`.
+ */
+struct _uffdw_cache_entry_t {
+	/* key - handler data and page offset as handler sees it */
+	void * data;
+	size_t page;
+
+	/* next entry in the same hash bucket */
+	size_t next;
+	/* neighbours in LRU list */
+	size_t newer;
+	size_t older;
+};
+
+/**
+ * Page cache. Everything is allocated upfront, as pages are put in on
+ * the fault path, where allocating may deadlock with `fork()`.
+ */
+struct uffdw_cache_t {
+	pthread_mutex_t mutex;
+	size_t pagesize;
+
+	/* entries and their pages, `used` of `count` are taken */
+	struct _uffdw_cache_entry_t * entries;
+	char * pages;
+	size_t count;
+	size_t used;
+
+	/* hash table of entry indices, size is a power of two */
+	size_t * buckets;
+	size_t bucket_mask;
+
+	/* ends of LRU list */
+	size_t newest;
+	size_t oldest;
+};
+
+/**
+ * Hash table keyed by page of an instance, with linear probing. Entry
+ * is free if its `uffdw` is NULL.
+ */
+struct _uffdw_page_entry_t {
+	struct uffdw_t * uffdw;
+	size_t address;
+	size_t value;
+};
+
+struct _uffdw_page_map_t {
+	struct _uffdw_page_entry_t * entries;
+	/* size is a power of two, at least twice `count` */
+	size_t mask;
+	size_t count;
+};
+
+#define UFFDW_RESIDENT_REFERENCED 1
+#define UFFDW_RESIDENT_DIRTY 2
+#define UFFDW_RESIDENT_EVICTING 4
+
+/**
+ * Page resident in memory of a budget, one of preallocated
+ * `uffdw_budget_t.slots`. Free if `uffdw` is NULL.
+ */
+struct _uffdw_resident_t {
+	struct uffdw_t * uffdw;
+	size_t address;
+	unsigned flags;
+};
+
+struct uffdw_budget_t {
+	pthread_mutex_t mutex;
+	/* signaled when there are more pages than the budget, or on destroy */
+	pthread_cond_t over;
+	/* signaled when a batch of pages is dropped */
+	pthread_cond_t evicted;
+	pthread_t thread;
+	bool stop;
+
+	size_t pagesize;
+	/* pages kept, slots are twice as many - faults don't wait for eviction */
+	size_t pages;
+
+	/* resident pages swept by clock hand, and their slots in `resident` */
+	struct _uffdw_resident_t * slots;
+	size_t capacity;
+	size_t hand;
+	size_t * free_slots;
+	size_t free_count;
+	struct _uffdw_page_map_t resident;
+
+	/* file offsets of pages written out, -1 if there is no swap file */
+	int swap_fd;
+	struct _uffdw_page_map_t swapped;
+	/* free offsets of the swap file, there is room for all of them */
+	size_t * swap_free;
+	size_t swap_free_count;
+	size_t swap_end;
+};
+
+/**
+ * Area whose writes are tracked (see `uffdw_track_dirty()`).
+ */
+struct _uffdw_dirty_t {
+	size_t offset;
+	size_t end;
+	/* bit per page, set when a write-protected page gets written */
+	unsigned long * bits;
+	struct _uffdw_dirty_t * next;
+};
+
 struct uffdw_t {
 	int uffd;
-	pthread_t thread;
+	/* features agreed on with the kernel */
+	uint64_t features;
+
+	/* all threads read the same uffd, one at a time (see `_uffdw_serve`) */
+	size_t thread_count;
+	struct _uffdw_thread_t * threads;
+	pthread_mutex_t read_mutex;
+	/* becomes readable when threads should stop */
+	int stop_fd;
+
+	/* taken by writers of the range table, lookups don't need it */
 	pthread_mutex_t mutex;
 
 	long pagesize;
 
+	/* recent sequential access streams, for adaptive readahead */
+	struct _uffdw_stream_t streams[UFFDW_STREAMS];
+	unsigned _Atomic stream_victim;
+
+	/* range table as seen by writers and as published for readers */
 	struct uffdw_range_t * ranges;
+	struct uffdw_range_t * _Atomic published;
+	/* times the table was published, tells copies of it are out of date */
+	size_t _Atomic publishes;
+
+	/* nodes created since the last publish can be modified in place */
+	size_t gen;
+	/* nodes replaced since the last publish */
+	struct uffdw_range_t * retired;
+	/* nodes reserved for the next changes of the table */
+	struct uffdw_range_t * spare;
+	size_t spare_count;
+
+	/* pages whose handler is running or deferred, 0 is a free slot */
+	size_t _Atomic pending[UFFDW_PENDING_SLOTS];
+
+	/* pages filled and not dropped since, NULL if it couldn't be mapped */
+	struct _uffdw_residency_t * residency;
+
+	/* areas with tracked writes and their count, for a quick check */
+	struct _uffdw_dirty_t * dirty;
+	size_t _Atomic dirty_count;
+	pthread_mutex_t dirty_mutex;
+
+	/* sources created through this instance, guarded by `mutex` */
+	struct _uffdw_source_t * sources;
+
+	/* statistics counted by threads on their own, and of events, which
+	 * are guarded by `mutex` */
+	struct _uffdw_stats_slot_t stats[UFFDW_STATS_SLOTS];
+	size_t forks;
+	size_t remaps;
+	size_t removes;
+	size_t unmaps;
+
+	/* registrations made so far, guarded by `mutex` */
+	size_t registrations;
+	/* trace being recorded, guarded by `mutex` */
+	struct _uffdw_trace_t * trace;
+	struct _uffdw_replay_t * replay;
+	/* started by first prefetch, guarded by `mutex` */
+	struct _uffdw_prefetcher_t * prefetcher;
+	/* batches of faults being resolved, replay and prefetch give way to them */
+	size_t _Atomic demand;
+
+	/* serves forked process, its pages are not in this address space */
+	bool forked;
+	/* no pages are put under budget once this is set */
+	bool _Atomic canceling;
+
 	struct uffdw_t * children;
 	struct uffdw_t * next;
+
+	/* all running instances, to find them by uffd */
+	struct uffdw_t * next_instance;
+	/* shared reactor threads working on this instance */
+	size_t busy;
+	/* what the reactor finds this instance by, if it serves it */
+	struct _uffdw_handle_t * handle;
 };
 
 struct uffdw_range_t {
@@ -48,13 +512,232 @@ struct uffdw_range_t {
 	/* access to addr `offset + i` is presented to handler as access to `handler_offset + i` */
 	size_t handler_offset;
 
+	struct uffdw_range_options_t options;
+
+	/* counters of registration this range comes from */
+	struct _uffdw_counters_t * counters;
+	/* number of that registration, see `uffdw_record()` */
+	size_t registration;
+
+	/* ranges never overlap, so they are kept in a treap ordered by `offset` */
+	size_t priority;
+	struct uffdw_range_t * left;
+	struct uffdw_range_t * right;
+
+	/* generation of writes this node was created in */
+	size_t gen;
+	/* nodes and tables pointing to this one - tables of forked processes
+	 * share nodes, which are copied once either of them changes */
+	size_t _Atomic refs;
+
+	/* once out of the table, epoch it was retired in and next node
+	 * retired or free in the pool */
+	size_t epoch;
 	struct uffdw_range_t * next;
 };
 
+/**
+ * Pagefault read from uffd, with the range it hit at the time.
+ */
+struct _uffdw_fault_t {
+	/* aligned to `pagesize` of the range */
+	size_t address;
+	size_t pagesize;
+	bool wp;
+	bool found;
+	/* of the faulting thread, see `uffdw_set_thread_priority()` */
+	int priority;
+	struct uffdw_range_t range;
+};
+
+/**
+ * Faults of a batch resolved together, `first` to `next` - 1 of them.
+ */
+struct _uffdw_run_t {
+	size_t first;
+	size_t next;
+	size_t end;
+	int priority;
+};
+
+/**
+ * Thread with priority, free slot if `tid` is 0.
+ */
+struct _uffdw_priority_t {
+	pid_t _Atomic tid;
+	int _Atomic priority;
+};
+
+/**
+ * Pagefaults read at once.
+ */
+struct _uffdw_batch_t {
+	size_t count;
+	struct _uffdw_fault_t faults[UFFDW_BATCH];
+	/* when they were read, in ns */
+	uint64_t read_at;
+};
+
+/**
+ * Range tables are read without locking. Writers never touch nodes
+ * that may be visible to readers - they copy them instead and publish
+ * a new root (`_uffdw_publish()`). Replaced nodes are freed once every
+ * reading thread has left the epoch it was in during publishing.
+ */
+struct _uffdw_reader_t {
+	/* epoch the thread entered its read section in, 0 if outside */
+	size_t _Atomic epoch;
+	struct _uffdw_reader_t * next;
+};
+
+/**
+ * Own thread of an instance. Its reader record is allocated along with
+ * it, a thread that mallocs before its first read could block on the
+ * locks of a fork() waiting for that very read.
+ */
+struct _uffdw_thread_t {
+	pthread_t thread;
+	struct uffdw_t * uffdw;
+	struct _uffdw_reader_t reader;
+};
+
+/**
+ * Trace being replayed by its own thread.
+ */
+/**
+ * Range as replay looks it up, by registration and offset handler sees.
+ */
+struct _uffdw_replay_entry_t {
+	size_t registration;
+	size_t handler_offset;
+	size_t size;
+	size_t offset;
+};
+
+struct _uffdw_replay_t {
+	pthread_t thread;
+	struct uffdw_t * uffdw;
+	struct _uffdw_reader_t reader;
+	bool _Atomic stop;
+	uint8_t * data;
+	size_t size;
+	/* ranges sorted by registration, as of `publishes` of the table */
+	struct _uffdw_replay_entry_t * index;
+	size_t index_count;
+	size_t index_capacity;
+	size_t index_publishes;
+};
+
+/**
+ * Span of memory queued for prefetch.
+ */
+struct _uffdw_span_t {
+	size_t offset;
+	size_t end;
+	struct _uffdw_span_t * next;
+};
+
+/**
+ * Thread filling queued spans in the background.
+ */
+struct _uffdw_prefetcher_t {
+	pthread_t thread;
+	struct uffdw_t * uffdw;
+	struct _uffdw_reader_t reader;
+	bool _Atomic stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;
+	struct _uffdw_span_t * first;
+	struct _uffdw_span_t * last;
+};
+
+static size_t _Atomic _uffdw_epoch = 1;
+static size_t _Atomic _uffdw_gen = 1;
+static pthread_mutex_t _uffdw_rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct _uffdw_reader_t * _uffdw_readers = NULL;
+static struct uffdw_range_t * _uffdw_retired = NULL;
+static pthread_mutex_t _uffdw_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct uffdw_range_t * _uffdw_pool = NULL;
+static __thread struct _uffdw_reader_t * _uffdw_reader = NULL;
+
+static struct _uffdw_priority_t _uffdw_priorities[UFFDW_PRIORITY_SLOTS];
+static pthread_mutex_t _uffdw_priorities_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* threads in the table, none is looked for while it's 0 */
+static size_t _Atomic _uffdw_prioritized = 0;
+
+/**
+ * Instance served by the reactor, as its events tell it. Handles are
+ * reused rather than freed, so an event that comes late finds no
+ * instance or another one, whose uffd is then read for nothing.
+ */
+struct _uffdw_handle_t {
+	struct uffdw_t * uffdw;
+	struct _uffdw_handle_t * next;
+};
+
+static pthread_mutex_t _uffdw_instances_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _uffdw_instances_cond = PTHREAD_COND_INITIALIZER;
+static struct uffdw_t * _uffdw_instances = NULL;
+/* handles of instances that are gone */
+static struct _uffdw_handle_t * _uffdw_free_handles = NULL;
+
+/**
+ * Threads serving all instances created by `uffdw_create_shared()` (and
+ * their forks), started with the first one.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	int epoll_fd;
+	pthread_t threads[UFFDW_REACTOR_THREADS];
+	struct _uffdw_reader_t readers[UFFDW_REACTOR_THREADS];
+	/* forks of all instances to be set up, see `_uffdw_defer_fork()` -
+	 * started with the first instance of any kind */
+	int fork_pipe[2];
+	pthread_t fork_thread;
+} _uffdw_reactor = {PTHREAD_MUTEX_INITIALIZER, -1, {0}, {{0}}, {-1, -1}, 0};
+
+struct _uffdw_fork_t {
+	struct uffdw_t * parent;
+	int uffd;
+	/* parent's table at the time of fork, with a reference of its own */
+	struct uffdw_range_t * ranges;
+	/* and pages that were there, copied for the child */
+	struct _uffdw_residency_t * residency;
+};
+
+/* pages installed by this thread should come write-protected */
+static __thread bool _uffdw_copy_wp = false;
+/* pages installed by this thread are filled ahead, nobody waits for them */
+static __thread bool _uffdw_copy_dontwake = false;
+/* pages of zeroes copied in by this thread get the shared zero page */
+static __thread bool _uffdw_copy_zeroes = false;
+/* range whose handler runs in this thread, if it's cached */
+static __thread struct uffdw_range_t * _uffdw_capture = NULL;
+/* page size of range whose handler runs in this thread, 0 for base pages */
+static __thread size_t _uffdw_granule = 0;
+/* instance whose pages this thread fills, for their residency, and
+ * pages faulted on, which are never left out of a batch */
+static __thread struct uffdw_t * _uffdw_installing = NULL;
+static __thread size_t _uffdw_faulting = 0;
+static __thread size_t _uffdw_faulting_end = 0;
+/* counters of instance and of range whose faults this thread resolves */
+static __thread struct _uffdw_counters_t * _uffdw_counting = NULL;
+static __thread struct _uffdw_counters_t * _uffdw_range_counting = NULL;
+/* scratch memory of this thread, see `uffdw_scratch()` */
+static __thread void * _uffdw_scratch_map = NULL;
+static __thread size_t _uffdw_scratch_size = 0;
+static pthread_key_t _uffdw_scratch_key;
+static pthread_once_t _uffdw_scratch_once = PTHREAD_ONCE_INIT;
+/* statistics slot of this thread, taken on first use */
+static __thread size_t _uffdw_stats_slot = SIZE_MAX;
+static size_t _Atomic _uffdw_stats_slots_taken = 0;
+
+static void * _Atomic _uffdw_zeroes_map = NULL;
+
 static inline size_t _read_exact(int fd, void * buf, size_t size) {
 	off_t offset = 0;
 	while (size > 0) {
-		ssize_t read_result = read(fd, buf, size);
+		ssize_t read_result = read(fd, (char *)buf + offset, size);
 		if (read_result <= 0) return offset;
 		size -= read_result;
 		offset += read_result;
@@ -62,6 +745,18 @@ static inline size_t _read_exact(int fd, void * buf, size_t size) {
 	return offset;
 }
 
+static bool _uffdw_pread_all(int fd, void * buf, size_t size, size_t offset) {
+	while (size > 0) {
+		ssize_t got = pread(fd, buf, size, offset);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return false;
+		buf = (char *)buf + got;
+		size -= got;
+		offset += got;
+	}
+	return true;
+}
+
 static inline size_t _min(size_t a, size_t b) {
 	if (a <= b) return a;
 	return b;
@@ -72,6 +767,96 @@ static inline size_t _max(size_t a, size_t b) {
 	return b;
 }
 
+static void _uffdw_scratch_free(void * _) {
+	(void)_;
+	if (_uffdw_scratch_map != NULL && munmap(_uffdw_scratch_map, _uffdw_scratch_size) != 0) {
+		warn("failed to unmap scratch memory");
+	}
+	_uffdw_scratch_map = NULL;
+	_uffdw_scratch_size = 0;
+}
+
+static void _uffdw_scratch_key_create(void) {
+	if (pthread_key_create(&_uffdw_scratch_key, _uffdw_scratch_free) != 0) {
+		warnx("failed to create scratch memory key");
+	}
+}
+
+void * uffdw_scratch(size_t size) {
+	if (size <= _uffdw_scratch_size) return _uffdw_scratch_map;
+	pthread_once(&_uffdw_scratch_once, _uffdw_scratch_key_create);
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t map_size = (_max(size, UFFDW_SCRATCH_SIZE) + page_size - 1) / page_size * page_size;
+	void * map = mmap(
+		NULL, map_size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+		-1, 0
+	);
+	if (map == MAP_FAILED) {
+		warn("failed to map scratch memory");
+		return NULL;
+	}
+	_uffdw_scratch_free(NULL);
+	_uffdw_scratch_map = map;
+	_uffdw_scratch_size = map_size;
+	// it goes away with the thread
+	pthread_setspecific(_uffdw_scratch_key, map);
+	return map;
+}
+
+static void _uffdw_counters_init(struct _uffdw_counters_t * counters) {
+	atomic_init(&counters->faults, 0);
+	atomic_init(&counters->bytes_copied, 0);
+	atomic_init(&counters->bytes_zeroed, 0);
+	atomic_init(&counters->eexist, 0);
+	atomic_init(&counters->failures, 0);
+}
+
+static void _uffdw_counters_sum(struct uffdw_counters_t * sum, struct _uffdw_counters_t * counters) {
+	sum->faults += atomic_load_explicit(&counters->faults, memory_order_relaxed);
+	sum->bytes_copied += atomic_load_explicit(&counters->bytes_copied, memory_order_relaxed);
+	sum->bytes_zeroed += atomic_load_explicit(&counters->bytes_zeroed, memory_order_relaxed);
+	sum->eexist += atomic_load_explicit(&counters->eexist, memory_order_relaxed);
+	sum->failures += atomic_load_explicit(&counters->failures, memory_order_relaxed);
+}
+
+/**
+ * Add `n` to `field` of counters this thread counts to (see
+ * `_uffdw_counting`).
+ */
+#define _uffdw_count(field, n) do { \
+	if (_uffdw_counting != NULL) { \
+		atomic_fetch_add_explicit(&_uffdw_counting->field, (n), memory_order_relaxed); \
+	} \
+	if (_uffdw_range_counting != NULL) { \
+		atomic_fetch_add_explicit(&_uffdw_range_counting->field, (n), memory_order_relaxed); \
+	} \
+} while (0)
+
+/**
+ * Get statistics slot of the calling thread. Threads are spread over
+ * slots, so that they rarely share a cache line.
+ */
+static inline struct _uffdw_stats_slot_t * _uffdw_slot(struct uffdw_t * uffdw) {
+	if (_uffdw_stats_slot == SIZE_MAX) {
+		_uffdw_stats_slot = atomic_fetch_add(&_uffdw_stats_slots_taken, 1) % UFFDW_STATS_SLOTS;
+	}
+	return &uffdw->stats[_uffdw_stats_slot];
+}
+
+static inline uint64_t _uffdw_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void _uffdw_note_latency(struct uffdw_t * uffdw, uint64_t since, size_t faults) {
+	uint64_t ns = _uffdw_now() - since;
+	size_t bucket = ns == 0 ? 0 : _min(63 - __builtin_clzll(ns), UFFDW_LATENCY_BUCKETS - 1);
+	atomic_fetch_add_explicit(&_uffdw_slot(uffdw)->latency[bucket], faults, memory_order_relaxed);
+}
+
 static inline size_t _ranges_overlap(
 	size_t off_a, size_t end_a,
 	size_t off_b, size_t end_b,
@@ -88,427 +873,4695 @@ static inline size_t _ranges_overlap(
 	}
 }
 
-static inline struct uffdw_t * _uffdw_alloc(void) {
-	struct uffdw_t * uffdw = malloc(sizeof(struct uffdw_t));
-	if (uffdw == NULL) return NULL;
-
-	uffdw->uffd = -1;
-	// TODO uffdw->thread
-	uffdw->children = NULL;
-	uffdw->ranges = NULL;
-	if (pthread_mutex_init(&uffdw->mutex, NULL) != 0) {
-		free(uffdw);
-		return NULL;
-	}
-
-	return uffdw;
+static inline size_t _hash(size_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
 }
 
-static void _uffdw_cleanup(struct uffdw_t * data) {
-	if (data == NULL) return;
+static void _uffdw_rcu_register_thread(struct _uffdw_reader_t * reader) {
+	atomic_init(&reader->epoch, 0);
 
-	// cancel all children
-	struct uffdw_t * child = data->children;
-	while (child != NULL) {
-		struct uffdw_t * next = child->next;
-		uffdw_cancel(child);
-		child = next;
-	}
-	data->children = NULL;
+	pthread_mutex_lock(&_uffdw_rcu_mutex);
+	reader->next = _uffdw_readers;
+	_uffdw_readers = reader;
+	pthread_mutex_unlock(&_uffdw_rcu_mutex);
 
-	// close uffd
-	if (data->uffd >= 0) {
-		if (close(data->uffd) != 0) {
-			warn("there was a problem during closing userfaultfd descriptor");
-		}
-	}
-	data->uffd = -1;
+	_uffdw_reader = reader;
+}
 
-	// free ranges
-	struct uffdw_range_t * range = data->ranges;
-	while (range != NULL) {
-		struct uffdw_range_t * next = range->next;
-		free(range);
-		range = next;
-	}
+/**
+ * Set up thread that runs handlers: it looks up ranges, and its scratch
+ * memory is there before the first fault.
+ */
+static void _uffdw_handler_thread_init(struct _uffdw_reader_t * reader) {
+	_uffdw_rcu_register_thread(reader);
+	uffdw_scratch(UFFDW_SCRATCH_SIZE);
+}
 
-	// free mutex
-	if (pthread_mutex_destroy(&data->mutex) != 0) warnx("failed to destroy mutex");
+static void _uffdw_rcu_unregister_thread(void) {
+	pthread_mutex_lock(&_uffdw_rcu_mutex);
+	struct _uffdw_reader_t * * reader = &_uffdw_readers;
+	while (*reader != _uffdw_reader) reader = &((*reader)->next);
+	*reader = _uffdw_reader->next;
+	pthread_mutex_unlock(&_uffdw_rcu_mutex);
 
-	free(data);
+	_uffdw_reader = NULL;
 }
 
-static inline void _uffdw_attach_child(struct uffdw_t * parent, struct uffdw_t * child) {
-	assert(child->next == NULL);
-	child->next = parent->children;
-	parent->children = child;
+static inline void _uffdw_rcu_read_lock(void) {
+	atomic_store(&_uffdw_reader->epoch, atomic_load(&_uffdw_epoch));
 }
 
-static inline struct uffdw_range_t * _uffdw_get_range(
-	struct uffdw_t * uffdw, size_t offset, size_t end
-) {
-	for (
-		struct uffdw_range_t * range = uffdw->ranges;
-		range != NULL;
-		range = range->next
-	) {
-		if ((_ranges_overlap(range->offset, range->end, offset, end, NULL, NULL)) > 0) {
-			return range;
-		}
-	}
-	return NULL;
+static inline void _uffdw_rcu_read_unlock(void) {
+	atomic_store(&_uffdw_reader->epoch, 0);
 }
 
-static inline bool _uffdw_add_range(
-	struct uffdw_t * uffdw,
-	size_t offset, size_t end, size_t handler_offset,
-	uffdw_handler_t handler, void * private_data
-) {
-	assert(offset <= end);
-	if (end == offset) return true;
-	assert(_uffdw_get_range(uffdw, offset, end) == NULL);
-
-	struct uffdw_range_t * range = malloc(sizeof(struct uffdw_range_t));
-	if (range == NULL) return false;
-
-	range->offset = offset;
-	range->end = end;
-	range->handler_offset = handler_offset;
-	range->handler = handler;
-	range->handler_data = private_data;
-	range->next = uffdw->ranges;
-	uffdw->ranges = range;
-
-	return true;
+/**
+ * Return node to the pool, chunks are never unmapped.
+ */
+static inline void _uffdw_range_free(struct uffdw_range_t * range) {
+	pthread_mutex_lock(&_uffdw_pool_mutex);
+	range->next = _uffdw_pool;
+	_uffdw_pool = range;
+	pthread_mutex_unlock(&_uffdw_pool_mutex);
 }
 
-static inline void _uffdw_remove_range(
-	struct uffdw_t * uffdw, size_t offset, size_t end
-) {
-	struct uffdw_range_t * * range_p = &(uffdw->ranges);
-	while (*range_p != NULL) {
-		struct uffdw_range_t * range  = *range_p;
-		size_t o, e;
-		size_t s = _ranges_overlap(range->offset, range->end, offset, end, &o, &e);
-		if (s > 0) {
-			// unlink previous range
-			*range_p = range->next;
-			range->next = NULL;
-
-			// add split ranges
-			if (
-				!_uffdw_add_range(
-					uffdw,
-					range->offset, o, range->handler_offset,
-					range->handler, range->handler_data
-				) ||
-				!_uffdw_add_range(
-					uffdw,
-					e, range->end, range->handler_offset - range->offset + e,
-					range->handler, range->handler_data
-				)
-			) warnx("failed to add split ranges");
+/**
+ * Free retired nodes no reader can see anymore. Must be called with
+ * `_uffdw_rcu_mutex` held.
+ */
+static void _uffdw_rcu_reclaim(void) {
+	size_t oldest = SIZE_MAX;
+	for (struct _uffdw_reader_t * r = _uffdw_readers; r != NULL; r = r->next) {
+		size_t epoch = atomic_load(&r->epoch);
+		if (epoch != 0 && epoch < oldest) oldest = epoch;
+	}
 
-			free(range);
+	struct uffdw_range_t * * item = &_uffdw_retired;
+	while (*item != NULL) {
+		struct uffdw_range_t * i = *item;
+		if (i->epoch <= oldest) {
+			*item = i->next;
+			_uffdw_range_free(i);
 		} else {
-			range_p = &(range->next);
+			item = &(i->next);
 		}
 	}
 }
 
-static void * _uffdw_run(void * _uffdw) {
-	struct uffdw_t * uffdw = _uffdw;
-
-	while (true) {
-		struct uffd_msg msg;
-		if (read(uffdw->uffd, &msg, sizeof(msg)) != sizeof(msg)) {
-			if (DEBUG) perror("failed to read uffd message");
+/**
+ * Get a node from the pool, mapping more of them if it's empty. Nodes
+ * are changed while handling events, which a `fork()` holding malloc
+ * locks may be waiting for, so they never come from malloc.
+ */
+static struct uffdw_range_t * _uffdw_pool_take(void) {
+	pthread_mutex_lock(&_uffdw_pool_mutex);
+	if (_uffdw_pool == NULL) {
+		struct uffdw_range_t * chunk = mmap(
+			NULL, UFFDW_POOL_CHUNK,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0
+		);
+		if (chunk == MAP_FAILED) {
+			pthread_mutex_unlock(&_uffdw_pool_mutex);
 			return NULL;
 		}
-
-		bool flag_write;
-		struct uffdw_t * new_uffdw;
-
-		if (pthread_mutex_lock(&uffdw->mutex) != 0) {
-			warnx("failed to acquire lock");
-			return NULL;
+		for (size_t i = 0; i < UFFDW_POOL_CHUNK / sizeof(struct uffdw_range_t); i ++) {
+			chunk[i].next = _uffdw_pool;
+			_uffdw_pool = &chunk[i];
 		}
+	}
+	struct uffdw_range_t * range = _uffdw_pool;
+	_uffdw_pool = range->next;
+	pthread_mutex_unlock(&_uffdw_pool_mutex);
+	return range;
+}
 
-		switch (msg.event) {
-			case UFFD_EVENT_PAGEFAULT: {
-				flag_write = (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0;
-				LOG("uffd %d: got PAGEFAULT (%p, FLAG_WRITE=%d)", uffdw->uffd, (void *)msg.arg.pagefault.address, flag_write);
-				if (flag_write) {
-					LOG("error: write faults are not supported");
-					pthread_mutex_unlock(&uffdw->mutex);
-					return NULL;
-				}
+/**
+ * Make sure that `count` nodes can be allocated by writer of `uffdw`,
+ * so that a change of the table is either made whole or not at all.
+ * Must be called with `uffdw->mutex` held.
+ */
+static bool _uffdw_range_reserve(struct uffdw_t * uffdw, size_t count) {
+	while (uffdw->spare_count < count) {
+		struct uffdw_range_t * range = _uffdw_pool_take();
+		if (range == NULL) {
+			warn("failed to map range nodes");
+			return false;
+		}
+		range->next = uffdw->spare;
+		uffdw->spare = range;
+		uffdw->spare_count ++;
+	}
+	return true;
+}
+
+/**
+ * Get a node, one of those reserved if there are any.
+ */
+static struct uffdw_range_t * _uffdw_range_alloc(struct uffdw_t * uffdw) {
+	struct uffdw_range_t * range = uffdw->spare;
+	if (range != NULL) {
+		uffdw->spare = range->next;
+		uffdw->spare_count --;
+	} else if ((range = _uffdw_pool_take()) == NULL) {
+		return NULL;
+	}
+
+	range->gen = uffdw->gen;
+	atomic_init(&range->refs, 1);
+	range->next = NULL;
+	return range;
+}
+
+static inline void _uffdw_range_ref(struct uffdw_range_t * range) {
+	if (range != NULL) atomic_fetch_add(&range->refs, 1);
+}
+
+/**
+ * Get rid of a node that is no longer in the table. Nodes that could
+ * have been seen by readers wait for next publish.
+ */
+static void _uffdw_range_drop(struct uffdw_t * uffdw, struct uffdw_range_t * range) {
+	if (range->gen == uffdw->gen) {
+		_uffdw_range_free(range);
+		return;
+	}
+	range->next = uffdw->retired;
+	uffdw->retired = range;
+}
+
+/**
+ * Drop reference to `node`, and the node itself along with references
+ * to its children if it was the last one. Must be called with
+ * `uffdw->mutex` held.
+ */
+static void _uffdw_range_unref(struct uffdw_t * uffdw, struct uffdw_range_t * node) {
+	if (node == NULL || atomic_fetch_sub(&node->refs, 1) > 1) return;
+	_uffdw_range_unref(uffdw, node->left);
+	_uffdw_range_unref(uffdw, node->right);
+	_uffdw_range_drop(uffdw, node);
+}
+
+/**
+ * Get modifiable version of `node`, copying it if readers could see it.
+ * Parent of `node` must be modifiable already, so that a node only this
+ * table points to is told by its single reference. Nodes for the copies
+ * must be reserved (see `_uffdw_range_path()`).
+ */
+static struct uffdw_range_t * _uffdw_range_mut(
+	struct uffdw_t * uffdw, struct uffdw_range_t * node
+) {
+	if (node->gen == uffdw->gen) return node;
+	struct uffdw_range_t * copy = _uffdw_range_alloc(uffdw);
+	assert(copy != NULL);
+	*copy = *node;
+	copy->gen = uffdw->gen;
+	copy->next = NULL;
+	atomic_init(&copy->refs, 1);
+	if (atomic_load(&node->refs) == 1) {
+		// children move over to the copy
+		_uffdw_range_drop(uffdw, node);
+	} else {
+		_uffdw_range_ref(copy->left);
+		_uffdw_range_ref(copy->right);
+		_uffdw_range_unref(uffdw, node);
+	}
+	return copy;
+}
+
+/**
+ * Get number of nodes on the path that splits treap `node` at `key`.
+ * Those are the nodes the split copies, and joining the parts back
+ * copies no others. Taking ranges out never makes the path longer.
+ */
+static size_t _uffdw_range_path(struct uffdw_range_t * node, size_t key) {
+	size_t count = 0;
+	for (; node != NULL; node = node->offset < key ? node->right : node->left) count ++;
+	return count;
+}
+
+/**
+ * Split treap `node` into ranges starting below `key` (`*l`) and the
+ * rest (`*r`).
+ */
+static void _uffdw_range_split(
+	struct uffdw_t * uffdw,
+	struct uffdw_range_t * node, size_t key,
+	struct uffdw_range_t * * l, struct uffdw_range_t * * r
+) {
+	if (node == NULL) {
+		*l = NULL;
+		*r = NULL;
+		return;
+	}
+	node = _uffdw_range_mut(uffdw, node);
+	if (node->offset < key) {
+		_uffdw_range_split(uffdw, node->right, key, &(node->right), r);
+		*l = node;
+	} else {
+		_uffdw_range_split(uffdw, node->left, key, l, &(node->left));
+		*r = node;
+	}
+}
+
+/**
+ * Join two treaps. All ranges in `a` must lie below all ranges in `b`.
+ */
+static struct uffdw_range_t * _uffdw_range_join(
+	struct uffdw_t * uffdw,
+	struct uffdw_range_t * a, struct uffdw_range_t * b
+) {
+	if (a == NULL) return b;
+	if (b == NULL) return a;
+	if (a->priority > b->priority) {
+		a = _uffdw_range_mut(uffdw, a);
+		a->right = _uffdw_range_join(uffdw, a->right, b);
+		return a;
+	} else {
+		b = _uffdw_range_mut(uffdw, b);
+		b->left = _uffdw_range_join(uffdw, a, b->left);
+		return b;
+	}
+}
+
+static struct _uffdw_residency_t * _uffdw_residency_create(void) {
+	// mapped, so that forks can copy it while reading events (see `_uffdw_defer_fork()`)
+	void * residency = mmap(
+		NULL, sizeof(struct _uffdw_residency_t),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (residency == MAP_FAILED) {
+		warn("failed to map residency table");
+		return NULL;
+	}
+	return residency;
+}
+
+static void _uffdw_residency_destroy(struct _uffdw_residency_t * residency) {
+	if (residency == NULL) return;
+	for (size_t i = 0; i < UFFDW_RESIDENCY_SLOTS; i ++) {
+		struct _uffdw_residency_block_t * block = atomic_load(&residency->blocks[i]);
+		if (block != NULL) munmap(block, sizeof(struct _uffdw_residency_block_t));
+	}
+	munmap(residency, sizeof(struct _uffdw_residency_t));
+}
+
+/**
+ * Get block number `n` of `residency`, mapping it if there is none and
+ * `create` is set. NULL if there is none, or it can't be added.
+ */
+static struct _uffdw_residency_block_t * _uffdw_residency_block(
+	struct _uffdw_residency_t * residency, size_t n, bool create
+) {
+	if (residency == NULL) return NULL;
+	size_t h = _hash(n);
+	struct _uffdw_residency_block_t * created = NULL;
+	for (size_t i = 0; i < UFFDW_RESIDENCY_PROBES; i ++) {
+		struct _uffdw_residency_block_t * _Atomic * slot = &residency->blocks[(h + i) % UFFDW_RESIDENCY_SLOTS];
+		struct _uffdw_residency_block_t * found = atomic_load(slot);
+		if (found == NULL) {
+			// blocks are never taken out, so it isn't any further
+			if (!create) return NULL;
+			if (created == NULL) {
+				created = mmap(
+					NULL, sizeof(struct _uffdw_residency_block_t),
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+					-1, 0
+				);
+				if (created == MAP_FAILED) return NULL;
+				created->block = n;
+			}
+			if (atomic_compare_exchange_strong(slot, &found, created)) return created;
+		}
+		if (found->block == n) {
+			if (created != NULL) munmap(created, sizeof(struct _uffdw_residency_block_t));
+			return found;
+		}
+	}
+	if (created != NULL) munmap(created, sizeof(struct _uffdw_residency_block_t));
+	return NULL;
+}
+
+/**
+ * Copy `residency` for a forked process. NULL if it can't be mapped.
+ */
+static struct _uffdw_residency_t * _uffdw_residency_clone(struct _uffdw_residency_t * residency) {
+	if (residency == NULL) return NULL;
+	struct _uffdw_residency_t * copy = _uffdw_residency_create();
+	if (copy == NULL) return NULL;
+	for (size_t i = 0; i < UFFDW_RESIDENCY_SLOTS; i ++) {
+		struct _uffdw_residency_block_t * block = atomic_load(&residency->blocks[i]);
+		if (block == NULL) continue;
+		struct _uffdw_residency_block_t * block_copy = mmap(
+			NULL, sizeof(struct _uffdw_residency_block_t),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0
+		);
+		if (block_copy == MAP_FAILED) {
+			_uffdw_residency_destroy(copy);
+			return NULL;
+		}
+		// same slot, blocks are looked for in the same order
+		block_copy->block = block->block;
+		for (size_t w = 0; w < UFFDW_RESIDENCY_WORDS; w ++) {
+			atomic_init(&block_copy->bits[w], atomic_load(&block->bits[w]));
+		}
+		atomic_store(&copy->blocks[i], block_copy);
+	}
+	return copy;
+}
+
+/**
+ * Set or clear residency bits of base pages from `offset` to `end`.
+ */
+static void _uffdw_residency_update(struct uffdw_t * uffdw, size_t offset, size_t end, bool set) {
+	size_t pagesize = uffdw->pagesize;
+	size_t page = offset / pagesize;
+	size_t end_page = (end + pagesize - 1) / pagesize;
+	while (page < end_page) {
+		size_t stop = _min(end_page, (page / UFFDW_RESIDENCY_PAGES + 1) * UFFDW_RESIDENCY_PAGES);
+		struct _uffdw_residency_block_t * block = _uffdw_residency_block(uffdw->residency, page / UFFDW_RESIDENCY_PAGES, set);
+		for (; block != NULL && page < stop; page = (page / 64 + 1) * 64) {
+			size_t bits = _min(64 - page % 64, stop - page);
+			uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << (page % 64);
+			uint64_t _Atomic * word = &block->bits[page % UFFDW_RESIDENCY_PAGES / 64];
+			// pages are mostly filled once, the line isn't written to when they are already set
+			if (set && (atomic_load(word) & mask) != mask) atomic_fetch_or(word, mask);
+			if (!set && (atomic_load(word) & mask) != 0) atomic_fetch_and(word, ~mask);
+		}
+		page = stop;
+	}
+}
+
+/**
+ * Get address of first base page from `offset` to `end` whose residency
+ * bit is `set`, or `end` if there is none. Bits are scanned a word at a
+ * time, blocks that aren't there at once.
+ */
+static size_t _uffdw_residency_find(struct uffdw_t * uffdw, size_t offset, size_t end, bool set) {
+	size_t pagesize = uffdw->pagesize;
+	size_t page = offset / pagesize;
+	size_t end_page = (end + pagesize - 1) / pagesize;
+	while (page < end_page) {
+		size_t stop = _min(end_page, (page / UFFDW_RESIDENCY_PAGES + 1) * UFFDW_RESIDENCY_PAGES);
+		struct _uffdw_residency_block_t * block = _uffdw_residency_block(uffdw->residency, page / UFFDW_RESIDENCY_PAGES, false);
+		if (block == NULL) {
+			if (!set) break;
+			page = stop;
+			continue;
+		}
+		for (; page < stop; page = (page / 64 + 1) * 64) {
+			uint64_t word = atomic_load(&block->bits[page % UFFDW_RESIDENCY_PAGES / 64]);
+			if (!set) word = ~word;
+			word &= ~0ULL << (page % 64);
+			if (word != 0) return _max(offset, _min((page / 64 * 64 + __builtin_ctzll(word)) * pagesize, end));
+		}
+	}
+	return _max(offset, _min(page * pagesize, end));
+}
+
+/**
+ * Get number of base pages from `offset` to `end` whose residency bit
+ * is set.
+ */
+static size_t _uffdw_residency_count(struct uffdw_t * uffdw, size_t offset, size_t end) {
+	size_t pagesize = uffdw->pagesize;
+	size_t page = offset / pagesize;
+	size_t end_page = (end + pagesize - 1) / pagesize;
+	size_t count = 0;
+	while (page < end_page) {
+		size_t stop = _min(end_page, (page / UFFDW_RESIDENCY_PAGES + 1) * UFFDW_RESIDENCY_PAGES);
+		struct _uffdw_residency_block_t * block = _uffdw_residency_block(uffdw->residency, page / UFFDW_RESIDENCY_PAGES, false);
+		for (; block != NULL && page < stop; page = (page / 64 + 1) * 64) {
+			size_t bits = _min(64 - page % 64, stop - page);
+			uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << (page % 64);
+			count += __builtin_popcountll(atomic_load(&block->bits[page % UFFDW_RESIDENCY_PAGES / 64]) & mask);
+		}
+		page = stop;
+	}
+	return count;
+}
+
+/**
+ * Carry residency bits of `size` bytes from `from` over to `to`, which
+ * don't overlap, as pages are moved by `mremap()`.
+ */
+static void _uffdw_residency_move(struct uffdw_t * uffdw, size_t from, size_t to, size_t size) {
+	_uffdw_residency_update(uffdw, to, to + size, false);
+	size_t at = from;
+	while ((at = _uffdw_residency_find(uffdw, at, from + size, true)) < from + size) {
+		size_t run_end = _uffdw_residency_find(uffdw, at, from + size, false);
+		_uffdw_residency_update(uffdw, at - from + to, run_end - from + to, true);
+		at = run_end;
+	}
+	_uffdw_residency_update(uffdw, from, from + size, false);
+}
+
+/**
+ * Set residency bits of pages from `offset` to `end` that are there
+ * already, as `mincore()` tells. It goes by base pages, larger ones of
+ * `pagesize` are told by their first one.
+ */
+static void _uffdw_residency_seed(struct uffdw_t * uffdw, size_t offset, size_t end, size_t pagesize) {
+	bool base = pagesize == (size_t)uffdw->pagesize;
+	unsigned char present[UFFDW_READAHEAD_MAX];
+	size_t step = base ? UFFDW_READAHEAD_MAX * pagesize : pagesize;
+	for (size_t at = offset; at < end; at += step) {
+		size_t pages = base ? _min(step, end - at) / pagesize : 1;
+		if (mincore((void *)at, base ? pages * pagesize : (size_t)uffdw->pagesize, present) != 0) continue;
+		for (size_t i = 0; i < pages;) {
+			size_t j = i;
+			while (j < pages && (present[j] & 1)) j ++;
+			if (j > i) _uffdw_residency_update(uffdw, at + i * pagesize, at + j * pagesize, true);
+			i = j + 1;
+		}
+	}
+}
+
+static inline struct uffdw_t * _uffdw_alloc(void) {
+	// statistics slots are aligned to cache lines
+	struct uffdw_t * uffdw = aligned_alloc(_Alignof(struct uffdw_t), sizeof(struct uffdw_t));
+	if (uffdw == NULL) return NULL;
+
+	uffdw->uffd = -1;
+	uffdw->features = 0;
+	uffdw->stop_fd = -1;
+	uffdw->thread_count = 0;
+	uffdw->threads = NULL;
+	uffdw->children = NULL;
+	uffdw->next = NULL;
+	uffdw->sources = NULL;
+	uffdw->dirty = NULL;
+	atomic_init(&uffdw->dirty_count, 0);
+	uffdw->ranges = NULL;
+	atomic_init(&uffdw->published, NULL);
+	atomic_init(&uffdw->publishes, 0);
+	uffdw->gen = 0;
+	uffdw->retired = NULL;
+	uffdw->spare = NULL;
+	uffdw->spare_count = 0;
+	uffdw->residency = NULL;
+	for (size_t i = 0; i < UFFDW_STREAMS; i ++) {
+		atomic_init(&uffdw->streams[i].next, 0);
+		atomic_init(&uffdw->streams[i].window, 0);
+	}
+	atomic_init(&uffdw->stream_victim, 0);
+	for (size_t i = 0; i < UFFDW_PENDING_SLOTS; i ++) {
+		atomic_init(&uffdw->pending[i], 0);
+	}
+	for (size_t i = 0; i < UFFDW_STATS_SLOTS; i ++) {
+		_uffdw_counters_init(&uffdw->stats[i].counters);
+		for (size_t b = 0; b < UFFDW_LATENCY_BUCKETS; b ++) {
+			atomic_init(&uffdw->stats[i].latency[b], 0);
+		}
+	}
+	uffdw->forks = 0;
+	uffdw->remaps = 0;
+	uffdw->removes = 0;
+	uffdw->unmaps = 0;
+	uffdw->registrations = 0;
+	uffdw->trace = NULL;
+	uffdw->replay = NULL;
+	uffdw->prefetcher = NULL;
+	atomic_init(&uffdw->demand, 0);
+	uffdw->forked = false;
+	atomic_init(&uffdw->canceling, false);
+	uffdw->next_instance = NULL;
+	uffdw->busy = 0;
+	uffdw->handle = NULL;
+	if (pthread_mutex_init(&uffdw->mutex, NULL) != 0) {
+		free(uffdw);
+		return NULL;
+	}
+	if (pthread_mutex_init(&uffdw->read_mutex, NULL) != 0) {
+		pthread_mutex_destroy(&uffdw->mutex);
+		free(uffdw);
+		return NULL;
+	}
+	if (pthread_mutex_init(&uffdw->dirty_mutex, NULL) != 0) {
+		pthread_mutex_destroy(&uffdw->read_mutex);
+		pthread_mutex_destroy(&uffdw->mutex);
+		free(uffdw);
+		return NULL;
+	}
+
+	return uffdw;
+}
+
+static void _uffdw_publish(struct uffdw_t * uffdw);
+
+/**
+ * Take `uffdw` off running instances, once it's canceled or its uffd is
+ * done for. Events that are still on their way find nothing.
+ */
+static void _uffdw_unlist(struct uffdw_t * uffdw) {
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	struct uffdw_t * * instance = &_uffdw_instances;
+	while (*instance != NULL && *instance != uffdw) instance = &((*instance)->next_instance);
+	if (*instance != NULL) *instance = uffdw->next_instance;
+	struct _uffdw_handle_t * handle = uffdw->handle;
+	if (handle != NULL) {
+		handle->uffdw = NULL;
+		handle->next = _uffdw_free_handles;
+		_uffdw_free_handles = handle;
+		uffdw->handle = NULL;
+	}
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+}
+
+static void _uffdw_cleanup(struct uffdw_t * data) {
+	if (data == NULL) return;
+
+	// nobody can complete faults from now on
+	_uffdw_unlist(data);
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	while (data->busy > 0) pthread_cond_wait(&_uffdw_instances_cond, &_uffdw_instances_mutex);
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+
+	// cancel all children
+	struct uffdw_t * child = data->children;
+	while (child != NULL) {
+		struct uffdw_t * next = child->next;
+		uffdw_cancel(child);
+		child = next;
+	}
+	data->children = NULL;
+
+	// close uffd
+	if (data->uffd >= 0) {
+		if (close(data->uffd) != 0) {
+			warn("there was a problem during closing userfaultfd descriptor");
+		}
+	}
+	data->uffd = -1;
+	if (data->stop_fd >= 0) close(data->stop_fd);
+	data->stop_fd = -1;
+
+	// threads reading ranges are gone by now, but those of other
+	// processes' tables may still look at nodes that were shared
+	_uffdw_range_unref(data, data->ranges);
+	data->ranges = NULL;
+	_uffdw_publish(data);
+	while (data->spare != NULL) {
+		struct uffdw_range_t * next = data->spare->next;
+		_uffdw_range_free(data->spare);
+		data->spare = next;
+	}
+
+	free(data->threads);
+	data->threads = NULL;
+
+	_uffdw_residency_destroy(data->residency);
+	data->residency = NULL;
+
+	while (data->dirty != NULL) {
+		struct _uffdw_dirty_t * next = data->dirty->next;
+		free(data->dirty->bits);
+		free(data->dirty);
+		data->dirty = next;
+	}
+
+	// free sources, nothing refers to them anymore
+	while (data->sources != NULL) {
+		struct _uffdw_source_t * next = data->sources->next;
+		data->sources->destroy(data->sources);
+		data->sources = next;
+	}
+
+	// free mutexes
+	if (pthread_mutex_destroy(&data->mutex) != 0) warnx("failed to destroy mutex");
+	if (pthread_mutex_destroy(&data->read_mutex) != 0) warnx("failed to destroy mutex");
+	if (pthread_mutex_destroy(&data->dirty_mutex) != 0) warnx("failed to destroy mutex");
+
+	free(data);
+}
+
+static inline void _uffdw_attach_child(struct uffdw_t * parent, struct uffdw_t * child) {
+	assert(child->next == NULL);
+	child->next = parent->children;
+	parent->children = child;
+}
+
+/**
+ * Start modifying range table. Must be called with `uffdw->mutex` held.
+ */
+static inline void _uffdw_write_begin(struct uffdw_t * uffdw) {
+	uffdw->gen = atomic_fetch_add(&_uffdw_gen, 1);
+}
+
+/**
+ * Make modified range table visible to readers and get rid of what
+ * they can't see anymore.
+ */
+static void _uffdw_publish(struct uffdw_t * uffdw) {
+	atomic_store(&uffdw->published, uffdw->ranges);
+	atomic_fetch_add(&uffdw->publishes, 1);
+	uffdw->gen = 0;
+	size_t epoch = atomic_fetch_add(&_uffdw_epoch, 1) + 1;
+
+	pthread_mutex_lock(&_uffdw_rcu_mutex);
+	while (uffdw->retired != NULL) {
+		struct uffdw_range_t * next = uffdw->retired->next;
+		uffdw->retired->epoch = epoch;
+		uffdw->retired->next = _uffdw_retired;
+		_uffdw_retired = uffdw->retired;
+		uffdw->retired = next;
+	}
+	_uffdw_rcu_reclaim();
+	pthread_mutex_unlock(&_uffdw_rcu_mutex);
+}
+
+/**
+ * Get lowest range ending above `offset`, starting the search at `node`.
+ */
+static inline struct uffdw_range_t * _uffdw_range_find(
+	struct uffdw_range_t * node, size_t offset
+) {
+	// ranges are disjoint, so their ends are sorted just like their offsets
+	struct uffdw_range_t * found = NULL;
+	while (node != NULL) {
+		if (node->end > offset) {
+			found = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return found;
+}
+
+/**
+ * Get first (lowest) range overlapping `offset` - `end`. Writers only.
+ */
+static inline struct uffdw_range_t * _uffdw_get_range(
+	struct uffdw_t * uffdw, size_t offset, size_t end
+) {
+	struct uffdw_range_t * found = _uffdw_range_find(uffdw->ranges, offset);
+	if (found != NULL && found->offset < end && offset < end) return found;
+	return NULL;
+}
+
+/**
+ * Copy range containing `addr` into `range`. Doesn't take any locks, so
+ * it's safe to use on the fault path.
+ */
+static inline bool _uffdw_lookup(
+	struct uffdw_t * uffdw, size_t addr, struct uffdw_range_t * range
+) {
+	_uffdw_rcu_read_lock();
+	struct uffdw_range_t * found = _uffdw_range_find(atomic_load(&uffdw->published), addr);
+	bool ok = found != NULL && found->offset <= addr;
+	if (ok) *range = *found;
+	_uffdw_rcu_read_unlock();
+	return ok;
+}
+
+/**
+ * Insert `range`, which is modifiable. Needs `_uffdw_insert_cost()`
+ * nodes reserved.
+ */
+static inline void _uffdw_insert_range(struct uffdw_t * uffdw, struct uffdw_range_t * range) {
+	struct uffdw_range_t * l, * r;
+	range->priority = _hash(range->offset);
+	range->left = NULL;
+	range->right = NULL;
+	_uffdw_range_split(uffdw, uffdw->ranges, range->offset, &l, &r);
+	uffdw->ranges = _uffdw_range_join(uffdw, _uffdw_range_join(uffdw, l, range), r);
+}
+
+static inline size_t _uffdw_insert_cost(struct uffdw_t * uffdw, size_t offset) {
+	// a range inserted before may make the path longer by one
+	return _uffdw_range_path(uffdw->ranges, offset) + 1;
+}
+
+/**
+ * Take `range` out of the table. Returned node is a modifiable version
+ * of it. Needs `_uffdw_detach_cost()` nodes reserved.
+ */
+static inline struct uffdw_range_t * _uffdw_detach_range(
+	struct uffdw_t * uffdw, struct uffdw_range_t * range
+) {
+	struct uffdw_range_t * l, * m, * r;
+	_uffdw_range_split(uffdw, uffdw->ranges, range->offset, &l, &m);
+	_uffdw_range_split(uffdw, m, range->offset + 1, &m, &r);
+	assert(m != NULL && m->offset == range->offset && m->left == NULL && m->right == NULL);
+	uffdw->ranges = _uffdw_range_join(uffdw, l, r);
+	return m;
+}
+
+static inline size_t _uffdw_detach_cost(struct uffdw_t * uffdw, struct uffdw_range_t * range) {
+	return _uffdw_range_path(uffdw->ranges, range->offset) + _uffdw_range_path(uffdw->ranges, range->offset + 1);
+}
+
+/**
+ * Ranges `a` and `b` can be merged if `b` continues `a` both in address
+ * space and in handler space.
+ */
+static inline bool _uffdw_ranges_mergeable(
+	struct uffdw_range_t * a, struct uffdw_range_t * b
+) {
+	return (
+		a->end == b->offset &&
+		a->handler == b->handler &&
+		a->handler_data == b->handler_data &&
+		a->handler_offset + (a->end - a->offset) == b->handler_offset &&
+		a->options.readahead == b->options.readahead &&
+		a->options.readahead_adaptive == b->options.readahead_adaptive &&
+		a->options.cache == b->options.cache &&
+		a->options.budget == b->options.budget &&
+		a->options.pagesize == b->options.pagesize &&
+		a->options.detect_zeroes == b->options.detect_zeroes &&
+		a->counters == b->counters &&
+		a->registration == b->registration
+	);
+}
+
+/**
+ * Add range `offset` - `end` handled the same way as `like` is. The
+ * table is left as it was if it fails.
+ */
+static inline bool _uffdw_add_range(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t end, size_t handler_offset,
+	const struct uffdw_range_t * like
+) {
+	assert(offset <= end);
+	if (end == offset) return true;
+	assert(_uffdw_get_range(uffdw, offset, end) == NULL);
+
+	struct uffdw_range_t wanted = *like;
+	wanted.offset = offset;
+	wanted.end = end;
+	wanted.handler_offset = handler_offset;
+
+	// merge with neighbours, all nodes needed are taken upfront
+	struct uffdw_range_t * prev = offset > 0 ? _uffdw_get_range(uffdw, offset - 1, offset) : NULL;
+	if (prev != NULL && !_uffdw_ranges_mergeable(prev, &wanted)) prev = NULL;
+	struct uffdw_range_t * next = _uffdw_get_range(uffdw, end, end + 1);
+	if (next != NULL && !_uffdw_ranges_mergeable(&wanted, next)) next = NULL;
+	size_t nodes = 1 + _uffdw_insert_cost(uffdw, prev != NULL ? prev->offset : offset);
+	if (prev != NULL) nodes += _uffdw_detach_cost(uffdw, prev);
+	if (next != NULL) nodes += _uffdw_detach_cost(uffdw, next);
+	if (!_uffdw_range_reserve(uffdw, nodes)) return false;
+
+	struct uffdw_range_t * range = _uffdw_range_alloc(uffdw);
+	range->offset = offset;
+	range->end = end;
+	range->handler_offset = handler_offset;
+	range->handler = like->handler;
+	range->handler_data = like->handler_data;
+	range->options = like->options;
+	range->counters = like->counters;
+	range->registration = like->registration;
+
+	if (prev != NULL) {
+		prev = _uffdw_detach_range(uffdw, prev);
+		range->offset = prev->offset;
+		range->handler_offset = prev->handler_offset;
+		_uffdw_range_drop(uffdw, prev);
+	}
+	if (next != NULL) {
+		// it may have been copied by the detach above
+		next = _uffdw_detach_range(uffdw, _uffdw_get_range(uffdw, end, end + 1));
+		range->end = next->end;
+		_uffdw_range_drop(uffdw, next);
+	}
+
+	_uffdw_insert_range(uffdw, range);
+	return true;
+}
+
+/**
+ * Remove ranges from `offset` to `end`, cutting those that reach over.
+ * Ranges are removed one by one, so it may fail with some of them gone.
+ */
+static inline bool _uffdw_remove_range(
+	struct uffdw_t * uffdw, size_t offset, size_t end
+) {
+	struct uffdw_range_t * range;
+	while ((range = _uffdw_get_range(uffdw, offset, end)) != NULL) {
+		bool cut = range->offset < offset && range->end > end;
+		size_t nodes = _uffdw_detach_cost(uffdw, range) + _uffdw_insert_cost(uffdw, range->offset < offset ? range->offset : end);
+		if (cut) nodes += 1 + _uffdw_insert_cost(uffdw, end);
+		if (!_uffdw_range_reserve(uffdw, nodes)) return false;
+		range = _uffdw_detach_range(uffdw, range);
+
+		// keep split parts, reusing the node where possible
+		if (cut) {
+			struct uffdw_range_t * after = _uffdw_range_alloc(uffdw);
+			after->offset = end;
+			after->end = range->end;
+			after->handler_offset = range->handler_offset - range->offset + end;
+			after->handler = range->handler;
+			after->handler_data = range->handler_data;
+			after->options = range->options;
+			after->counters = range->counters;
+			after->registration = range->registration;
+			_uffdw_insert_range(uffdw, after);
+		} else if (range->end > end) {
+			range->handler_offset += end - range->offset;
+			range->offset = end;
+		}
+		if (range->offset < offset) {
+			range->end = _min(range->end, offset);
+			_uffdw_insert_range(uffdw, range);
+		} else if (range->offset >= end) {
+			_uffdw_insert_range(uffdw, range);
+		} else {
+			_uffdw_range_drop(uffdw, range);
+		}
+	}
+	return true;
+}
+
+/**
+ * Get running instance by its uffd and keep it from being freed until
+ * `_uffdw_release()`.
+ */
+static struct uffdw_t * _uffdw_acquire(int uffd) {
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	struct uffdw_t * uffdw = _uffdw_instances;
+	while (uffdw != NULL && uffdw->uffd != uffd) uffdw = uffdw->next_instance;
+	if (uffdw != NULL) uffdw->busy ++;
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+	return uffdw;
+}
+
+/**
+ * Like `_uffdw_acquire()`, but by handle the reactor got.
+ */
+static struct uffdw_t * _uffdw_acquire_handle(struct _uffdw_handle_t * handle) {
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	struct uffdw_t * uffdw = handle->uffdw;
+	if (uffdw != NULL) uffdw->busy ++;
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+	return uffdw;
+}
+
+static void _uffdw_release(struct uffdw_t * uffdw) {
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	if (-- uffdw->busy == 0) pthread_cond_broadcast(&_uffdw_instances_cond);
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+}
+
+static bool _uffdw_start(struct uffdw_t * uffdw, size_t threads);
+
+/**
+ * Get number of pages to resolve on fault at `address`. The window
+ * ends before first page that is known to be there.
+ */
+static size_t _uffdw_readahead(
+	struct uffdw_t * uffdw, struct uffdw_range_t * range, size_t address
+) {
+	size_t pagesize = range->options.pagesize;
+	size_t window = _min(range->options.readahead, (range->end - address) / pagesize);
+	if (window <= 1) return 1;
+
+	if (range->options.readahead_adaptive) {
+		// grow the window while faults come where previous windows ended
+		struct _uffdw_stream_t * stream = NULL;
+		for (size_t i = 0; i < UFFDW_STREAMS; i ++) {
+			if (atomic_load(&uffdw->streams[i].next) == address) {
+				stream = &uffdw->streams[i];
+				window = _min(window, atomic_load(&stream->window) * 2);
+				break;
+			}
+		}
+		if (stream == NULL) {
+			stream = &uffdw->streams[atomic_fetch_add(&uffdw->stream_victim, 1) % UFFDW_STREAMS];
+			window = 1;
+		}
+		atomic_store(&stream->window, window);
+		atomic_store(&stream->next, address + window * pagesize);
+		if (window == 1) return 1;
+	}
+
+	// larger pages have all their bits set or cleared together
+	size_t present = _uffdw_residency_find(uffdw, address + pagesize, address + window * pagesize, true);
+	return (present - address) / pagesize;
+}
+
+/**
+ * Note that handler is asked for page at `address`. Returns false if it
+ * was asked already and the fault will be resolved anyway. It's best
+ * effort - when the table is crowded, or when a slot before the page got
+ * free, the page is asked for again, which is harmless.
+ */
+static bool _uffdw_pending_add(struct uffdw_t * uffdw, size_t address) {
+	size_t h = _hash(address / uffdw->pagesize);
+	for (size_t i = 0; i < UFFDW_PENDING_PROBES; i ++) {
+		if (atomic_load(&uffdw->pending[(h + i) % UFFDW_PENDING_SLOTS]) == address) return false;
+	}
+	for (size_t i = 0; i < UFFDW_PENDING_PROBES; i ++) {
+		size_t expected = 0;
+		if (atomic_compare_exchange_strong(
+			&uffdw->pending[(h + i) % UFFDW_PENDING_SLOTS],
+			&expected, address
+		)) return true;
+		if (expected == address) return false;
+	}
+	return true;
+}
+
+static void _uffdw_pending_remove(struct uffdw_t * uffdw, size_t address) {
+	size_t h = _hash(address / uffdw->pagesize);
+	for (size_t i = 0; i < UFFDW_PENDING_PROBES; i ++) {
+		size_t expected = address;
+		if (atomic_compare_exchange_strong(
+			&uffdw->pending[(h + i) % UFFDW_PENDING_SLOTS],
+			&expected, 0
+		)) return;
+	}
+}
+
+/**
+ * Get priority of faults of thread `tid`. Nothing is looked up until
+ * some thread gets one.
+ */
+static inline int _uffdw_priority_of(pid_t tid) {
+	if (atomic_load(&_uffdw_prioritized) == 0) return 0;
+	size_t h = _hash(tid);
+	for (size_t i = 0; i < UFFDW_PRIORITY_PROBES; i ++) {
+		struct _uffdw_priority_t * slot = &_uffdw_priorities[(h + i) % UFFDW_PRIORITY_SLOTS];
+		if (atomic_load(&slot->tid) == tid) return atomic_load(&slot->priority);
+	}
+	return 0;
+}
+
+bool uffdw_set_thread_priority(pid_t tid, int priority) {
+	if (tid <= 0) {
+		warnx("thread id %d is not valid", (int)tid);
+		return false;
+	}
+	size_t h = _hash(tid);
+	pthread_mutex_lock(&_uffdw_priorities_mutex);
+	struct _uffdw_priority_t * slot = NULL;
+	for (size_t i = 0; i < UFFDW_PRIORITY_PROBES; i ++) {
+		struct _uffdw_priority_t * s = &_uffdw_priorities[(h + i) % UFFDW_PRIORITY_SLOTS];
+		pid_t t = atomic_load(&s->tid);
+		if (t == tid) {
+			slot = s;
+			break;
+		}
+		if (t == 0 && slot == NULL) slot = s;
+	}
+	bool known = slot != NULL && atomic_load(&slot->tid) == tid;
+	bool ok = true;
+	if (priority == 0) {
+		// default one takes no slot
+		if (known) {
+			atomic_store(&slot->tid, 0);
+			atomic_fetch_sub(&_uffdw_prioritized, 1);
+		}
+	} else if (slot == NULL) {
+		warnx("too many threads with priority");
+		ok = false;
+	} else {
+		atomic_store(&slot->priority, priority);
+		if (!known) {
+			atomic_store(&slot->tid, tid);
+			atomic_fetch_add(&_uffdw_prioritized, 1);
+		}
+	}
+	pthread_mutex_unlock(&_uffdw_priorities_mutex);
+	return ok;
+}
+
+static inline size_t * _uffdw_cache_bucket(struct uffdw_cache_t * cache, void * data, size_t page) {
+	return &cache->buckets[_hash((size_t)data ^ _hash(page)) & cache->bucket_mask];
+}
+
+/**
+ * Get entry for handler page `page`. Must be called with `cache->mutex`
+ * held.
+ */
+static size_t _uffdw_cache_find(struct uffdw_cache_t * cache, void * data, size_t page) {
+	size_t i = *_uffdw_cache_bucket(cache, data, page);
+	while (i != UFFDW_CACHE_NONE && (cache->entries[i].data != data || cache->entries[i].page != page)) {
+		i = cache->entries[i].next;
+	}
+	return i;
+}
+
+static void _uffdw_cache_unlink(struct uffdw_cache_t * cache, size_t i) {
+	struct _uffdw_cache_entry_t * entry = &cache->entries[i];
+	if (entry->newer != UFFDW_CACHE_NONE) cache->entries[entry->newer].older = entry->older;
+	else cache->newest = entry->older;
+	if (entry->older != UFFDW_CACHE_NONE) cache->entries[entry->older].newer = entry->newer;
+	else cache->oldest = entry->newer;
+}
+
+static void _uffdw_cache_push(struct uffdw_cache_t * cache, size_t i) {
+	struct _uffdw_cache_entry_t * entry = &cache->entries[i];
+	entry->newer = UFFDW_CACHE_NONE;
+	entry->older = cache->newest;
+	if (cache->newest != UFFDW_CACHE_NONE) cache->entries[cache->newest].newer = i;
+	cache->newest = i;
+	if (cache->oldest == UFFDW_CACHE_NONE) cache->oldest = i;
+}
+
+/**
+ * Store copy of handler page `page`, evicting the least recently used
+ * one if the cache is full.
+ */
+static void _uffdw_cache_put(struct uffdw_cache_t * cache, void * data, size_t page, const void * src) {
+	pthread_mutex_lock(&cache->mutex);
+	size_t i = _uffdw_cache_find(cache, data, page);
+	if (i != UFFDW_CACHE_NONE) {
+		_uffdw_cache_unlink(cache, i);
+	} else {
+		if (cache->used < cache->count) {
+			i = cache->used ++;
+		} else {
+			// evict the oldest entry, dropping it from its bucket too
+			i = cache->oldest;
+			_uffdw_cache_unlink(cache, i);
+			size_t * link = _uffdw_cache_bucket(cache, cache->entries[i].data, cache->entries[i].page);
+			while (*link != i) link = &cache->entries[*link].next;
+			*link = cache->entries[i].next;
+		}
+		size_t * bucket = _uffdw_cache_bucket(cache, data, page);
+		cache->entries[i].data = data;
+		cache->entries[i].page = page;
+		cache->entries[i].next = *bucket;
+		*bucket = i;
+	}
+	memcpy(cache->pages + i * cache->pagesize, src, cache->pagesize);
+	_uffdw_cache_push(cache, i);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * Put pages just copied to `target_offset` to the cache of the range
+ * being handled, if any.
+ */
+static void _uffdw_cache_capture(
+	struct uffdw_range_t * range,
+	const char * our_offset, size_t target_offset, size_t size
+) {
+	struct uffdw_cache_t * cache = range->options.cache;
+	for (size_t done = 0; done < size; done += cache->pagesize) {
+		size_t address = target_offset + done;
+		if (address < range->offset || address >= range->end) continue;
+		_uffdw_cache_put(
+			cache, range->handler_data,
+			address - range->offset + range->handler_offset,
+			our_offset + done
+		);
+	}
+}
+
+/**
+ * Resolve pages from `address` on that are cached, up to `size` bytes.
+ * Returns how many bytes were resolved.
+ */
+static size_t _uffdw_cache_serve(struct uffdw_t * uffdw, struct uffdw_range_t * range, size_t address, size_t size) {
+	struct uffdw_cache_t * cache = range->options.cache;
+	size_t done = 0;
+	pthread_mutex_lock(&cache->mutex);
+	while (done < size) {
+		size_t i = _uffdw_cache_find(
+			cache, range->handler_data,
+			address + done - range->offset + range->handler_offset
+		);
+		if (i == UFFDW_CACHE_NONE) break;
+		if (!uffdw_copy(uffdw->uffd, cache->pages + i * cache->pagesize, address + done, cache->pagesize)) break;
+		_uffdw_cache_unlink(cache, i);
+		_uffdw_cache_push(cache, i);
+		done += cache->pagesize;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return done;
+}
+
+/**
+ * Get tracked area containing `address`. Must be called with
+ * `uffdw->dirty_mutex` held.
+ */
+static struct _uffdw_dirty_t * _uffdw_dirty_find(struct uffdw_t * uffdw, size_t address) {
+	for (struct _uffdw_dirty_t * area = uffdw->dirty; area != NULL; area = area->next) {
+		if (area->offset <= address && address < area->end) return area;
+	}
+	return NULL;
+}
+
+static bool _uffdw_is_tracked(struct uffdw_t * uffdw, size_t address) {
+	if (atomic_load(&uffdw->dirty_count) == 0) return false;
+	pthread_mutex_lock(&uffdw->dirty_mutex);
+	bool tracked = _uffdw_dirty_find(uffdw, address) != NULL;
+	pthread_mutex_unlock(&uffdw->dirty_mutex);
+	return tracked;
+}
+
+/**
+ * Note the writes to write-protected pages and let them through. Pages
+ * outside of tracked areas (eg. in forked children) are just let
+ * through.
+ */
+static bool _uffdw_handle_write(struct uffdw_t * uffdw, size_t address, size_t size) {
+	pthread_mutex_lock(&uffdw->dirty_mutex);
+	for (size_t done = 0; done < size; done += uffdw->pagesize) {
+		struct _uffdw_dirty_t * area = _uffdw_dirty_find(uffdw, address + done);
+		if (area == NULL) continue;
+		size_t page = (address + done - area->offset) / uffdw->pagesize;
+		area->bits[page / ULONG_BITS] |= 1UL << (page % ULONG_BITS);
+	}
+	bool ok = uffdw_writeprotect(uffdw->uffd, address, size, false);
+	// mappings are changing, writers try again once the event is read
+	if (!ok && errno == EAGAIN) ok = uffdw_wake(uffdw->uffd, address, size);
+	pthread_mutex_unlock(&uffdw->dirty_mutex);
+	return ok;
+}
+
+static inline size_t _uffdw_page_hash(struct uffdw_t * uffdw, size_t address) {
+	return _hash(address ^ (size_t)uffdw);
+}
+
+static struct _uffdw_page_entry_t * _uffdw_page_map_find(
+	struct _uffdw_page_map_t * map, struct uffdw_t * uffdw, size_t address
+) {
+	for (size_t i = _uffdw_page_hash(uffdw, address) & map->mask; ; i = (i + 1) & map->mask) {
+		struct _uffdw_page_entry_t * entry = &map->entries[i];
+		if (entry->uffdw == NULL) return NULL;
+		if (entry->uffdw == uffdw && entry->address == address) return entry;
+	}
+}
+
+/**
+ * Add entry that is not there yet. There must be room for it.
+ */
+static struct _uffdw_page_entry_t * _uffdw_page_map_put(
+	struct _uffdw_page_map_t * map, struct uffdw_t * uffdw, size_t address
+) {
+	assert((map->count + 1) * 2 <= map->mask + 1);
+	size_t i = _uffdw_page_hash(uffdw, address) & map->mask;
+	while (map->entries[i].uffdw != NULL) i = (i + 1) & map->mask;
+	map->entries[i].uffdw = uffdw;
+	map->entries[i].address = address;
+	map->count ++;
+	return &map->entries[i];
+}
+
+/**
+ * Remove entry, moving back those that would not be found after it.
+ */
+static void _uffdw_page_map_del(struct _uffdw_page_map_t * map, struct _uffdw_page_entry_t * entry) {
+	size_t hole = entry - map->entries;
+	for (size_t i = (hole + 1) & map->mask; map->entries[i].uffdw != NULL; i = (i + 1) & map->mask) {
+		size_t home = _uffdw_page_hash(map->entries[i].uffdw, map->entries[i].address) & map->mask;
+		if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+			map->entries[hole] = map->entries[i];
+			hole = i;
+		}
+	}
+	map->entries[hole].uffdw = NULL;
+	map->count --;
+}
+
+static bool _uffdw_page_map_init(struct _uffdw_page_map_t * map, size_t count) {
+	size_t size = 16;
+	while (size < count * 2) size *= 2;
+	map->entries = calloc(size, sizeof(struct _uffdw_page_entry_t));
+	map->mask = size - 1;
+	map->count = 0;
+	return map->entries != NULL;
+}
+
+/**
+ * Make room for `more` entries.
+ */
+static bool _uffdw_page_map_reserve(struct _uffdw_page_map_t * map, size_t more) {
+	if ((map->count + more) * 2 <= map->mask + 1) return true;
+	struct _uffdw_page_map_t bigger;
+	if (!_uffdw_page_map_init(&bigger, map->count + more)) return false;
+	for (size_t i = 0; i <= map->mask; i ++) {
+		struct _uffdw_page_entry_t * entry = &map->entries[i];
+		if (entry->uffdw != NULL) _uffdw_page_map_put(&bigger, entry->uffdw, entry->address)->value = entry->value;
+	}
+	free(map->entries);
+	*map = bigger;
+	return true;
+}
+
+/**
+ * Get budget that pages of `range` are under in `uffdw`, if any.
+ */
+static inline struct uffdw_budget_t * _uffdw_budget_of(struct uffdw_t * uffdw, struct uffdw_range_t * range) {
+	if (range->options.budget == NULL || uffdw->forked || atomic_load(&uffdw->canceling)) return NULL;
+	return range->options.budget;
+}
+
+/**
+ * Note pages from `address` on that were faulted in, or once again.
+ */
+static void _uffdw_budget_track(
+	struct uffdw_t * uffdw, struct uffdw_budget_t * budget,
+	size_t address, size_t size
+) {
+	pthread_mutex_lock(&budget->mutex);
+	for (size_t page = address; page < address + size; page += budget->pagesize) {
+		struct _uffdw_page_entry_t * entry = _uffdw_page_map_find(&budget->resident, uffdw, page);
+		if (entry != NULL) {
+			budget->slots[entry->value].flags |= UFFDW_RESIDENT_REFERENCED;
+			continue;
+		}
+		// out of slots only if eviction is far behind, then the page goes untracked
+		if (budget->free_count == 0) break;
+		size_t slot = budget->free_slots[-- budget->free_count];
+		budget->slots[slot].uffdw = uffdw;
+		budget->slots[slot].address = page;
+		budget->slots[slot].flags = UFFDW_RESIDENT_REFERENCED;
+		_uffdw_page_map_put(&budget->resident, uffdw, page)->value = slot;
+	}
+	if (budget->capacity - budget->free_count > budget->pages) pthread_cond_signal(&budget->over);
+	pthread_mutex_unlock(&budget->mutex);
+}
+
+/**
+ * Fault in page at `address` from swap, if it's there.
+ */
+static bool _uffdw_budget_swap_in(struct uffdw_t * uffdw, struct uffdw_budget_t * budget, size_t address) {
+	if (budget->swap_fd < 0) return false;
+	pthread_mutex_lock(&budget->mutex);
+	struct _uffdw_page_entry_t * entry = _uffdw_page_map_find(&budget->swapped, uffdw, address);
+	size_t offset = entry != NULL ? entry->value : SIZE_MAX;
+	pthread_mutex_unlock(&budget->mutex);
+	if (offset == SIZE_MAX) return false;
+
+	char * page = uffdw_scratch(budget->pagesize);
+	if (page == NULL) return false;
+	if (!_uffdw_pread_all(budget->swap_fd, page, budget->pagesize, offset)) {
+		warn("failed to read page from swap");
+		return false;
+	}
+	return uffdw_copy(uffdw->uffd, page, address, budget->pagesize);
+}
+
+/**
+ * Count pages from `address` on, up to `pages`, that have no copy in
+ * swap - the handler must not overwrite those that have.
+ */
+static size_t _uffdw_budget_unswapped(
+	struct uffdw_t * uffdw, struct uffdw_budget_t * budget,
+	size_t address, size_t pages
+) {
+	if (budget->swap_fd < 0) return pages;
+	pthread_mutex_lock(&budget->mutex);
+	size_t count = 0;
+	while (count < pages && _uffdw_page_map_find(&budget->swapped, uffdw, address + count * budget->pagesize) == NULL) {
+		count ++;
+	}
+	pthread_mutex_unlock(&budget->mutex);
+	return _max(count, 1);
+}
+
+/**
+ * Note writes to write-protected pages and let them through, except of
+ * pages that are being dropped - their writers are woken once they are
+ * gone, to fault them in from swap.
+ */
+static bool _uffdw_budget_write(
+	struct uffdw_t * uffdw, struct uffdw_budget_t * budget,
+	size_t address, size_t size
+) {
+	bool ok = true;
+	pthread_mutex_lock(&budget->mutex);
+	for (size_t page = address; page < address + size; page += budget->pagesize) {
+		struct _uffdw_page_entry_t * entry = _uffdw_page_map_find(&budget->resident, uffdw, page);
+		if (entry != NULL) {
+			struct _uffdw_resident_t * slot = &budget->slots[entry->value];
+			if (slot->flags & UFFDW_RESIDENT_EVICTING) continue;
+			slot->flags |= UFFDW_RESIDENT_REFERENCED | UFFDW_RESIDENT_DIRTY;
+		}
+		if (!_uffdw_handle_write(uffdw, page, budget->pagesize)) ok = false;
+	}
+	pthread_mutex_unlock(&budget->mutex);
+	return ok;
+}
+
+/**
+ * Forget resident page of `entry`, unless the budget is dropping it.
+ * Must be called with `budget->mutex` held.
+ */
+static void _uffdw_budget_forget_resident(struct uffdw_budget_t * budget, struct _uffdw_page_entry_t * entry) {
+	size_t i = entry->value;
+	if (budget->slots[i].flags & UFFDW_RESIDENT_EVICTING) return;
+	_uffdw_page_map_del(&budget->resident, entry);
+	budget->slots[i].uffdw = NULL;
+	budget->free_slots[budget->free_count ++] = i;
+}
+
+/**
+ * Forget swapped out copy of `entry`, or move it by `delta` if `moved`,
+ * unless its page is being dropped right now. Returns true if `entry`
+ * was taken out of its place. Must be called with `budget->mutex` held.
+ */
+static bool _uffdw_budget_forget_swapped(
+	struct uffdw_budget_t * budget, struct _uffdw_page_entry_t * entry,
+	bool moved, size_t delta
+) {
+	struct _uffdw_page_entry_t * resident = _uffdw_page_map_find(&budget->resident, entry->uffdw, entry->address);
+	if (resident != NULL && (budget->slots[resident->value].flags & UFFDW_RESIDENT_EVICTING)) return false;
+	struct _uffdw_page_entry_t copy = *entry;
+	_uffdw_page_map_del(&budget->swapped, entry);
+	if (!moved) {
+		budget->swap_free[budget->swap_free_count ++] = copy.value;
+		return true;
+	}
+	// there is room, an entry was just taken out
+	struct _uffdw_page_entry_t * there = _uffdw_page_map_find(&budget->swapped, copy.uffdw, copy.address + delta);
+	if (there != NULL) {
+		budget->swap_free[budget->swap_free_count ++] = there->value;
+	} else {
+		there = _uffdw_page_map_put(&budget->swapped, copy.uffdw, copy.address + delta);
+	}
+	there->value = copy.value;
+	return true;
+}
+
+/**
+ * Forget pages of `uffdw` from `start` to `end`, those being dropped by
+ * the budget itself excepted. Their swapped out versions are forgotten
+ * too unless they are `moved` by `delta`. Ranges smaller than the tables
+ * - like every page the budget drops, which comes back as REMOVE event -
+ * are looked up page by page, larger ones go through the tables. Must be
+ * called with `budget->mutex` held.
+ */
+static void _uffdw_budget_forget(
+	struct uffdw_budget_t * budget, struct uffdw_t * uffdw,
+	size_t start, size_t end,
+	bool moved, size_t delta
+) {
+	size_t pages = (end - start) / budget->pagesize;
+	if (pages < budget->capacity) {
+		for (size_t p = 0; p < pages; p ++) {
+			struct _uffdw_page_entry_t * entry = _uffdw_page_map_find(&budget->resident, uffdw, start + p * budget->pagesize);
+			if (entry != NULL) _uffdw_budget_forget_resident(budget, entry);
+		}
+	} else {
+		for (size_t i = 0; i < budget->capacity; i ++) {
+			struct _uffdw_resident_t * slot = &budget->slots[i];
+			if (slot->uffdw != uffdw || slot->address < start || slot->address >= end) continue;
+			_uffdw_budget_forget_resident(budget, _uffdw_page_map_find(&budget->resident, uffdw, slot->address));
+		}
+	}
+
+	if (budget->swapped.count == 0) return;
+	if (pages <= budget->swapped.mask) {
+		// moved ones go like memmove(), so that none is moved twice
+		bool down = moved && (ssize_t)delta > 0;
+		for (size_t p = 0; p < pages; p ++) {
+			size_t address = start + (down ? pages - 1 - p : p) * budget->pagesize;
+			struct _uffdw_page_entry_t * entry = _uffdw_page_map_find(&budget->swapped, uffdw, address);
+			if (entry != NULL) _uffdw_budget_forget_swapped(budget, entry, moved, delta);
+		}
+		return;
+	}
+	// mremap() never moves pages over themselves, so moved ones are out of the way
+	size_t i = 0;
+	while (i <= budget->swapped.mask) {
+		struct _uffdw_page_entry_t * entry = &budget->swapped.entries[i];
+		bool inside = entry->uffdw == uffdw && entry->address >= start && entry->address < end;
+		// entry that comes in its place is looked at next
+		if (!inside || !_uffdw_budget_forget_swapped(budget, entry, moved, delta)) i ++;
+	}
+}
+
+/**
+ * Forget pages of budgets of ranges from `start` to `end`, which are
+ * gone or moved to `to` if `moved`. Must be called with `uffdw->mutex`
+ * held.
+ */
+static void _uffdw_budget_event(struct uffdw_t * uffdw, size_t start, size_t end, bool moved, size_t to) {
+	if (uffdw->forked) return;
+	struct uffdw_range_t * range = _uffdw_get_range(uffdw, start, end);
+	while (range != NULL) {
+		size_t o = start, e = end;
+		_ranges_overlap(range->offset, range->end, start, end, &o, &e);
+		struct uffdw_budget_t * budget = range->options.budget;
+		if (budget != NULL) {
+			pthread_mutex_lock(&budget->mutex);
+			_uffdw_budget_forget(budget, uffdw, o, e, moved, to - start);
+			pthread_mutex_unlock(&budget->mutex);
+		}
+		range = _uffdw_get_range(uffdw, range->end, end);
+	}
+}
+
+/**
+ * Take pages of `uffdw` out of budgets, once those being dropped are
+ * gone. Threads of `uffdw` must be running still, dropping pages waits
+ * for them to read the REMOVE events.
+ */
+static void _uffdw_budget_detach(struct uffdw_t * uffdw) {
+	if (uffdw->forked) return;
+	atomic_store(&uffdw->canceling, true);
+
+	// budgets are waited for with no lock held, so that events can be read
+	size_t count = 0;
+	struct uffdw_budget_t * * budgets = NULL;
+	pthread_mutex_lock(&uffdw->mutex);
+	for (
+		struct uffdw_range_t * range = _uffdw_get_range(uffdw, 0, SIZE_MAX);
+		range != NULL;
+		range = _uffdw_get_range(uffdw, range->end, SIZE_MAX)
+	) {
+		struct uffdw_budget_t * budget = range->options.budget;
+		if (budget == NULL) continue;
+		bool known = false;
+		for (size_t i = 0; i < count; i ++) known = known || budgets[i] == budget;
+		if (known) continue;
+		struct uffdw_budget_t * * more = realloc(budgets, sizeof(struct uffdw_budget_t *) * (count + 1));
+		if (more == NULL) {
+			warn("failed to detach from budget");
+			continue;
+		}
+		budgets = more;
+		budgets[count ++] = budget;
+	}
+	pthread_mutex_unlock(&uffdw->mutex);
+
+	for (size_t b = 0; b < count; b ++) {
+		struct uffdw_budget_t * budget = budgets[b];
+		pthread_mutex_lock(&budget->mutex);
+		bool evicting = true;
+		while (evicting) {
+			evicting = false;
+			for (size_t i = 0; i < budget->capacity; i ++) {
+				struct _uffdw_resident_t * slot = &budget->slots[i];
+				if (slot->uffdw == uffdw && (slot->flags & UFFDW_RESIDENT_EVICTING)) evicting = true;
+			}
+			if (evicting) pthread_cond_wait(&budget->evicted, &budget->mutex);
+		}
+		_uffdw_budget_forget(budget, uffdw, 0, SIZE_MAX, false, 0);
+		pthread_mutex_unlock(&budget->mutex);
+	}
+	free(budgets);
+}
+
+/**
+ * Resolve pagefaults on `size` bytes from `fault->address` with a
+ * single handler call.
+ */
+static enum uffdw_status_t _uffdw_handle_pagefault(struct uffdw_t * uffdw, struct _uffdw_fault_t * fault, size_t size) {
+	size_t address = fault->address;
+	struct uffdw_range_t * range = &fault->range;
+	struct uffdw_budget_t * budget = fault->found ? _uffdw_budget_of(uffdw, range) : NULL;
+	if (fault->wp) {
+		bool ok = budget != NULL && budget->swap_fd >= 0 ?
+			_uffdw_budget_write(uffdw, budget, address, size) :
+			_uffdw_handle_write(uffdw, address, size);
+		if (!ok) {
+			LOG("error: failed to unprotect written page");
+			return UFFDW_FAILED;
+		}
+		return UFFDW_DONE;
+	}
+
+	// missing pages of tracked areas come protected, so that first write is seen
+	_uffdw_copy_wp = _uffdw_is_tracked(uffdw, address) || (budget != NULL && budget->swap_fd >= 0);
+	_uffdw_copy_zeroes = fault->found && range->options.detect_zeroes;
+	_uffdw_granule = fault->pagesize;
+	_uffdw_installing = uffdw;
+	_uffdw_faulting = address;
+	_uffdw_faulting_end = address + size;
+	// faulting pages are missing whatever their bits say
+	_uffdw_residency_update(uffdw, address, address + size, false);
+
+	enum uffdw_status_t status = UFFDW_DONE;
+	size_t filled = 0;
+	if (!fault->found) {
+		warnx("uffd %d: PAGEFAULT on non registered page %p", uffdw->uffd, (void *)address);
+		uffdw_zeropage(uffdw->uffd, address, size);
+	} else if (budget != NULL && _uffdw_budget_swap_in(uffdw, budget, address)) {
+		LOG("uffd %d: %p served from swap", uffdw->uffd, (void *)address);
+		filled = fault->pagesize;
+	} else if (range->options.cache != NULL && (filled = _uffdw_cache_serve(uffdw, range, address, size)) > 0) {
+		LOG("uffd %d: %p served from cache", uffdw->uffd, (void *)address);
+	} else if (!_uffdw_pending_add(uffdw, address)) {
+		LOG("uffd %d: %p is being resolved already", uffdw->uffd, (void *)address);
+	} else {
+		size_t pages = _max(size / fault->pagesize, _uffdw_readahead(uffdw, range, address));
+		if (budget != NULL) pages = _uffdw_budget_unswapped(uffdw, budget, address, pages);
+		if (range->options.cache != NULL) _uffdw_capture = range;
+		status = range->handler(
+			uffdw->uffd,
+			address - range->offset + range->handler_offset,
+			address, pages * fault->pagesize,
+			range->handler_data
+		);
+		_uffdw_capture = NULL;
+		if (status != UFFDW_PENDING) _uffdw_pending_remove(uffdw, address);
+		if (status == UFFDW_FAILED) {
+			LOG("error: uffdw handler failed");
+		} else {
+			filled = pages * fault->pagesize;
+		}
+	}
+	if (budget != NULL && filled > 0) _uffdw_budget_track(uffdw, budget, address, filled);
+
+	// only the first page is up to the handler, the rest fault again if left out
+	if (size > fault->pagesize && !_uffdw_copy_dontwake) {
+		uffdw_wake(uffdw->uffd, address + fault->pagesize, size - fault->pagesize);
+	}
+
+	_uffdw_copy_wp = false;
+	_uffdw_copy_zeroes = false;
+	_uffdw_granule = 0;
+	_uffdw_installing = NULL;
+	_uffdw_faulting = 0;
+	_uffdw_faulting_end = 0;
+	return status;
+}
+
+static int _uffdw_fault_cmp(const void * _a, const void * _b) {
+	const struct _uffdw_fault_t * a = _a;
+	const struct _uffdw_fault_t * b = _b;
+	if (a->address != b->address) return a->address < b->address ? -1 : 1;
+	return (int)a->wp - (int)b->wp;
+}
+
+/**
+ * Tell if `next` can be resolved together with run of faults starting
+ * at `first` and ending at `end` - it is the same page as the last one
+ * or the page right after it, of the same kind and range.
+ */
+static bool _uffdw_fault_extends(
+	struct uffdw_t * uffdw,
+	struct _uffdw_fault_t * first, struct _uffdw_fault_t * next, size_t end
+) {
+	if (next->pagesize != first->pagesize) return false;
+	if (next->address != end && next->address + next->pagesize != end) return false;
+	if (next->wp != first->wp) return false;
+	if (next->found != first->found) return false;
+	if (first->wp) return !first->found || next->range.options.budget == first->range.options.budget;
+	if (first->found && (
+		next->range.offset != first->range.offset ||
+		next->range.handler_offset != first->range.handler_offset ||
+		next->range.handler != first->range.handler
+	)) return false;
+	// the run is installed protected or not as a whole
+	return _uffdw_is_tracked(uffdw, next->address) == _uffdw_is_tracked(uffdw, first->address);
+}
+
+/**
+ * Resolve pagefaults of a batch. Faults on the same page are resolved
+ * once, and runs of adjacent pages of the same range with a single
+ * handler call. Runs without any locks, concurrently with other threads
+ * of the pool.
+ */
+static bool _uffdw_handle_faults(struct uffdw_t * uffdw, struct _uffdw_batch_t * batch) {
+	struct _uffdw_fault_t * faults = batch->faults;
+	if (batch->count == 0) return true;
+	if (batch->count > 1) qsort(faults, batch->count, sizeof(struct _uffdw_fault_t), _uffdw_fault_cmp);
+	atomic_fetch_add(&uffdw->demand, 1);
+
+	struct _uffdw_run_t runs[UFFDW_BATCH];
+	size_t run_count = 0;
+	bool prioritized = false;
+	for (size_t i = 0; i < batch->count; ) {
+		struct _uffdw_run_t * run = &runs[run_count ++];
+		run->first = i;
+		run->end = faults[i].address + faults[i].pagesize;
+		run->priority = faults[i].priority;
+		size_t j = i + 1;
+		while (j < batch->count && _uffdw_fault_extends(uffdw, &faults[i], &faults[j], run->end)) {
+			run->end = faults[j].address + faults[j].pagesize;
+			run->priority = faults[j].priority > run->priority ? faults[j].priority : run->priority;
+			j ++;
+		}
+		run->next = j;
+		if (run->priority != 0) prioritized = true;
+		i = j;
+	}
+
+	// runs of threads with higher priority go first, the rest stay in order
+	for (size_t r = 1; prioritized && r < run_count; r ++) {
+		struct _uffdw_run_t run = runs[r];
+		size_t k = r;
+		while (k > 0 && runs[k - 1].priority < run.priority) {
+			runs[k] = runs[k - 1];
+			k --;
+		}
+		runs[k] = run;
+	}
+
+	bool ok = true;
+	for (size_t r = 0; r < run_count; r ++) {
+		size_t i = runs[r].first;
+		size_t j = runs[r].next;
+
+		_uffdw_counting = &_uffdw_slot(uffdw)->counters;
+		_uffdw_range_counting = faults[i].found ? faults[i].range.counters : NULL;
+		_uffdw_count(faults, j - i);
+		enum uffdw_status_t status = _uffdw_handle_pagefault(uffdw, &faults[i], runs[r].end - faults[i].address);
+		if (status == UFFDW_FAILED) {
+			_uffdw_count(failures, 1);
+			ok = false;
+		}
+		_uffdw_counting = NULL;
+		_uffdw_range_counting = NULL;
+		if (status == UFFDW_DONE) _uffdw_note_latency(uffdw, batch->read_at, j - i);
+	}
+	atomic_fetch_sub(&uffdw->demand, 1);
+	return ok;
+}
+
+static bool _uffdw_start(struct uffdw_t * uffdw, size_t threads);
+
+/**
+ * Set up instance for forked process with uffd `uffd`, table `ranges` -
+ * shared with `parent`, until either of them changes it - and its own
+ * `residency`, served the same way as `parent`.
+ */
+static struct uffdw_t * _uffdw_fork(
+	struct uffdw_t * parent, int uffd,
+	struct uffdw_range_t * ranges, struct _uffdw_residency_t * residency
+) {
+	// copy structure
+	struct uffdw_t * new_uffdw = _uffdw_alloc();
+	if (new_uffdw == NULL) {
+		warn("failed to allocate uffdw structure");
+		close(uffd);
+		_uffdw_residency_destroy(residency);
+		return NULL;
+	}
+	new_uffdw->uffd = uffd;
+	new_uffdw->forked = true;
+	new_uffdw->features = parent->features;
+	new_uffdw->pagesize = parent->pagesize;
+	_uffdw_range_ref(ranges);
+	new_uffdw->ranges = ranges;
+	atomic_store(&new_uffdw->published, ranges);
+	new_uffdw->residency = residency;
+
+	// run threads
+	if (!_uffdw_start(new_uffdw, parent->thread_count)) {
+		if (DEBUG) perror("failed to create child uffdw threads");
+		uffdw_cancel(new_uffdw);
+		return NULL;
+	}
+
+	return new_uffdw;
+}
+
+/**
+ * Leave setting up of forked process to `_uffdw_forks_run()`. The
+ * table as it is now is referenced until then, and `uffdw` is kept
+ * alive. Pages there now are there in the child too, their residency
+ * is copied right away. Must be called with `uffdw->mutex` held.
+ */
+static bool _uffdw_defer_fork(struct uffdw_t * uffdw, int uffd) {
+	struct _uffdw_fork_t request = {uffdw, uffd, uffdw->ranges, _uffdw_residency_clone(uffdw->residency)};
+	_uffdw_range_ref(request.ranges);
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	uffdw->busy ++;
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+
+	if (write(_uffdw_reactor.fork_pipe[1], &request, sizeof(request)) != sizeof(request)) {
+		warn("uffd %d: failed to pass fork on", uffdw->uffd);
+		close(uffd);
+		_uffdw_range_unref(uffdw, request.ranges);
+		_uffdw_residency_destroy(request.residency);
+		_uffdw_release(uffdw);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Forget tracked areas that lie completely between `start` and `end`.
+ */
+static void _uffdw_forget_dirty(struct uffdw_t * uffdw, size_t start, size_t end) {
+	pthread_mutex_lock(&uffdw->dirty_mutex);
+	struct _uffdw_dirty_t * * area = &uffdw->dirty;
+	while (*area != NULL) {
+		struct _uffdw_dirty_t * a = *area;
+		if (start <= a->offset && a->end <= end) {
+			*area = a->next;
+			free(a->bits);
+			free(a);
+			atomic_fetch_sub(&uffdw->dirty_count, 1);
+		} else {
+			area = &(a->next);
+		}
+	}
+	pthread_mutex_unlock(&uffdw->dirty_mutex);
+}
+
+/**
+ * Apply non-pagefault event to the range table. Must be called with
+ * `uffdw->mutex` held, inside of a write.
+ */
+static bool _uffdw_handle_event(struct uffdw_t * uffdw, struct uffd_msg * msg) {
+	switch (msg->event) {
+		case UFFD_EVENT_FORK: {
+			LOG("uffd %d: got FORK (new uffd %d)", uffdw->uffd, msg->arg.fork.ufd);
+			uffdw->forks ++;
+
+			// threads reading events can't wait for malloc locks, next
+			// fork() may hold them until its FORK events are read
+			return _uffdw_defer_fork(uffdw, msg->arg.fork.ufd);
+		}
+
+		case UFFD_EVENT_REMAP: {
+			LOG(
+				"uffd %d: got REMAP (%zu, %p -> %p)", uffdw->uffd,
+				(size_t)msg->arg.remap.len, (void *)msg->arg.remap.from, (void *)msg->arg.remap.to
+			);
+			uffdw->remaps ++;
+
+			size_t from = msg->arg.remap.from;
+			size_t from_end = from + msg->arg.remap.len;
+			struct uffdw_range_t * range = _uffdw_get_range(uffdw, from, from_end);
+			if (range == NULL) {
+				warnx("uffd %d: REMAP on non registered addr %p", uffdw->uffd, (void *)msg->arg.remap.from);
+			}
+
+			// mapping at the destination is replaced
+			_uffdw_budget_event(uffdw, msg->arg.remap.to, msg->arg.remap.to + msg->arg.remap.len, false, 0);
+			_uffdw_budget_event(uffdw, from, from_end, true, msg->arg.remap.to);
+			if (!_uffdw_remove_range(uffdw, msg->arg.remap.to, msg->arg.remap.to + msg->arg.remap.len)) {
+				warnx("uffd %d: failed to remove range data", uffdw->uffd);
+			}
+			_uffdw_residency_move(uffdw, from, msg->arg.remap.to, msg->arg.remap.len);
+
+			// carry every registered piece over to its new place
+			while (range != NULL) {
+				size_t o = from, e = from_end;
+				_ranges_overlap(range->offset, range->end, from, from_end, &o, &e);
+				if (!_uffdw_add_range(
+					uffdw,
+					o - from + msg->arg.remap.to, e - from + msg->arg.remap.to,
+					o - range->offset + range->handler_offset,
+					range
+				)) warnx("uffd %d: failed to store range data", uffdw->uffd);
+				range = _uffdw_get_range(uffdw, e, from_end);
+			}
+
+			return true;
+		}
+
+		case UFFD_EVENT_REMOVE: {
+			LOG("uffd %d: got REMOVE (%p - %p)", uffdw->uffd, (void *)msg->arg.remove.start, (void *)msg->arg.remove.end);
+			uffdw->removes ++;
+			// pages are faulted in again like any missing ones
+			_uffdw_budget_event(uffdw, msg->arg.remove.start, msg->arg.remove.end, false, 0);
+			_uffdw_residency_update(uffdw, msg->arg.remove.start, msg->arg.remove.end, false);
+			return true;
+		}
+
+		case UFFD_EVENT_UNMAP: {
+			LOG("uffd %d: got UNMAP (%p - %p)", uffdw->uffd, (void *)msg->arg.remove.start, (void *)msg->arg.remove.end);
+			uffdw->unmaps ++;
+			_uffdw_budget_event(uffdw, msg->arg.remove.start, msg->arg.remove.end, false, 0);
+			if (!_uffdw_remove_range(
+				uffdw,
+				msg->arg.remove.start, msg->arg.remove.end
+			)) warnx("uffd %d: failed to remove range data", uffdw->uffd);
+			_uffdw_forget_dirty(uffdw, msg->arg.remove.start, msg->arg.remove.end);
+			_uffdw_residency_update(uffdw, msg->arg.remove.start, msg->arg.remove.end, false);
+			return true;
+		}
+
+		default: {
+			LOG("uffd %d: error: got unsupported message type", uffdw->uffd);
+			return false;
+		}
+	}
+}
+
+/**
+ * Write `length` bytes of trace from `data`. Must be called with
+ * `trace->write_mutex` held.
+ */
+static bool _uffdw_trace_write(struct _uffdw_trace_t * trace, const uint8_t * data, size_t length) {
+	size_t written = 0;
+	while (trace->ok && written < length) {
+		ssize_t got = write(trace->fd, data + written, length - written);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) {
+			warn("failed to write fault trace");
+			trace->ok = false;
+		} else {
+			written += got;
+		}
+	}
+	return trace->ok;
+}
+
+/**
+ * Write buffer swapped out by `_uffdw_trace_add()`, once `uffdw->mutex`
+ * is let go, and let the next one be swapped.
+ */
+static void _uffdw_trace_flush(struct _uffdw_trace_t * trace) {
+	_uffdw_trace_write(trace, trace->spare, trace->spare_length);
+	trace->spare_length = 0;
+	pthread_mutex_unlock(&trace->write_mutex);
+}
+
+static inline void _uffdw_trace_put(struct _uffdw_trace_t * trace, uint64_t value) {
+	while (value >= 0x80) {
+		trace->buffer[trace->length ++] = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	trace->buffer[trace->length ++] = (uint8_t)value;
+}
+
+/**
+ * Note fault at `address` of `range` in trace being recorded. Must be
+ * called with `uffdw->mutex` held. Returns true if the buffer got full
+ * and was swapped out, then the caller writes it with
+ * `_uffdw_trace_flush()` after letting the mutex go. Faults that come
+ * while the last one is still being written are left out.
+ */
+static bool _uffdw_trace_add(struct uffdw_t * uffdw, struct uffdw_range_t * range, size_t address) {
+	struct _uffdw_trace_t * trace = uffdw->trace;
+	size_t page = (address - range->offset + range->handler_offset) / uffdw->pagesize;
+	if (range->registration == trace->registration && page == trace->page) return false;
+
+	// two varints are 20 bytes at most
+	bool full = trace->length + 20 > UFFDW_TRACE_BUFFER;
+	if (full) {
+		// taken here so that the trace isn't stopped before it's written
+		if (pthread_mutex_trylock(&trace->write_mutex) != 0) return false;
+		uint8_t * buffer = trace->buffer;
+		trace->buffer = trace->spare;
+		trace->spare = buffer;
+		trace->spare_length = trace->length;
+		trace->length = 0;
+	}
+	int64_t delta = (int64_t)(page - trace->page);
+	_uffdw_trace_put(trace, range->registration);
+	_uffdw_trace_put(trace, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	trace->registration = range->registration;
+	trace->page = page;
+	return full;
+}
+
+/**
+ * Read messages that are there, up to `UFFDW_BATCH`. Returns 1 if
+ * there were some, 0 when there were none and -1 if the uffd can't be
+ * read. Events that fail are logged, they don't stop the reading.
+ *
+ * Events are applied to the range table before `uffdw->mutex` is let
+ * go. The kernel lets eg. `munmap()` return as soon as its event is
+ * read, so a `uffdw_register()` following it must not see the table
+ * from before the event. Pagefaults are looked up as they come, so
+ * that the events after them don't count.
+ */
+static int _uffdw_try_read(struct uffdw_t * uffdw, struct _uffdw_batch_t * batch) {
+	struct uffd_msg msgs[UFFDW_BATCH];
+	struct _uffdw_trace_t * flushing = NULL;
+	batch->count = 0;
+
+	pthread_mutex_lock(&uffdw->mutex);
+	ssize_t size = read(uffdw->uffd, msgs, sizeof(msgs));
+	if (size < (ssize_t)sizeof(struct uffd_msg)) {
+		pthread_mutex_unlock(&uffdw->mutex);
+		if (size < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+		if (DEBUG) perror("failed to read uffd message");
+		return -1;
+	}
+	batch->read_at = _uffdw_now();
+
+	bool ok = true;
+	for (size_t i = 0; i < (size_t)size / sizeof(struct uffd_msg); i ++) {
+		struct uffd_msg * msg = &msgs[i];
+		if (msg->event == UFFD_EVENT_PAGEFAULT) {
+			struct _uffdw_fault_t * fault = &batch->faults[batch->count ++];
+			fault->address = msg->arg.pagefault.address;
+			fault->wp = (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) != 0;
+			fault->priority = (uffdw->features & UFFD_FEATURE_THREAD_ID) ? _uffdw_priority_of(msg->arg.pagefault.feat.ptid) : 0;
+			fault->found = _uffdw_lookup(uffdw, fault->address, &fault->range);
+			fault->pagesize = fault->found ? fault->range.options.pagesize : (size_t)uffdw->pagesize;
+			fault->address &= ~(fault->pagesize - 1);
+			if (uffdw->trace != NULL && fault->found && !fault->wp && _uffdw_trace_add(uffdw, &fault->range, fault->address)) {
+				flushing = uffdw->trace;
+			}
+			LOG(
+				"uffd %d: got PAGEFAULT (%p, FLAG_WRITE=%d, FLAG_WP=%d)", uffdw->uffd, (void *)fault->address,
+				(msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0, fault->wp
+			);
+		} else if (msg->event == UFFD_EVENT_FORK) {
+			// parent's table stays as it is
+			if (!_uffdw_handle_event(uffdw, msg)) ok = false;
+		} else {
+			_uffdw_write_begin(uffdw);
+			if (!_uffdw_handle_event(uffdw, msg)) ok = false;
+			_uffdw_publish(uffdw);
+		}
+	}
+	pthread_mutex_unlock(&uffdw->mutex);
+	if (flushing != NULL) _uffdw_trace_flush(flushing);
+	if (!ok) warnx("uffd %d: failed to handle events", uffdw->uffd);
+	return 1;
+}
+
+/**
+ * Wait for next messages. Returns false once `uffdw` is being canceled,
+ * or its uffd can't be read any more.
+ */
+static bool _uffdw_read(struct uffdw_t * uffdw, struct _uffdw_batch_t * batch) {
+	struct pollfd fds[2] = {
+		{.fd = uffdw->uffd, .events = POLLIN},
+		{.fd = uffdw->stop_fd, .events = POLLIN},
+	};
+	while (true) {
+		// uffd is nonblocking, so try it first and sleep only if it's empty
+		int got = _uffdw_try_read(uffdw, batch);
+		if (got < 0) _uffdw_unlist(uffdw);
+		if (got != 0) return got > 0;
+
+		if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+			warn("uffd %d: poll failed", uffdw->uffd);
+			return false;
+		}
+		if (fds[1].revents != 0) return false;
+	}
+}
+
+/**
+ * Serve messages that came since the last read. Messages are read by
+ * one thread at a time and events are applied before the next ones are
+ * read, so that no pagefault is looked up in a range table older than
+ * itself.
+ */
+static bool _uffdw_serve(struct uffdw_t * uffdw) {
+	struct _uffdw_batch_t batch;
+
+	pthread_mutex_lock(&uffdw->read_mutex);
+	bool ok = _uffdw_read(uffdw, &batch);
+	pthread_mutex_unlock(&uffdw->read_mutex);
+
+	// a failed fault is the handler's to report, the thread goes on
+	if (!_uffdw_handle_faults(uffdw, &batch)) {
+		LOG("uffd %d: failed to handle faults", uffdw->uffd);
+	}
+	return ok;
+}
+
+static void * _uffdw_run(void * _thread) {
+	struct _uffdw_thread_t * thread = _thread;
+	struct uffdw_t * uffdw = thread->uffdw;
+
+	_uffdw_handler_thread_init(&thread->reader);
+	while (_uffdw_serve(uffdw));
+	_uffdw_rcu_unregister_thread();
+	return NULL;
+}
+
+/**
+ * Let the reactor pick up next message of `uffdw`. Every uffd is
+ * one-shot, so only one thread at a time reads it, like `read_mutex`
+ * does for own threads.
+ */
+static bool _uffdw_reactor_arm(struct uffdw_t * uffdw, struct _uffdw_handle_t * handle, int op) {
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = handle;
+	return epoll_ctl(_uffdw_reactor.epoll_fd, op, uffdw->uffd, &event) == 0;
+}
+
+static void * _uffdw_reactor_run(void * reader) {
+	_uffdw_handler_thread_init(reader);
+	while (true) {
+		struct epoll_event event;
+		int n = epoll_wait(_uffdw_reactor.epoll_fd, &event, 1, -1);
+		if (n < 0 && errno != EINTR) {
+			warn("epoll failed");
+			break;
+		}
+		if (n <= 0) continue;
+
+		// the instance may be gone, or its handle taken by another
+		struct _uffdw_handle_t * handle = event.data.ptr;
+		struct uffdw_t * uffdw = _uffdw_acquire_handle(handle);
+		if (uffdw == NULL) continue;
+
+		struct _uffdw_batch_t batch;
+		int got = _uffdw_try_read(uffdw, &batch);
+		// read failure means the uffd is done for, eg. its process exited
+		if (got < 0) {
+			_uffdw_unlist(uffdw);
+		} else if (!_uffdw_reactor_arm(uffdw, handle, EPOLL_CTL_MOD)) {
+			warn("uffd %d: failed to rearm", uffdw->uffd);
+		}
+		_uffdw_handle_faults(uffdw, &batch);
+
+		_uffdw_release(uffdw);
+	}
+	_uffdw_rcu_unregister_thread();
+	return NULL;
+}
+
+/**
+ * Set up forked processes passed on by threads reading events. It may
+ * wait for the fork to finish, which is fine here.
+ */
+static void * _uffdw_forks_run(void * _) {
+	(void)_;
+
+	struct _uffdw_fork_t request;
+	while (_read_exact(_uffdw_reactor.fork_pipe[0], &request, sizeof(request)) == sizeof(request)) {
+		struct uffdw_t * parent = request.parent;
+		struct uffdw_t * child = _uffdw_fork(parent, request.uffd, request.ranges, request.residency);
+
+		pthread_mutex_lock(&parent->mutex);
+		if (child != NULL) _uffdw_attach_child(parent, child);
+		_uffdw_range_unref(parent, request.ranges);
+		pthread_mutex_unlock(&parent->mutex);
+		_uffdw_release(parent);
+	}
+	warnx("fork pipe closed");
+	return NULL;
+}
+
+/**
+ * Start thread setting up forked processes, unless it's running
+ * already. Must be called with `_uffdw_reactor.mutex` held.
+ */
+static bool _uffdw_forks_start(void) {
+	if (_uffdw_reactor.fork_pipe[1] >= 0) return true;
+	if (pipe2(_uffdw_reactor.fork_pipe, O_CLOEXEC) != 0) return false;
+	if (pthread_create(&_uffdw_reactor.fork_thread, NULL, _uffdw_forks_run, NULL) != 0) {
+		warn("failed to create fork thread");
+		close(_uffdw_reactor.fork_pipe[0]);
+		close(_uffdw_reactor.fork_pipe[1]);
+		_uffdw_reactor.fork_pipe[0] = -1;
+		_uffdw_reactor.fork_pipe[1] = -1;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Hand `uffdw` over to the shared reactor, starting it if needed.
+ */
+static bool _uffdw_reactor_add(struct uffdw_t * uffdw) {
+	pthread_mutex_lock(&_uffdw_reactor.mutex);
+	if (_uffdw_reactor.epoll_fd < 0) {
+		int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0) {
+			pthread_mutex_unlock(&_uffdw_reactor.mutex);
+			return false;
+		}
+		_uffdw_reactor.epoll_fd = epoll_fd;
+		for (size_t i = 0; i < UFFDW_REACTOR_THREADS; i ++) {
+			if (pthread_create(&_uffdw_reactor.threads[i], NULL, _uffdw_reactor_run, &_uffdw_reactor.readers[i]) != 0) {
+				warn("failed to create reactor thread");
+			}
+		}
+	}
+	pthread_mutex_unlock(&_uffdw_reactor.mutex);
+
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	struct _uffdw_handle_t * handle = _uffdw_free_handles;
+	if (handle != NULL) _uffdw_free_handles = handle->next;
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+	// allocated out of the mutex, readers take it while a fork holds malloc locks
+	if (handle == NULL) handle = malloc(sizeof(struct _uffdw_handle_t));
+	if (handle == NULL) return false;
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	handle->uffdw = uffdw;
+	uffdw->handle = handle;
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+
+	return _uffdw_reactor_arm(uffdw, handle, EPOLL_CTL_ADD);
+}
+
+/**
+ * Spawn `threads` handling threads for `uffdw`, or leave it to the
+ * shared reactor if there are none. On failure threads that did start
+ * are left running.
+ */
+static bool _uffdw_start(struct uffdw_t * uffdw, size_t threads) {
+	pthread_mutex_lock(&_uffdw_instances_mutex);
+	uffdw->next_instance = _uffdw_instances;
+	_uffdw_instances = uffdw;
+	pthread_mutex_unlock(&_uffdw_instances_mutex);
+
+	pthread_mutex_lock(&_uffdw_reactor.mutex);
+	bool forks = _uffdw_forks_start();
+	pthread_mutex_unlock(&_uffdw_reactor.mutex);
+	if (!forks) return false;
+
+	if (threads == 0) return _uffdw_reactor_add(uffdw);
+
+	uffdw->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (uffdw->stop_fd < 0) return false;
+	uffdw->threads = malloc(sizeof(struct _uffdw_thread_t) * threads);
+	if (uffdw->threads == NULL) return false;
+	while (uffdw->thread_count < threads) {
+		struct _uffdw_thread_t * thread = &uffdw->threads[uffdw->thread_count];
+		thread->uffdw = uffdw;
+		if (pthread_create(&thread->thread, NULL, _uffdw_run, thread) != 0) {
+			return false;
+		}
+		uffdw->thread_count ++;
+	}
+	return true;
+}
+
+/**
+ * Get features the kernel offers, asking a throwaway uffd (API
+ * handshake can be done only once).
+ */
+static uint64_t _uffdw_available_features(void) {
+	int uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+	if (uffd < 0) return 0;
+	struct uffdio_api api_options;
+	api_options.api = UFFD_API;
+	api_options.features = 0;
+	api_options.ioctls = 0;
+	uint64_t features = ioctl(uffd, UFFDIO_API, &api_options) == 0 ? api_options.features : 0;
+	close(uffd);
+	return features;
+}
+
+/**
+ * Create instance served by `threads` own threads, or by the shared
+ * reactor if 0.
+ */
+static struct uffdw_t * _uffdw_create(size_t threads) {
+	struct uffdw_t * data = _uffdw_alloc();
+	if (data == NULL) {
+		warn("failed to allocate uffdw struture");
+		return NULL;
+	}
+
+	data->pagesize = sysconf(_SC_PAGESIZE);
+	if (data->pagesize < 0) {
+		warn("failed to get pagesize");
+		_uffdw_cleanup(data);
+		return NULL;
+	}
+
+	data->residency = _uffdw_residency_create();
+	if (data->residency == NULL) {
+		_uffdw_cleanup(data);
+		return NULL;
+	}
+
+	data->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (data->uffd < 0) {
+		warn("failed to open userfaultfd descriptor");
+		_uffdw_cleanup(data);
+		return NULL;
+	}
+
+	struct uffdio_api api_options;
+	api_options.api = UFFD_API;
+	api_options.features = (
+		UFFD_FEATURE_EVENT_FORK |
+		UFFD_FEATURE_EVENT_REMAP |
+		UFFD_FEATURE_EVENT_REMOVE |
+		UFFD_FEATURE_EVENT_UNMAP |
+		UFFD_FEATURE_MISSING_HUGETLBFS |
+		UFFD_FEATURE_MISSING_SHMEM
+	);
+	// nice to have
+	api_options.features |= _uffdw_available_features() & (
+		UFFD_FEATURE_PAGEFAULT_FLAG_WP |
+		UFFD_FEATURE_WP_UNPOPULATED |
+		UFFD_FEATURE_THREAD_ID
+	);
+	api_options.ioctls = 0;
+
+	if (ioctl(data->uffd, UFFDIO_API, &api_options) != 0) {
+		warn("failed to handshake with userfaultfd API");
+		_uffdw_cleanup(data);
+		return NULL;
+	}
+	if (!(api_options.ioctls & (1 << _UFFDIO_REGISTER))) {
+		warnx("got invalid response to uffd handshake");
+		_uffdw_cleanup(data);
+		return NULL;
+	}
+	data->features = api_options.features;
+
+	if (!_uffdw_start(data, threads)) {
+		warnx("failed to create uffdw threads");
+		uffdw_cancel(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+struct uffdw_t * uffdw_create() {
+	return uffdw_create_pool(1);
+}
+
+struct uffdw_t * uffdw_create_pool(size_t threads) {
+	assert(threads > 0);
+	return _uffdw_create(threads);
+}
+
+struct uffdw_t * uffdw_create_shared() {
+	return _uffdw_create(0);
+}
+
+static void _uffdw_replay_end(struct uffdw_t * uffdw);
+static void _uffdw_prefetch_end(struct uffdw_t * uffdw);
+
+void uffdw_cancel(struct uffdw_t * data) {
+	LOG("uffd %d: canceling", data->uffd);
+
+	_uffdw_replay_end(data);
+	_uffdw_prefetch_end(data);
+	if (data->trace != NULL) uffdw_record_stop(data);
+	_uffdw_budget_detach(data);
+
+	// stop and wait for threads
+	if (data->stop_fd >= 0 && eventfd_write(data->stop_fd, 1) != 0) {
+		warn("failed to stop uffdw threads");
+	}
+	for (size_t i = 0; i < data->thread_count; i ++) {
+		if (pthread_join(data->threads[i].thread, NULL) != 0) {
+			warn("there was a problem during joining uffdw thread");
+		}
+	}
+
+	// clean thread structure
+	_uffdw_cleanup(data);
+}
+
+int _uffdw_get_uffd(struct uffdw_t * data) {
+	return data->uffd;
+}
+
+bool uffdw_register(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size, size_t handler_offset,
+	uffdw_handler_t handler, void * private_data
+) {
+	struct uffdw_range_options_t options = {0};
+	return uffdw_register_opts(
+		uffdw,
+		offset, size, handler_offset,
+		handler, private_data,
+		&options
+	);
+}
+
+static void _uffdw_range_counters_destroy(struct _uffdw_source_t * source) {
+	free(source);
+}
+
+/**
+ * Get page size of mapping at `address`, as the kernel tells it.
+ */
+static size_t _uffdw_vma_pagesize(struct uffdw_t * uffdw, size_t address) {
+	size_t pagesize = uffdw->pagesize;
+	FILE * smaps = fopen("/proc/self/smaps", "r");
+	if (smaps == NULL) {
+		warn("failed to open smaps");
+		return pagesize;
+	}
+
+	char line[256];
+	bool inside = false;
+	while (fgets(line, sizeof(line), smaps) != NULL) {
+		size_t start, end, kb;
+		if (sscanf(line, "%zx-%zx ", &start, &end) == 2) {
+			inside = start <= address && address < end;
+		} else if (inside && sscanf(line, "KernelPageSize: %zu kB", &kb) == 1) {
+			pagesize = kb * 1024;
+			break;
+		}
+	}
+	fclose(smaps);
+	return pagesize;
+}
+
+/**
+ * Check that range is made of whole pages of its size. Cache stores
+ * base pages only, so larger ones go without it; budgets refuse them.
+ */
+static bool _uffdw_check_pagesize(
+	struct uffdw_range_options_t * options,
+	size_t offset, size_t size, size_t handler_offset
+) {
+	size_t pagesize = options->pagesize;
+	if ((pagesize & (pagesize - 1)) != 0 || (offset | size | handler_offset) & (pagesize - 1)) {
+		warnx("range %p - %p is not made of %zu B pages", (void *)offset, (void *)(offset + size), pagesize);
+		return false;
+	}
+	if (pagesize != (size_t)sysconf(_SC_PAGESIZE)) {
+		options->cache = NULL;
+		if (options->budget != NULL) {
+			warnx("range %p - %p of %zu B pages can't be under budget", (void *)offset, (void *)(offset + size), pagesize);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool uffdw_register_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size, size_t handler_offset,
+	uffdw_handler_t handler, void * private_data,
+	const struct uffdw_range_options_t * options
+) {
+	struct uffdw_registration_t registration = {
+		offset, size, handler_offset,
+		handler, private_data,
+		options
+	};
+	return uffdw_register_many(uffdw, &registration, 1);
+}
+
+/**
+ * Range being registered by `uffdw_register_many()`.
+ */
+struct _uffdw_registering_t {
+	const struct uffdw_registration_t * registration;
+	struct uffdw_range_t like;
+	struct _uffdw_range_counters_t * counters;
+	__u64 mode;
+	__u64 ioctls;
+};
+
+static int _uffdw_registering_cmp(const void * _a, const void * _b) {
+	const struct _uffdw_registering_t * a = _a;
+	const struct _uffdw_registering_t * b = _b;
+	return (a->registration->offset > b->registration->offset) - (a->registration->offset < b->registration->offset);
+}
+
+static void _uffdw_registering_free(struct _uffdw_registering_t * items, size_t count) {
+	for (size_t i = 0; i < count; i ++) free(items[i].counters);
+	free(items);
+}
+
+/**
+ * Check options of `registration` and prepare what registering it
+ * takes into `item`.
+ */
+static bool _uffdw_registering_init(
+	struct uffdw_t * uffdw,
+	const struct uffdw_registration_t * registration,
+	struct _uffdw_registering_t * item
+) {
+	static const struct uffdw_range_options_t defaults = {0};
+	const struct uffdw_range_options_t * options = registration->options != NULL ? registration->options : &defaults;
+	size_t offset = registration->offset;
+	size_t size = registration->size;
+	LOG("uffd %d: register %p - %p", uffdw->uffd, (void *)offset, (void *)(offset + size));
+
+	item->registration = registration;
+	item->like.handler = registration->handler;
+	item->like.handler_data = registration->private_data;
+	item->like.options = *options;
+	size_t readahead = options->readahead == 0 && options->readahead_adaptive ? UFFDW_ADAPTIVE_MAX : options->readahead;
+	item->like.options.readahead = _min(_max(readahead, 1), UFFDW_READAHEAD_MAX);
+	if (options->pagesize == 0) item->like.options.pagesize = uffdw->pagesize;
+	if (!_uffdw_check_pagesize(&item->like.options, offset, size, registration->handler_offset)) return false;
+	// writes to pages swapped in are told by write-protecting them
+	bool swapped = options->budget != NULL && options->budget->swap_fd >= 0;
+	if (swapped && !(uffdw->features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+		warnx("uffd %d: write-protect faults are not available for swap", uffdw->uffd);
+		return false;
+	}
+	item->mode = UFFDIO_REGISTER_MODE_MISSING | (swapped ? UFFDIO_REGISTER_MODE_WP : 0);
+
+	item->counters = malloc(sizeof(struct _uffdw_range_counters_t));
+	if (item->counters == NULL) {
+		warn("failed to allocate range counters");
+		return false;
+	}
+	item->counters->source.destroy = _uffdw_range_counters_destroy;
+	_uffdw_counters_init(&item->counters->counters);
+	item->like.counters = &item->counters->counters;
+	return true;
+}
+
+bool uffdw_register_many(
+	struct uffdw_t * uffdw,
+	const struct uffdw_registration_t * registrations, size_t count
+) {
+	if (count == 0) return true;
+	struct _uffdw_registering_t * items = calloc(count, sizeof(struct _uffdw_registering_t));
+	if (items == NULL) {
+		warn("failed to allocate registrations");
+		return false;
+	}
+	for (size_t i = 0; i < count; i ++) {
+		if (!_uffdw_registering_init(uffdw, &registrations[i], &items[i])) {
+			_uffdw_registering_free(items, count);
+			return false;
+		}
+	}
+	if (count > 1) qsort(items, count, sizeof(struct _uffdw_registering_t), _uffdw_registering_cmp);
+
+	if (pthread_mutex_lock(&uffdw->mutex) != 0) {
+		warnx("failed to acquire lock");
+		_uffdw_registering_free(items, count);
+		return false;
+	}
+
+	// registering again would drop write-protect mode
+	pthread_mutex_lock(&uffdw->dirty_mutex);
+	for (struct _uffdw_dirty_t * area = uffdw->dirty; area != NULL; area = area->next) {
+		for (size_t i = 0; i < count; i ++) {
+			const struct uffdw_registration_t * r = items[i].registration;
+			if (_ranges_overlap(r->offset, r->offset + r->size, area->offset, area->end, NULL, NULL)) {
+				items[i].mode |= UFFDIO_REGISTER_MODE_WP;
+			}
+		}
+	}
+	pthread_mutex_unlock(&uffdw->dirty_mutex);
+
+	// alloc and attach range structures, they must be visible before first fault
+	bool ok = true;
+	size_t added = 0;
+	// numbers are given back on failure, so that traces of registrations that are there fit
+	size_t numbered = uffdw->registrations;
+	_uffdw_write_begin(uffdw);
+	for (; added < count; added ++) {
+		const struct uffdw_registration_t * r = items[added].registration;
+		items[added].like.registration = uffdw->registrations ++;
+		if (!_uffdw_add_range(
+			uffdw,
+			r->offset, r->offset + r->size, r->handler_offset,
+			&items[added].like
+		)) {
+			warn("failed to store uffdw range data");
+			ok = false;
+			break;
+		}
+	}
+	_uffdw_publish(uffdw);
+
+	// adjacent ranges of the same mode are registered with a single syscall
+	size_t done = 0;
+	while (ok && done < count) {
+		size_t last = done;
+		while (
+			last + 1 < count &&
+			items[last + 1].mode == items[done].mode &&
+			items[last].registration->offset + items[last].registration->size == items[last + 1].registration->offset
+		) last ++;
+
+		struct uffdio_register reg;
+		reg.range.start = items[done].registration->offset;
+		reg.range.len = items[last].registration->offset + items[last].registration->size - reg.range.start;
+		reg.mode = items[done].mode;
+		reg.ioctls = 0;
+		if (ioctl(uffdw->uffd, UFFDIO_REGISTER, &reg) != 0) {
+			warn("uffd register syscall failed");
+			ok = false;
+			break;
+		}
+		for (; done <= last; done ++) items[done].ioctls = reg.ioctls;
+	}
+
+	// hugetlbfs mappings can't have zero page, which tells them apart cheaply;
+	// no fault is looked up before the mutex is let go, so it's not too late
+	for (size_t i = 0; ok && i < count; i ++) {
+		struct _uffdw_registering_t * item = &items[i];
+		const struct uffdw_registration_t * r = item->registration;
+		bool guessed = r->options == NULL || r->options->pagesize == 0;
+		if (!guessed || (item->ioctls & (1 << _UFFDIO_ZEROPAGE))) continue;
+		item->like.options.pagesize = _uffdw_vma_pagesize(uffdw, r->offset);
+		ok = _uffdw_check_pagesize(&item->like.options, r->offset, r->size, r->handler_offset);
+		_uffdw_write_begin(uffdw);
+		if (ok) ok = _uffdw_remove_range(uffdw, r->offset, r->offset + r->size);
+		if (ok) ok = _uffdw_add_range(uffdw, r->offset, r->offset + r->size, r->handler_offset, &item->like);
+		_uffdw_publish(uffdw);
+	}
+
+	if (!ok) {
+		// either all of them or none
+		for (size_t i = 0; i < done; i ++) {
+			struct uffdio_range range = {items[i].registration->offset, items[i].registration->size};
+			ioctl(uffdw->uffd, UFFDIO_UNREGISTER, &range);
+		}
+		_uffdw_write_begin(uffdw);
+		for (size_t i = 0; i < added; i ++) {
+			const struct uffdw_registration_t * r = items[i].registration;
+			if (!_uffdw_remove_range(uffdw, r->offset, r->offset + r->size)) {
+				warnx("uffd %d: failed to remove range data", uffdw->uffd);
+			}
+		}
+		_uffdw_publish(uffdw);
+		uffdw->registrations = numbered;
+		pthread_mutex_unlock(&uffdw->mutex);
+		_uffdw_registering_free(items, count);
+		return false;
+	}
+
+	// pages that are there already are never asked for
+	for (size_t i = 0; i < count; i ++) {
+		const struct uffdw_registration_t * r = items[i].registration;
+		_uffdw_residency_seed(uffdw, r->offset, r->offset + r->size, items[i].like.options.pagesize);
+	}
+
+	for (size_t i = 0; i < count; i ++) {
+		items[i].counters->source.next = uffdw->sources;
+		uffdw->sources = &items[i].counters->source;
+		items[i].counters = NULL;
+	}
+
+	pthread_mutex_unlock(&uffdw->mutex);
+	for (size_t i = 0; i < count; i ++) {
+		const struct uffdw_registration_t * r = items[i].registration;
+		if (r->options != NULL && r->options->populate && !uffdw_prefetch(uffdw, r->offset, r->size)) {
+			warnx("uffd %d: failed to populate %p - %p", uffdw->uffd, (void *)r->offset, (void *)(r->offset + r->size));
+		}
+	}
+	_uffdw_registering_free(items, count);
+	return true;
+}
+
+static int _uffdw_unregistering_cmp(const void * _a, const void * _b) {
+	const struct uffdio_range * a = _a;
+	const struct uffdio_range * b = _b;
+	return (a->start > b->start) - (a->start < b->start);
+}
+
+bool uffdw_unregister(struct uffdw_t * uffdw, size_t offset, size_t size) {
+	struct uffdw_registration_t registration = {.offset = offset, .size = size};
+	return uffdw_unregister_many(uffdw, &registration, 1);
+}
+
+bool uffdw_unregister_many(
+	struct uffdw_t * uffdw,
+	const struct uffdw_registration_t * registrations, size_t count
+) {
+	if (count == 0) return true;
+	struct uffdio_range * spans = malloc(sizeof(struct uffdio_range) * count);
+	if (spans == NULL) {
+		warn("failed to allocate ranges to unregister");
+		return false;
+	}
+	for (size_t i = 0; i < count; i ++) {
+		LOG("uffd %d: unregister %p - %p", uffdw->uffd, (void *)registrations[i].offset, (void *)(registrations[i].offset + registrations[i].size));
+		spans[i].start = registrations[i].offset;
+		spans[i].len = registrations[i].size;
+	}
+
+	// touching and overlapping ones go with a single syscall
+	if (count > 1) qsort(spans, count, sizeof(struct uffdio_range), _uffdw_unregistering_cmp);
+	size_t merged = 0;
+	for (size_t i = 1; i < count; i ++) {
+		if (spans[i].start <= spans[merged].start + spans[merged].len) {
+			spans[merged].len = _max(spans[merged].len, spans[i].start + spans[i].len - spans[merged].start);
+		} else {
+			spans[++ merged] = spans[i];
+		}
+	}
+	count = merged + 1;
+
+	if (pthread_mutex_lock(&uffdw->mutex) != 0) {
+		warnx("failed to acquire lock");
+		free(spans);
+		return false;
+	}
+
+	bool ok = true;
+	_uffdw_write_begin(uffdw);
+	for (size_t i = 0; i < count; i ++) {
+		size_t start = spans[i].start;
+		size_t end = start + spans[i].len;
+		if (ioctl(uffdw->uffd, UFFDIO_UNREGISTER, &spans[i]) != 0) {
+			warn("uffd unregister syscall failed");
+			ok = false;
+			continue;
+		}
+		// pages that are there stay, but budgets don't get to drop them anymore
+		_uffdw_budget_event(uffdw, start, end, false, 0);
+		if (!_uffdw_remove_range(uffdw, start, end)) {
+			warnx("uffd %d: failed to remove range data", uffdw->uffd);
+			ok = false;
+		}
+		_uffdw_forget_dirty(uffdw, start, end);
+		_uffdw_residency_update(uffdw, start, end, false);
+	}
+	_uffdw_publish(uffdw);
+	pthread_mutex_unlock(&uffdw->mutex);
+
+	free(spans);
+	return ok;
+}
+
+/**
+ * Get page size of range being handled by this thread.
+ */
+static inline size_t _uffdw_page(void) {
+	return _uffdw_granule != 0 ? _uffdw_granule : (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static enum uffdw_status_t _uffdw_file_handler(
+	int uffd,
+	size_t page_offset, size_t real_page_offset, size_t size,
+	void * _file
+) {
+	struct _uffdw_file_t * file = _file;
+
+	// copy what is in the file straight from its mapping, the rest is zeroes
+	size_t mapped = 0;
+	if (page_offset >= file->offset && page_offset < file->end) {
+		mapped = _min(size, file->end - page_offset);
+	}
+	// pages of the range, which may be huge ones
+	size_t pagesize = _uffdw_page();
+	size_t whole = mapped / pagesize * pagesize;
+	if (whole > 0 && !uffdw_copy(
+		uffd,
+		file->base + (page_offset - file->offset), real_page_offset, whole
+	)) return false;
+	if (whole < mapped) {
+		// data ends in the middle of a page
+		char * page = uffdw_scratch(pagesize);
+		if (page == NULL) return false;
+		memcpy(page, file->base + (page_offset + whole - file->offset), mapped - whole);
+		memset(page + (mapped - whole), 0, pagesize - (mapped - whole));
+		if (!uffdw_copy(uffd, page, real_page_offset + whole, pagesize)) return false;
+		mapped = whole + pagesize;
+	}
+	if (mapped < size && !uffdw_zeropage(
+		uffd,
+		real_page_offset + mapped, size - mapped
+	)) return false;
+	return true;
+}
+
+static void _uffdw_file_destroy(struct _uffdw_source_t * source) {
+	struct _uffdw_file_t * file = (struct _uffdw_file_t *)source;
+	if (file->base != NULL && munmap(file->base, file->size) != 0) {
+		warn("failed to unmap file source");
+	}
+	free(file);
+}
+
+static bool _uffdw_register_file_part(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t file_offset, size_t file_end,
+	const struct uffdw_range_options_t * options
+);
+
+bool uffdw_register_file(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t file_offset
+) {
+	struct uffdw_range_options_t options = {0};
+	return uffdw_register_file_opts(uffdw, offset, size, fd, file_offset, &options);
+}
+
+bool uffdw_register_file_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t file_offset,
+	const struct uffdw_range_options_t * options
+) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		warn("failed to stat file source");
+		return false;
+	}
+	return _uffdw_register_file_part(uffdw, offset, size, fd, file_offset, st.st_size, options);
+}
+
+/**
+ * Register memory range to be filled from file `fd` as if the file ended
+ * at `file_end`.
+ */
+static bool _uffdw_register_file_part(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t file_offset, size_t file_end,
+	const struct uffdw_range_options_t * options
+) {
+	if (file_offset % uffdw->pagesize != 0) {
+		warnx("file offset %zu is not page aligned", file_offset);
+		return false;
+	}
+
+	struct _uffdw_file_t * file = malloc(sizeof(struct _uffdw_file_t));
+	if (file == NULL) return false;
+	file->source.destroy = _uffdw_file_destroy;
+	file->base = NULL;
+	file->offset = file_offset;
+	file->size = 0;
+	file->end = file_offset;
+
+	// map only the part of the file that can be faulted in
+	if (file_end > file_offset) {
+		file->end = _min(file_offset + size, file_end);
+		file->size = (file->end - file_offset + uffdw->pagesize - 1) / uffdw->pagesize * uffdw->pagesize;
+		file->base = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, file_offset);
+		if (file->base == MAP_FAILED) {
+			warn("failed to map file source");
+			free(file);
+			return false;
+		}
+	}
+
+	if (!uffdw_register_opts(
+		uffdw,
+		offset, size, file_offset,
+		_uffdw_file_handler, file,
+		options
+	)) {
+		_uffdw_file_destroy(&file->source);
+		return false;
+	}
+
+	pthread_mutex_lock(&uffdw->mutex);
+	file->source.next = uffdw->sources;
+	uffdw->sources = &file->source;
+	pthread_mutex_unlock(&uffdw->mutex);
+
+	return true;
+}
+
+#define UFFDW_LZ_MIN_MATCH 4
+#define UFFDW_LZ_HASH_BITS 12
+
+static inline uint32_t _uffdw_lz_load(const uint8_t * p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+/**
+ * Write rest of length past the nibble - run of 255s and a final byte.
+ */
+static inline bool _uffdw_lz_put_length(
+	uint8_t * dst, size_t * op, size_t cap,
+	size_t length
+) {
+	for (; length >= 255; length -= 255) {
+		if (*op >= cap) return false;
+		dst[(*op) ++] = 255;
+	}
+	if (*op >= cap) return false;
+	dst[(*op) ++] = length;
+	return true;
+}
+
+static bool _uffdw_lz_put_sequence(
+	uint8_t * dst, size_t * op, size_t cap,
+	const uint8_t * literals, size_t literal_count,
+	size_t offset, size_t match
+) {
+	size_t match_code = match > 0 ? match - UFFDW_LZ_MIN_MATCH : 0;
+	if (*op >= cap) return false;
+	dst[(*op) ++] = _min(literal_count, 15) << 4 | _min(match_code, 15);
+	if (literal_count >= 15 && !_uffdw_lz_put_length(dst, op, cap, literal_count - 15)) return false;
+	if (cap - *op < literal_count) return false;
+	memcpy(dst + *op, literals, literal_count);
+	*op += literal_count;
+
+	// closing sequence has no match
+	if (match == 0) return true;
+	if (cap - *op < 2) return false;
+	dst[(*op) ++] = offset & 0xff;
+	dst[(*op) ++] = offset >> 8;
+	if (match_code >= 15 && !_uffdw_lz_put_length(dst, op, cap, match_code - 15)) return false;
+	return true;
+}
+
+/**
+ * Compress `size` bytes (up to 4 GiB) LZ77 way, in format close to LZ4
+ * block: sequences of token (literal count and match length less 4 in
+ * its nibbles, 15 means more length bytes follow), literals and 2 byte
+ * match offset. The last sequence has literals only.
+ *
+ * Returns compressed size or 0 if it doesn't fit in `cap` bytes.
+ */
+static size_t _uffdw_lz_compress(
+	const uint8_t * src, size_t size,
+	uint8_t * dst, size_t cap
+) {
+	uint32_t table[1 << UFFDW_LZ_HASH_BITS] = {0};
+	size_t ip = 0;
+	size_t anchor = 0;
+	size_t op = 0;
+	while (ip + UFFDW_LZ_MIN_MATCH <= size) {
+		uint32_t sequence = _uffdw_lz_load(src + ip);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - UFFDW_LZ_HASH_BITS);
+		size_t ref = table[hash];
+		table[hash] = ip;
+		if (ref >= ip || ip - ref > 0xffff || _uffdw_lz_load(src + ref) != sequence) {
+			ip ++;
+			continue;
+		}
+
+		size_t match = UFFDW_LZ_MIN_MATCH;
+		while (ip + match < size && src[ref + match] == src[ip + match]) match ++;
+		if (!_uffdw_lz_put_sequence(
+			dst, &op, cap,
+			src + anchor, ip - anchor,
+			ip - ref, match
+		)) return 0;
+		ip += match;
+		anchor = ip;
+	}
+	if (!_uffdw_lz_put_sequence(
+		dst, &op, cap,
+		src + anchor, size - anchor,
+		0, 0
+	)) return 0;
+	return op;
+}
+
+static inline bool _uffdw_lz_get_length(
+	const uint8_t * src, size_t * ip, size_t size,
+	size_t * length
+) {
+	uint8_t byte;
+	do {
+		if (*ip >= size) return false;
+		byte = src[(*ip) ++];
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+/**
+ * Decompress what `_uffdw_lz_compress()` made, into exactly `expected`
+ * bytes. Input is not trusted.
+ */
+static bool _uffdw_lz_decompress(
+	const uint8_t * src, size_t size,
+	uint8_t * dst, size_t expected
+) {
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < size) {
+		uint8_t token = src[ip ++];
+		size_t literals = token >> 4;
+		if (literals == 15 && !_uffdw_lz_get_length(src, &ip, size, &literals)) return false;
+		if (size - ip < literals || expected - op < literals) return false;
+		memcpy(dst + op, src + ip, literals);
+		ip += literals;
+		op += literals;
+		if (ip == size) break;
+
+		if (size - ip < 2) return false;
+		size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+		ip += 2;
+		size_t match = token & 15;
+		if (match == 15 && !_uffdw_lz_get_length(src, &ip, size, &match)) return false;
+		match += UFFDW_LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || expected - op < match) return false;
+		if (offset >= match) {
+			memcpy(dst + op, dst + op - offset, match);
+		} else {
+			// overlapping match repeats the last `offset` bytes
+			for (size_t i = 0; i < match; i ++) dst[op + i] = dst[op + i - offset];
+		}
+		op += match;
+	}
+	return op == expected;
+}
+
+static bool _uffdw_pwrite_all(int fd, const void * buf, size_t size, size_t offset) {
+	while (size > 0) {
+		ssize_t written = pwrite(fd, buf, size, offset);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			warn("failed to write packed image");
+			return false;
+		}
+		buf = (const char *)buf + written;
+		size -= written;
+		offset += written;
+	}
+	return true;
+}
+
+static bool _uffdw_pack_block_size_valid(size_t block_size) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	if (
+		block_size < page_size || block_size > UFFDW_PACK_BLOCK_MAX ||
+		(block_size & (block_size - 1)) != 0
+	) {
+		warnx("block size %zu is not a power of two from page size to %d", block_size, UFFDW_PACK_BLOCK_MAX);
+		return false;
+	}
+	return true;
+}
+
+bool uffdw_pack(int fd, int packed_fd, size_t block_size) {
+	if (!_uffdw_pack_block_size_valid(block_size)) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		warn("failed to stat file to pack");
+		return false;
+	}
+	struct _uffdw_pack_header_t header = {
+		.magic = UFFDW_PACK_MAGIC,
+		.size = st.st_size,
+		.block_size = block_size,
+		.blocks = 0,
+	};
+	size_t blocks = (header.size + block_size - 1) / block_size;
+	if (blocks > UINT32_MAX) {
+		warnx("file is too big to pack in %zu B blocks", block_size);
+		return false;
+	}
+	header.blocks = blocks;
+
+	const uint8_t * data = NULL;
+	if (header.size > 0) {
+		data = mmap(NULL, header.size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			warn("failed to map file to pack");
+			return false;
+		}
+	}
+	uint64_t * index = malloc((blocks + 1) * sizeof(uint64_t));
+	uint8_t * buf = malloc(block_size);
+	bool ok = index != NULL && buf != NULL;
+
+	// blocks follow the index, which is written when it's known
+	if (ok) index[0] = sizeof(header) + (blocks + 1) * sizeof(uint64_t);
+	for (size_t block = 0; ok && block < blocks; block ++) {
+		size_t size = _min(block_size, header.size - block * block_size);
+		const uint8_t * src = data + block * block_size;
+		// store as is what doesn't get smaller
+		size_t compressed = _uffdw_lz_compress(src, size, buf, size - 1);
+		if (compressed > 0) {
+			ok = _uffdw_pwrite_all(packed_fd, buf, compressed, index[block]);
+		} else {
+			compressed = size;
+			ok = _uffdw_pwrite_all(packed_fd, src, size, index[block]);
+		}
+		index[block + 1] = index[block] + compressed;
+	}
+	ok = ok && _uffdw_pwrite_all(packed_fd, &header, sizeof(header), 0);
+	ok = ok && _uffdw_pwrite_all(packed_fd, index, (blocks + 1) * sizeof(uint64_t), sizeof(header));
+
+	free(buf);
+	free(index);
+	if (data != NULL && munmap((void *)data, header.size) != 0) warn("failed to unmap packed file");
+	return ok;
+}
+
+/**
+ * Get block of packed image, `size` is its unpacked size.
+ */
+static bool _uffdw_unpack_block(
+	const struct _uffdw_packed_t * packed, size_t block,
+	char * dst, size_t size
+) {
+	const char * src = packed->base + packed->index[block];
+	size_t stored = packed->index[block + 1] - packed->index[block];
+	if (stored == size) {
+		memcpy(dst, src, size);
+		return true;
+	}
+	if (!_uffdw_lz_decompress((const uint8_t *)src, stored, (uint8_t *)dst, size)) {
+		warnx("packed block %zu is corrupted", block);
+		return false;
+	}
+	return true;
+}
+
+static enum uffdw_status_t _uffdw_packed_handler(
+	int uffd,
+	size_t page_offset, size_t real_page_offset, size_t size,
+	void * _packed
+) {
+	struct _uffdw_packed_t * packed = _packed;
+	size_t data_size = packed->header->size;
+	size_t block_size = packed->header->block_size;
+
+	// blocks are unpacked right where they are copied from
+	char * buf = uffdw_scratch(block_size);
+	if (buf == NULL) return UFFDW_FAILED;
+	size_t done = 0;
+	while (done < size && page_offset + done < data_size) {
+		size_t at = page_offset + done;
+		size_t block = at / block_size;
+		size_t block_offset = block * block_size;
+		size_t unpacked = _min(block_size, data_size - block_offset);
+		if (!_uffdw_unpack_block(packed, block, buf, unpacked)) return UFFDW_FAILED;
+		memset(buf + unpacked, 0, block_size - unpacked);
+
+		size_t len = _min(size - done, block_offset + block_size - at);
+		if (!uffdw_copy(uffd, buf + (at - block_offset), real_page_offset + done, len)) return UFFDW_FAILED;
+		done += len;
+	}
+	if (done < size && !uffdw_zeropage(uffd, real_page_offset + done, size - done)) return UFFDW_FAILED;
+	return UFFDW_DONE;
+}
+
+static void _uffdw_packed_destroy(struct _uffdw_source_t * source) {
+	struct _uffdw_packed_t * packed = (struct _uffdw_packed_t *)source;
+	if (packed->base != NULL && munmap(packed->base, packed->map_size) != 0) {
+		warn("failed to unmap packed source");
+	}
+	free(packed);
+}
+
+/**
+ * Check that packed image is whole, so that faults can trust its index.
+ */
+static bool _uffdw_packed_valid(const struct _uffdw_packed_t * packed) {
+	const struct _uffdw_pack_header_t * header = packed->header;
+	if (packed->map_size < sizeof(*header) || memcmp(header->magic, UFFDW_PACK_MAGIC, sizeof(header->magic)) != 0) {
+		warnx("not a packed image");
+		return false;
+	}
+	if (!_uffdw_pack_block_size_valid(header->block_size)) return false;
+	size_t blocks = header->blocks;
+	if (
+		blocks != (header->size + header->block_size - 1) / header->block_size ||
+		(packed->map_size - sizeof(*header)) / sizeof(uint64_t) < blocks + 1
+	) {
+		warnx("packed image index is cut short");
+		return false;
+	}
+	if (packed->index[0] < sizeof(*header) + (blocks + 1) * sizeof(uint64_t)) {
+		warnx("packed image blocks overlap its index");
+		return false;
+	}
+	for (size_t block = 0; block < blocks; block ++) {
+		size_t size = _min(header->block_size, header->size - block * header->block_size);
+		if (
+			packed->index[block + 1] <= packed->index[block] ||
+			packed->index[block + 1] - packed->index[block] > size ||
+			packed->index[block + 1] > packed->map_size
+		) {
+			warnx("packed block %zu is out of place", block);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool uffdw_register_packed(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset
+) {
+	struct uffdw_range_options_t options = {0};
+	return uffdw_register_packed_opts(uffdw, offset, size, fd, data_offset, &options);
+}
+
+bool uffdw_register_packed_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset,
+	const struct uffdw_range_options_t * options
+) {
+	if (data_offset % uffdw->pagesize != 0) {
+		warnx("data offset %zu is not page aligned", data_offset);
+		return false;
+	}
 
-				struct uffdw_range_t * range = _uffdw_get_range(
-					uffdw,
-					msg.arg.pagefault.address, msg.arg.pagefault.address + 1
-				);
-				if (range == NULL) {
-					warnx("uffd %d: PAGEFAULT on non registered page %p", uffdw->uffd, (void *)msg.arg.pagefault.address);
-					uffdw_zeropage(uffdw->uffd, msg.arg.pagefault.address, uffdw->pagesize);
-				} else {
-					if(!range->handler(
-						uffdw->uffd,
-						msg.arg.pagefault.address - range->offset + range->handler_offset,
-						msg.arg.pagefault.address,
-						range->handler_data
-					)) {
-						LOG("error: uffdw handler failed");
-						pthread_mutex_unlock(&uffdw->mutex);
-						return NULL;
-					}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		warn("failed to stat packed source");
+		return false;
+	}
+	if (st.st_size == 0) {
+		warnx("not a packed image");
+		return false;
+	}
+
+	struct _uffdw_packed_t * packed = malloc(sizeof(struct _uffdw_packed_t));
+	if (packed == NULL) return false;
+	packed->source.destroy = _uffdw_packed_destroy;
+	packed->map_size = st.st_size;
+	packed->base = mmap(NULL, packed->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (packed->base == MAP_FAILED) {
+		warn("failed to map packed source");
+		free(packed);
+		return false;
+	}
+	packed->header = (const struct _uffdw_pack_header_t *)packed->base;
+	packed->index = (const uint64_t *)(packed->base + sizeof(struct _uffdw_pack_header_t));
+	if (!_uffdw_packed_valid(packed)) {
+		_uffdw_packed_destroy(&packed->source);
+		return false;
+	}
+
+	// fault in whole blocks, so that each is unpacked once
+	struct uffdw_range_options_t packed_options = *options;
+	packed_options.readahead = _max(options->readahead, packed->header->block_size / uffdw->pagesize);
+
+	if (!uffdw_register_opts(
+		uffdw,
+		offset, size, data_offset,
+		_uffdw_packed_handler, packed,
+		&packed_options
+	)) {
+		_uffdw_packed_destroy(&packed->source);
+		return false;
+	}
+
+	pthread_mutex_lock(&uffdw->mutex);
+	packed->source.next = uffdw->sources;
+	uffdw->sources = &packed->source;
+	pthread_mutex_unlock(&uffdw->mutex);
+
+	return true;
+}
+
+static bool _uffdw_is_zero(const void * data, size_t size);
+
+bool uffdw_make_sparse(int fd, int image_fd) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		warn("failed to stat file to make sparse");
+		return false;
+	}
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	struct _uffdw_sparse_header_t header = {
+		.magic = UFFDW_SPARSE_MAGIC,
+		.size = st.st_size,
+		.pagesize = pagesize,
+		.extents = 0,
+	};
+	size_t pages_end = (header.size + pagesize - 1) / pagesize * pagesize;
+
+	// the last page is zeroes past the end of the file
+	const char * data = NULL;
+	if (header.size > 0) {
+		data = mmap(NULL, header.size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			warn("failed to map file to make sparse");
+			return false;
+		}
+	}
+
+	// holes are skipped without reading them, data is looked at page by page
+	struct _uffdw_extent_t * extents = NULL;
+	size_t capacity = 0;
+	bool ok = true;
+	size_t at = 0;
+	while (ok && at < pages_end) {
+		off_t start = lseek(fd, at, SEEK_DATA);
+		if (start < 0 && errno == ENXIO) break;
+		off_t hole = start < 0 ? -1 : lseek(fd, start, SEEK_HOLE);
+		// files that can't tell holes apart are data all over
+		if (start < 0 || hole < 0) {
+			start = at;
+			hole = header.size;
+		}
+		size_t begin = _max(at, (size_t)start / pagesize * pagesize);
+		size_t end = _min(((size_t)hole + pagesize - 1) / pagesize * pagesize, pages_end);
+
+		for (size_t page = begin; page < end; page += pagesize) {
+			if (_uffdw_is_zero(data + page, pagesize)) continue;
+			struct _uffdw_extent_t * last = header.extents > 0 ? &extents[header.extents - 1] : NULL;
+			if (last != NULL && last->offset + last->length == page) {
+				last->length += pagesize;
+				continue;
+			}
+			if (header.extents == UINT32_MAX) {
+				warnx("file has too many extents");
+				ok = false;
+				break;
+			}
+			if (header.extents == capacity) {
+				capacity = _max(capacity * 2, 64);
+				struct _uffdw_extent_t * more = realloc(extents, capacity * sizeof(struct _uffdw_extent_t));
+				if (more == NULL) {
+					warn("failed to allocate extents");
+					ok = false;
+					break;
 				}
+				extents = more;
+			}
+			extents[header.extents ++] = (struct _uffdw_extent_t){page, pagesize, 0};
+		}
+		at = end;
+	}
+
+	// data follows the index, page aligned, so that it maps well
+	size_t position = sizeof(header) + header.extents * sizeof(struct _uffdw_extent_t);
+	position = (position + pagesize - 1) / pagesize * pagesize;
+	for (size_t i = 0; ok && i < header.extents; i ++) {
+		extents[i].data = position;
+		ok = _uffdw_pwrite_all(
+			image_fd,
+			data + extents[i].offset, _min(extents[i].length, header.size - extents[i].offset),
+			position
+		);
+		position += extents[i].length;
+	}
+	if (ok && ftruncate(image_fd, position) != 0) {
+		warn("failed to resize sparse image");
+		ok = false;
+	}
+	ok = ok && _uffdw_pwrite_all(image_fd, &header, sizeof(header), 0);
+	ok = ok && _uffdw_pwrite_all(image_fd, extents, header.extents * sizeof(struct _uffdw_extent_t), sizeof(header));
+
+	free(extents);
+	if (data != NULL && munmap((void *)data, header.size) != 0) warn("failed to unmap file made sparse");
+	return ok;
+}
+
+/**
+ * Get first extent of sparse image that ends past `at`, `extents` of the
+ * header if there is none.
+ */
+static size_t _uffdw_sparse_find(const struct _uffdw_sparse_t * sparse, size_t at) {
+	size_t low = 0;
+	size_t high = sparse->header->extents;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const struct _uffdw_extent_t * extent = &sparse->extents[middle];
+		if (extent->offset + extent->length > at) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+	return low;
+}
+
+static enum uffdw_status_t _uffdw_sparse_handler(
+	int uffd,
+	size_t page_offset, size_t real_page_offset, size_t size,
+	void * _sparse
+) {
+	struct _uffdw_sparse_t * sparse = _sparse;
+
+	// each run of data is copied straight from the mapping, each gap between them is zeroes
+	size_t extent = _uffdw_sparse_find(sparse, page_offset);
+	size_t done = 0;
+	while (done < size) {
+		size_t at = page_offset + done;
+		const struct _uffdw_extent_t * e = extent < sparse->header->extents ? &sparse->extents[extent] : NULL;
+		size_t len;
+		if (e != NULL && e->offset <= at) {
+			len = _min(size - done, e->offset + e->length - at);
+			if (!uffdw_copy(uffd, sparse->base + e->data + (at - e->offset), real_page_offset + done, len)) return UFFDW_FAILED;
+			extent ++;
+		} else {
+			len = e != NULL ? _min(size - done, e->offset - at) : size - done;
+			if (!uffdw_zeropage(uffd, real_page_offset + done, len)) return UFFDW_FAILED;
+		}
+		done += len;
+	}
+	return UFFDW_DONE;
+}
+
+static void _uffdw_sparse_destroy(struct _uffdw_source_t * source) {
+	struct _uffdw_sparse_t * sparse = (struct _uffdw_sparse_t *)source;
+	if (sparse->base != NULL && munmap(sparse->base, sparse->map_size) != 0) {
+		warn("failed to unmap sparse source");
+	}
+	free(sparse);
+}
+
+/**
+ * Check that sparse image is whole and its extents are sorted, so that
+ * faults can trust its index.
+ */
+static bool _uffdw_sparse_valid(const struct _uffdw_sparse_t * sparse, size_t pagesize) {
+	const struct _uffdw_sparse_header_t * header = sparse->header;
+	if (sparse->map_size < sizeof(*header) || memcmp(header->magic, UFFDW_SPARSE_MAGIC, sizeof(header->magic)) != 0) {
+		warnx("not a sparse image");
+		return false;
+	}
+	size_t granule = header->pagesize;
+	if (granule == 0 || (granule & (granule - 1)) != 0 || granule % pagesize != 0) {
+		warnx("sparse image of %zu B pages can't be served in %zu B ones", granule, pagesize);
+		return false;
+	}
+	size_t extents = header->extents;
+	if ((sparse->map_size - sizeof(*header)) / sizeof(struct _uffdw_extent_t) < extents) {
+		warnx("sparse image index is cut short");
+		return false;
+	}
+	size_t index_end = sizeof(*header) + extents * sizeof(struct _uffdw_extent_t);
+	size_t pages_end = (header->size + granule - 1) / granule * granule;
+	size_t end = 0;
+	for (size_t i = 0; i < extents; i ++) {
+		const struct _uffdw_extent_t * e = &sparse->extents[i];
+		if (
+			e->length == 0 || (e->offset | e->length | e->data) % granule != 0 ||
+			e->offset < end || e->offset > pages_end || e->length > pages_end - e->offset ||
+			e->data < index_end || e->data > sparse->map_size || e->length > sparse->map_size - e->data
+		) {
+			warnx("sparse extent %zu is out of place", i);
+			return false;
+		}
+		end = e->offset + e->length;
+	}
+	return true;
+}
+
+bool uffdw_register_sparse(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset
+) {
+	struct uffdw_range_options_t options = {0};
+	return uffdw_register_sparse_opts(uffdw, offset, size, fd, data_offset, &options);
+}
+
+bool uffdw_register_sparse_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	int fd, size_t data_offset,
+	const struct uffdw_range_options_t * options
+) {
+	if (data_offset % uffdw->pagesize != 0) {
+		warnx("data offset %zu is not page aligned", data_offset);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		warn("failed to stat sparse source");
+		return false;
+	}
+	if (st.st_size == 0) {
+		warnx("not a sparse image");
+		return false;
+	}
+
+	struct _uffdw_sparse_t * sparse = malloc(sizeof(struct _uffdw_sparse_t));
+	if (sparse == NULL) return false;
+	sparse->source.destroy = _uffdw_sparse_destroy;
+	sparse->map_size = st.st_size;
+	sparse->base = mmap(NULL, sparse->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (sparse->base == MAP_FAILED) {
+		warn("failed to map sparse source");
+		free(sparse);
+		return false;
+	}
+	sparse->header = (const struct _uffdw_sparse_header_t *)sparse->base;
+	sparse->extents = (const struct _uffdw_extent_t *)(sparse->base + sizeof(struct _uffdw_sparse_header_t));
+	if (!_uffdw_sparse_valid(sparse, uffdw->pagesize)) {
+		_uffdw_sparse_destroy(&sparse->source);
+		return false;
+	}
+
+	if (!uffdw_register_opts(
+		uffdw,
+		offset, size, data_offset,
+		_uffdw_sparse_handler, sparse,
+		options
+	)) {
+		_uffdw_sparse_destroy(&sparse->source);
+		return false;
+	}
+
+	pthread_mutex_lock(&uffdw->mutex);
+	sparse->source.next = uffdw->sources;
+	uffdw->sources = &sparse->source;
+	pthread_mutex_unlock(&uffdw->mutex);
+
+	return true;
+}
+
+/**
+ * Send whole `size` bytes to socket `fd`. Peer that went away is an
+ * error, not a signal.
+ */
+static bool _uffdw_send_all(int fd, const void * buf, size_t size) {
+	while (size > 0) {
+		ssize_t sent = send(fd, buf, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		buf = (const char *)buf + sent;
+		size -= sent;
+	}
+	return true;
+}
+
+/**
+ * Take idle connection to page server, or make a new one. Connections
+ * are mapped rather than allocated, a fork may be waiting for the
+ * handler asking for one.
+ */
+static struct _uffdw_connection_t * _uffdw_remote_connect(struct _uffdw_remote_t * remote) {
+	pthread_mutex_lock(&remote->mutex);
+	struct _uffdw_connection_t * connection = remote->idle;
+	if (connection != NULL) remote->idle = connection->next;
+	pthread_mutex_unlock(&remote->mutex);
+	if (connection != NULL) return connection;
+
+	size_t map_size = sizeof(struct _uffdw_connection_t);
+	connection = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (connection == MAP_FAILED) {
+		warn("failed to map page server connection");
+		return NULL;
+	}
+	connection->map_size = map_size;
+	connection->next = NULL;
+	connection->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connection->fd < 0 || connect(connection->fd, (struct sockaddr *)&remote->address, sizeof(remote->address)) != 0) {
+		warn("failed to connect to page server %s", remote->address.sun_path);
+		if (connection->fd >= 0) close(connection->fd);
+		munmap(connection, map_size);
+		return NULL;
+	}
+	return connection;
+}
+
+static void _uffdw_connection_close(struct _uffdw_connection_t * connection) {
+	if (close(connection->fd) != 0) warn("failed to close page server connection");
+	if (munmap(connection, connection->map_size) != 0) warn("failed to unmap page server connection");
+}
+
+/**
+ * Give connection back, or close it if it's out of sync after failure.
+ */
+static void _uffdw_remote_release(
+	struct _uffdw_remote_t * remote, struct _uffdw_connection_t * connection, bool ok
+) {
+	if (!ok) {
+		_uffdw_connection_close(connection);
+		return;
+	}
+	pthread_mutex_lock(&remote->mutex);
+	connection->next = remote->idle;
+	remote->idle = connection;
+	pthread_mutex_unlock(&remote->mutex);
+}
+
+static enum uffdw_status_t _uffdw_remote_handler(
+	int uffd,
+	size_t page_offset, size_t real_page_offset, size_t size,
+	void * _remote
+) {
+	struct _uffdw_remote_t * remote = _remote;
+	size_t chunk = _max(UFFDW_REMOTE_CHUNK, remote->pagesize);
+	char * buffer = uffdw_scratch(chunk);
+	if (buffer == NULL) return UFFDW_FAILED;
+	struct _uffdw_connection_t * connection = _uffdw_remote_connect(remote);
+	if (connection == NULL) return UFFDW_FAILED;
+
+	// faulting page goes first, predicted ones follow in chunks, all asked for at once
+	size_t first = _min(size, remote->pagesize);
+	size_t count = 1 + (size - first + chunk - 1) / chunk;
+	struct _uffdw_page_request_t requests[count];
+	requests[0] = (struct _uffdw_page_request_t){page_offset, first};
+	for (size_t i = 1, at = first; at < size; i ++, at += chunk) {
+		requests[i] = (struct _uffdw_page_request_t){page_offset + at, _min(chunk, size - at)};
+	}
+	bool ok = _uffdw_send_all(connection->fd, requests, sizeof(struct _uffdw_page_request_t) * count);
+
+	// nobody waits for predicted pages, faults that came on them are woken after the handler
+	bool dontwake = _uffdw_copy_dontwake;
+	bool copied = true;
+	size_t done = 0;
+	for (size_t i = 0; ok && i < count; i ++) {
+		struct _uffdw_page_request_t reply;
+		ok = (
+			_read_exact(connection->fd, &reply, sizeof(reply)) == sizeof(reply) &&
+			reply.offset == requests[i].offset && reply.size == requests[i].size &&
+			_read_exact(connection->fd, buffer, reply.size) == reply.size
+		);
+		if (!ok) {
+			warnx("page server %s failed to send %p - %p", remote->address.sun_path, (void *)requests[i].offset, (void *)(requests[i].offset + requests[i].size));
+			break;
+		}
+		// replies after a failed copy are still read, so that the connection stays in sync
+		if (!copied) continue;
+		_uffdw_copy_dontwake = dontwake || i > 0;
+		copied = uffdw_copy(uffd, buffer, real_page_offset + done, reply.size);
+		if (copied) done += reply.size;
+	}
+	_uffdw_copy_dontwake = dontwake;
+	_uffdw_remote_release(remote, connection, ok);
+
+	// only the faulting page is a must
+	return done > 0 ? UFFDW_DONE : UFFDW_FAILED;
+}
+
+static void _uffdw_remote_destroy(struct _uffdw_source_t * source) {
+	struct _uffdw_remote_t * remote = (struct _uffdw_remote_t *)source;
+	while (remote->idle != NULL) {
+		struct _uffdw_connection_t * next = remote->idle->next;
+		_uffdw_connection_close(remote->idle);
+		remote->idle = next;
+	}
+	pthread_mutex_destroy(&remote->mutex);
+	free(remote);
+}
+
+bool uffdw_register_remote(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	const char * path, size_t data_offset
+) {
+	struct uffdw_range_options_t options = {0};
+	return uffdw_register_remote_opts(uffdw, offset, size, path, data_offset, &options);
+}
+
+bool uffdw_register_remote_opts(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	const char * path, size_t data_offset,
+	const struct uffdw_range_options_t * options
+) {
+	struct _uffdw_remote_t * remote = malloc(sizeof(struct _uffdw_remote_t));
+	if (remote == NULL) return false;
+	remote->source.destroy = _uffdw_remote_destroy;
+	memset(&remote->address, 0, sizeof(remote->address));
+	remote->address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(remote->address.sun_path)) {
+		warnx("page server path %s is too long", path);
+		free(remote);
+		return false;
+	}
+	strcpy(remote->address.sun_path, path);
+	remote->pagesize = uffdw->pagesize;
+	if (options->pagesize != 0) remote->pagesize = options->pagesize;
+	pthread_mutex_init(&remote->mutex, NULL);
+	remote->idle = NULL;
+
+	// server that isn't there fails here rather than on first fault
+	struct _uffdw_connection_t * connection = _uffdw_remote_connect(remote);
+	if (connection == NULL) {
+		_uffdw_remote_destroy(&remote->source);
+		return false;
+	}
+	_uffdw_remote_release(remote, connection, true);
+
+	// every fault brings predicted pages along
+	struct uffdw_range_options_t remote_options = *options;
+	if (options->readahead == 0) remote_options.readahead = UFFDW_REMOTE_PREDICT;
+
+	if (!uffdw_register_opts(
+		uffdw,
+		offset, size, data_offset,
+		_uffdw_remote_handler, remote,
+		&remote_options
+	)) {
+		_uffdw_remote_destroy(&remote->source);
+		return false;
+	}
+
+	pthread_mutex_lock(&uffdw->mutex);
+	remote->source.next = uffdw->sources;
+	uffdw->sources = &remote->source;
+	pthread_mutex_unlock(&uffdw->mutex);
+
+	return true;
+}
+
+/**
+ * Client of `uffdw_serve_pages()`.
+ */
+struct _uffdw_page_client_t {
+	int fd;
+	int data_fd;
+};
+
+static void * _uffdw_serve_client(void * _client) {
+	struct _uffdw_page_client_t client = *(struct _uffdw_page_client_t *)_client;
+	free(_client);
+
+	char * buf = uffdw_scratch(UFFDW_REMOTE_CHUNK);
+	struct _uffdw_page_request_t request;
+	while (buf != NULL && _read_exact(client.fd, &request, sizeof(request)) == sizeof(request)) {
+		if (!_uffdw_send_all(client.fd, &request, sizeof(request))) break;
+		// data goes in chunks, zeroes past the end of the file
+		bool ok = true;
+		for (size_t done = 0; ok && done < request.size; ) {
+			size_t len = _min(UFFDW_REMOTE_CHUNK, request.size - done);
+			ssize_t got = pread(client.data_fd, buf, len, request.offset + done);
+			if (got < 0) {
+				warn("failed to read served data");
+				ok = false;
+				break;
+			}
+			memset(buf + got, 0, len - got);
+			ok = _uffdw_send_all(client.fd, buf, len);
+			done += len;
+		}
+		if (!ok) break;
+	}
+
+	close(client.fd);
+	return NULL;
+}
+
+bool uffdw_serve_pages(int listen_fd, int fd) {
+	for (;;) {
+		int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			// that's how shut down socket tells it
+			if (errno == EINVAL) return true;
+			warn("failed to accept page client");
+			return false;
+		}
+
+		struct _uffdw_page_client_t * client = malloc(sizeof(struct _uffdw_page_client_t));
+		pthread_t thread;
+		if (client == NULL) {
+			warn("failed to allocate page client");
+			close(client_fd);
+			continue;
+		}
+		client->fd = client_fd;
+		client->data_fd = fd;
+		if (pthread_create(&thread, NULL, _uffdw_serve_client, client) != 0) {
+			warnx("failed to create thread for page client");
+			close(client_fd);
+			free(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+static int _uffdw_elf_prot(ElfW(Word) flags) {
+	int prot = PROT_NONE;
+	if (flags & PF_R) prot |= PROT_READ;
+	if (flags & PF_W) prot |= PROT_WRITE;
+	if (flags & PF_X) prot |= PROT_EXEC;
+	return prot;
+}
+
+/**
+ * Read and check program headers of ELF file `fd`. Returns them in
+ * malloc'ed array, NULL if the file can't be loaded.
+ */
+static ElfW(Phdr) * _uffdw_elf_headers(int fd, size_t pagesize, ElfW(Ehdr) * ehdr) {
+	if (!_uffdw_pread_all(fd, ehdr, sizeof(*ehdr), 0)) {
+		warnx("failed to read ELF header");
+		return NULL;
+	}
+	if (
+		memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+		ehdr->e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32) ||
+		(ehdr->e_type != ET_EXEC && ehdr->e_type != ET_DYN) ||
+		ehdr->e_phentsize != sizeof(ElfW(Phdr)) || ehdr->e_phnum == 0
+	) {
+		warnx("not a loadable ELF file");
+		return NULL;
+	}
+
+	ElfW(Phdr) * phdrs = malloc(sizeof(ElfW(Phdr)) * ehdr->e_phnum);
+	if (phdrs == NULL) return NULL;
+	if (!_uffdw_pread_all(fd, phdrs, sizeof(ElfW(Phdr)) * ehdr->e_phnum, ehdr->e_phoff)) {
+		warnx("failed to read ELF program headers");
+		free(phdrs);
+		return NULL;
+	}
+
+	// segments come in address order, each on pages of its own
+	size_t end = 0;
+	for (size_t i = 0; i < ehdr->e_phnum; i ++) {
+		ElfW(Phdr) * phdr = &phdrs[i];
+		if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) continue;
+		if (
+			phdr->p_filesz > phdr->p_memsz ||
+			phdr->p_offset % pagesize != phdr->p_vaddr % pagesize ||
+			phdr->p_vaddr / pagesize * pagesize < end
+		) {
+			warnx("ELF segment %zu can't be mapped", i);
+			free(phdrs);
+			return NULL;
+		}
+		end = (phdr->p_vaddr + phdr->p_memsz + pagesize - 1) / pagesize * pagesize;
+	}
+	if (end == 0) {
+		warnx("ELF file has nothing to load");
+		free(phdrs);
+		return NULL;
+	}
+	return phdrs;
+}
+
+bool uffdw_load_elf(struct uffdw_t * uffdw, int fd, struct uffdw_elf_t * elf) {
+	struct uffdw_range_options_t options = {0};
+	return uffdw_load_elf_opts(uffdw, fd, elf, &options);
+}
+
+bool uffdw_load_elf_opts(
+	struct uffdw_t * uffdw,
+	int fd, struct uffdw_elf_t * elf,
+	const struct uffdw_range_options_t * options
+) {
+	size_t pagesize = uffdw->pagesize;
+	ElfW(Ehdr) ehdr;
+	ElfW(Phdr) * phdrs = _uffdw_elf_headers(fd, pagesize, &ehdr);
+	if (phdrs == NULL) return false;
+
+	size_t first = SIZE_MAX, end = 0;
+	for (size_t i = 0; i < ehdr.e_phnum; i ++) {
+		if (phdrs[i].p_type != PT_LOAD || phdrs[i].p_memsz == 0) continue;
+		first = _min(first, phdrs[i].p_vaddr / pagesize * pagesize);
+		end = _max(end, (phdrs[i].p_vaddr + phdrs[i].p_memsz + pagesize - 1) / pagesize * pagesize);
+	}
+
+	// reserve the whole span, gaps between segments stay inaccessible
+	void * base = mmap(
+		ehdr.e_type == ET_EXEC ? (void *)first : NULL, end - first,
+		PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+		(ehdr.e_type == ET_EXEC ? MAP_FIXED_NOREPLACE : 0),
+		-1, 0
+	);
+	if (base == MAP_FAILED) {
+		warn("failed to reserve space for ELF file");
+		free(phdrs);
+		return false;
+	}
+	if (ehdr.e_type == ET_EXEC && (size_t)base != first) {
+		warnx("ELF file's addresses are taken");
+		munmap(base, end - first);
+		free(phdrs);
+		return false;
+	}
+	elf->base = (size_t)base;
+	elf->size = end - first;
+	elf->bias = (size_t)base - first;
+	elf->entry = ehdr.e_entry != 0 ? elf->bias + ehdr.e_entry : 0;
+
+	bool ok = true;
+	for (size_t i = 0; ok && i < ehdr.e_phnum; i ++) {
+		ElfW(Phdr) * phdr = &phdrs[i];
+		if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) continue;
+
+		// segment's pages, file data first and then zeroes up to its size
+		size_t lead = phdr->p_vaddr % pagesize;
+		size_t offset = elf->bias + phdr->p_vaddr - lead;
+		size_t size = (lead + phdr->p_memsz + pagesize - 1) / pagesize * pagesize;
+		size_t file_offset = phdr->p_offset - lead;
+		LOG(
+			"uffd %d: ELF segment %zu at %p - %p", uffdw->uffd,
+			i, (void *)offset, (void *)(offset + size)
+		);
+		if (mmap(
+			(void *)offset, size,
+			_uffdw_elf_prot(phdr->p_flags), MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+			-1, 0
+		) == MAP_FAILED) {
+			warn("failed to map ELF segment %zu", i);
+			ok = false;
+		} else {
+			ok = _uffdw_register_file_part(
+				uffdw,
+				offset, size,
+				fd, file_offset, phdr->p_filesz > 0 ? phdr->p_offset + phdr->p_filesz : file_offset,
+				options
+			);
+		}
+	}
+	free(phdrs);
+
+	if (!ok && munmap(base, elf->size) != 0) warn("failed to unmap ELF file");
+	return ok;
+}
+
+bool uffdw_track_dirty(struct uffdw_t * uffdw, size_t offset, size_t size) {
+	LOG("uffd %d: track dirty %p - %p", uffdw->uffd, (void *)offset, (void *)(offset + size));
+
+	if (!(uffdw->features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+		warnx("write protection is not supported by the kernel");
+		return false;
+	}
+
+	size_t pages = size / uffdw->pagesize;
+	struct _uffdw_dirty_t * area = malloc(sizeof(struct _uffdw_dirty_t));
+	if (area == NULL) return false;
+	area->offset = offset;
+	area->end = offset + size;
+	area->bits = calloc((pages + ULONG_BITS - 1) / ULONG_BITS, sizeof(unsigned long));
+	if (area->bits == NULL) {
+		free(area);
+		return false;
+	}
+
+	if (pthread_mutex_lock(&uffdw->mutex) != 0) {
+		warnx("failed to acquire lock");
+		free(area->bits);
+		free(area);
+		return false;
+	}
+
+	// register piece by piece, lazily filled parts keep missing mode
+	size_t o = offset;
+	while (o < area->end) {
+		struct uffdw_range_t * range = _uffdw_get_range(uffdw, o, area->end);
+		bool lazy = range != NULL && range->offset <= o;
+		size_t piece_end = range == NULL ? area->end : lazy ? _min(range->end, area->end) : range->offset;
+
+		struct uffdio_register reg;
+		reg.range.start = o;
+		reg.range.len = piece_end - o;
+		reg.mode = UFFDIO_REGISTER_MODE_WP | (lazy ? UFFDIO_REGISTER_MODE_MISSING : 0);
+		reg.ioctls = 0;
+		if (ioctl(uffdw->uffd, UFFDIO_REGISTER, &reg) != 0) {
+			warn("uffd register syscall failed");
+			pthread_mutex_unlock(&uffdw->mutex);
+			free(area->bits);
+			free(area);
+			return false;
+		}
+		o = piece_end;
+	}
+
+	pthread_mutex_lock(&uffdw->dirty_mutex);
+	area->next = uffdw->dirty;
+	uffdw->dirty = area;
+	atomic_fetch_add(&uffdw->dirty_count, 1);
+	bool ok = uffdw_writeprotect(uffdw->uffd, offset, size, true);
+	pthread_mutex_unlock(&uffdw->dirty_mutex);
+
+	pthread_mutex_unlock(&uffdw->mutex);
+	return ok;
+}
+
+bool uffdw_collect_dirty(
+	struct uffdw_t * uffdw,
+	size_t offset, size_t size,
+	unsigned long * dirty
+) {
+	size_t pages = size / uffdw->pagesize;
+	memset(dirty, 0, (pages + ULONG_BITS - 1) / ULONG_BITS * sizeof(unsigned long));
+
+	pthread_mutex_lock(&uffdw->dirty_mutex);
+	struct _uffdw_dirty_t * area = _uffdw_dirty_find(uffdw, offset);
+	if (area == NULL || offset + size > area->end) {
+		pthread_mutex_unlock(&uffdw->dirty_mutex);
+		warnx("uffd %d: %p - %p is not tracked", uffdw->uffd, (void *)offset, (void *)(offset + size));
+		return false;
+	}
+
+	// take the bits over, skipping clean words
+	size_t first = (offset - area->offset) / uffdw->pagesize;
+	for (size_t i = 0; i < pages; i ++) {
+		size_t p = first + i;
+		unsigned long * word = &area->bits[p / ULONG_BITS];
+		if (*word == 0) {
+			i += ULONG_BITS - 1 - p % ULONG_BITS;
+			continue;
+		}
+		if (*word & (1UL << (p % ULONG_BITS))) {
+			*word &= ~(1UL << (p % ULONG_BITS));
+			dirty[i / ULONG_BITS] |= 1UL << (i % ULONG_BITS);
+		}
+	}
+
+	// protect collected pages again, run by run
+	bool ok = true;
+	size_t run = 0;
+	for (size_t i = 0; i <= pages; i ++) {
+		if (i < pages && (dirty[i / ULONG_BITS] & (1UL << (i % ULONG_BITS)))) continue;
+		if (run < i && !uffdw_writeprotect(
+			uffdw->uffd,
+			offset + run * uffdw->pagesize, (i - run) * uffdw->pagesize,
+			true
+		)) ok = false;
+		run = i + 1;
+	}
+
+	pthread_mutex_unlock(&uffdw->dirty_mutex);
+	return ok;
+}
+
+/**
+ * Put stats of ranges of table `node` in order, from `count` on.
+ */
+static size_t _uffdw_range_stats(
+	struct uffdw_range_t * node,
+	struct uffdw_range_stats_t * ranges, size_t max_ranges,
+	size_t count
+) {
+	if (node == NULL) return count;
+	count = _uffdw_range_stats(node->left, ranges, max_ranges, count);
+	if (count < max_ranges) {
+		struct uffdw_range_stats_t * stats = &ranges[count];
+		stats->offset = node->offset;
+		stats->size = node->end - node->offset;
+		memset(&stats->counters, 0, sizeof(stats->counters));
+		if (node->counters != NULL) _uffdw_counters_sum(&stats->counters, node->counters);
+	}
+	return _uffdw_range_stats(node->right, ranges, max_ranges, count + 1);
+}
+
+size_t uffdw_get_stats(
+	struct uffdw_t * uffdw,
+	struct uffdw_stats_t * stats,
+	struct uffdw_range_stats_t * ranges, size_t max_ranges
+) {
+	memset(stats, 0, sizeof(*stats));
+	for (size_t i = 0; i < UFFDW_STATS_SLOTS; i ++) {
+		_uffdw_counters_sum(&stats->counters, &uffdw->stats[i].counters);
+		for (size_t b = 0; b < UFFDW_LATENCY_BUCKETS; b ++) {
+			stats->latency[b] += atomic_load_explicit(&uffdw->stats[i].latency[b], memory_order_relaxed);
+		}
+	}
+
+	pthread_mutex_lock(&uffdw->mutex);
+	stats->forks = uffdw->forks;
+	stats->remaps = uffdw->remaps;
+	stats->removes = uffdw->removes;
+	stats->unmaps = uffdw->unmaps;
+	size_t count = _uffdw_range_stats(uffdw->ranges, ranges, max_ranges, 0);
+	pthread_mutex_unlock(&uffdw->mutex);
+	return count;
+}
 
-				break;
-			}
+bool uffdw_record(struct uffdw_t * uffdw, int fd) {
+	struct _uffdw_trace_header_t header;
+	memcpy(header.magic, UFFDW_TRACE_MAGIC, sizeof(header.magic));
+	header.pagesize = uffdw->pagesize;
 
-			case UFFD_EVENT_FORK: {
-				LOG("uffd %d: got FORK (new uffd %d)", uffdw->uffd, msg.arg.fork.ufd);
-
-				// copy structure
-				new_uffdw = _uffdw_alloc();
-				new_uffdw->uffd = msg.arg.fork.ufd;
-				struct uffdw_range_t * range = uffdw->ranges;
-				while (range != NULL) {
-					if (!_uffdw_add_range(
-						new_uffdw,
-						range->offset, range->end, range->handler_offset,
-						range->handler, range->handler_data
-					)) {
-						warn("failed to store range data");
-						_uffdw_cleanup(new_uffdw);
-						pthread_mutex_unlock(&uffdw->mutex);
-						return NULL;
-					}
-					range = range->next;
-				}
+	struct _uffdw_trace_t * trace = malloc(sizeof(struct _uffdw_trace_t));
+	if (trace == NULL) return false;
+	trace->fd = fd;
+	trace->ok = true;
+	trace->registration = SIZE_MAX;
+	trace->page = 0;
+	trace->buffer = trace->buffers[0];
+	trace->length = sizeof(header);
+	memcpy(trace->buffer, &header, sizeof(header));
+	trace->spare = trace->buffers[1];
+	trace->spare_length = 0;
+	if (pthread_mutex_init(&trace->write_mutex, NULL) != 0) {
+		free(trace);
+		return false;
+	}
 
-				// attach to children list
-				_uffdw_attach_child(uffdw, new_uffdw);
+	pthread_mutex_lock(&uffdw->mutex);
+	if (uffdw->trace != NULL) {
+		pthread_mutex_unlock(&uffdw->mutex);
+		warnx("uffd %d: trace is being recorded already", uffdw->uffd);
+		pthread_mutex_destroy(&trace->write_mutex);
+		free(trace);
+		return false;
+	}
+	uffdw->trace = trace;
+	pthread_mutex_unlock(&uffdw->mutex);
+	return true;
+}
 
-				// run thread
-				if (pthread_create(&(new_uffdw->thread), NULL, _uffdw_run, new_uffdw) != 0) {
-					if (DEBUG) perror("failed to create child uffdw thread");
-					_uffdw_cleanup(new_uffdw);
-					pthread_mutex_unlock(&uffdw->mutex);
-					return NULL;
-				}
+bool uffdw_record_stop(struct uffdw_t * uffdw) {
+	pthread_mutex_lock(&uffdw->mutex);
+	struct _uffdw_trace_t * trace = uffdw->trace;
+	uffdw->trace = NULL;
+	pthread_mutex_unlock(&uffdw->mutex);
+	if (trace == NULL) return false;
 
-				break;
-			}
+	// wait for the buffer being written, it goes before the rest
+	pthread_mutex_lock(&trace->write_mutex);
+	bool ok = _uffdw_trace_write(trace, trace->buffer, trace->length);
+	pthread_mutex_unlock(&trace->write_mutex);
+	pthread_mutex_destroy(&trace->write_mutex);
+	free(trace);
+	return ok;
+}
 
-			case UFFD_EVENT_REMAP: {
-				LOG(
-					"uffd %d: got REMAP (%zu, %p -> %p)", uffdw->uffd,
-					(size_t)msg.arg.remap.len, (void *)msg.arg.remap.from, (void *)msg.arg.remap.to
-				);
+static inline bool _uffdw_trace_get(struct _uffdw_replay_t * replay, size_t * at, uint64_t * value) {
+	*value = 0;
+	for (unsigned shift = 0; *at < replay->size && shift < 64; shift += 7) {
+		uint8_t byte = replay->data[(*at) ++];
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
 
-				struct uffdw_range_t * range = _uffdw_get_range(
-					uffdw,
-					msg.arg.remap.from, msg.arg.remap.from + 1
-				);
-				if (range == NULL) {
-					warnx("uffd %d: REMAP on non registered addr %p", uffdw->uffd, (void *)msg.arg.remap.from);
-				} else {
-					if (!_uffdw_add_range(
-						uffdw,
-						msg.arg.remap.to, msg.arg.remap.to + msg.arg.remap.len, msg.arg.remap.from,
-						range->handler, range->handler_data
-					)) warnx("uffd %d: failed to store range data", uffdw->uffd);
-				}
+static size_t _uffdw_replay_collect(
+	struct uffdw_range_t * node,
+	struct _uffdw_replay_entry_t * entries, size_t capacity,
+	size_t count
+) {
+	if (node == NULL) return count;
+	count = _uffdw_replay_collect(node->left, entries, capacity, count);
+	if (count < capacity) {
+		entries[count] = (struct _uffdw_replay_entry_t){
+			node->registration, node->handler_offset, node->end - node->offset, node->offset
+		};
+	}
+	return _uffdw_replay_collect(node->right, entries, capacity, count + 1);
+}
 
-				break;
-			}
+static int _uffdw_replay_entry_cmp(const void * _a, const void * _b) {
+	const struct _uffdw_replay_entry_t * a = _a;
+	const struct _uffdw_replay_entry_t * b = _b;
+	if (a->registration != b->registration) return (a->registration > b->registration) - (a->registration < b->registration);
+	return (a->handler_offset > b->handler_offset) - (a->handler_offset < b->handler_offset);
+}
 
-			case UFFD_EVENT_REMOVE: {
-				LOG("uffd %d: got REMOVE (%p - %p)", uffdw->uffd, (void *)msg.arg.remove.start, (void *)msg.arg.remove.end);
-				warnx("UFFD_EVENT_REMOVE handling not implemented yet");
-				break;
-			}
+/**
+ * Index ranges of the table by registration, unless it didn't change
+ * since the last time. Returns false if there's nothing new.
+ */
+static bool _uffdw_replay_index(struct uffdw_t * uffdw, struct _uffdw_replay_t * replay) {
+	while (true) {
+		_uffdw_rcu_read_lock();
+		size_t publishes = atomic_load(&uffdw->publishes);
+		if (replay->index != NULL && publishes == replay->index_publishes) {
+			_uffdw_rcu_read_unlock();
+			return false;
+		}
+		size_t count = _uffdw_replay_collect(atomic_load(&uffdw->published), replay->index, replay->index_capacity, 0);
+		_uffdw_rcu_read_unlock();
 
-			case UFFD_EVENT_UNMAP: {
-				LOG("uffd %d: got UNMAP (%p - %p)", uffdw->uffd, (void *)msg.arg.remove.start, (void *)msg.arg.remove.end);
-				_uffdw_remove_range(
-					uffdw,
-					msg.arg.remove.start, msg.arg.remove.end
-				);
-				break;
-			}
+		if (count <= replay->index_capacity && replay->index != NULL) {
+			qsort(replay->index, count, sizeof(struct _uffdw_replay_entry_t), _uffdw_replay_entry_cmp);
+			replay->index_count = count;
+			replay->index_publishes = publishes;
+			return true;
+		}
+		// table grew meanwhile, try again with room for it
+		size_t capacity = _max(count, 1) * 2;
+		struct _uffdw_replay_entry_t * index = realloc(replay->index, capacity * sizeof(struct _uffdw_replay_entry_t));
+		if (index == NULL) return false;
+		replay->index = index;
+		replay->index_capacity = capacity;
+	}
+}
 
-			default: {
-				LOG("uffd %d: error: got unsupported message type", uffdw->uffd);
-				pthread_mutex_unlock(&uffdw->mutex);
-				return NULL;
+/**
+ * Tell if `range` holds offset `handler_offset` of `registration`.
+ */
+static inline bool _uffdw_range_holds(const struct uffdw_range_t * range, size_t registration, size_t handler_offset) {
+	return (
+		range->registration == registration &&
+		handler_offset >= range->handler_offset &&
+		handler_offset - range->handler_offset < range->end - range->offset
+	);
+}
+
+/**
+ * Find where `page` of `registration` is now. Range of `fault` found the
+ * last time is tried first, following entries are mostly in the same one.
+ * Others are looked up in the index, which is built again only once the
+ * table changes.
+ */
+static bool _uffdw_replay_find(
+	struct uffdw_t * uffdw, struct _uffdw_replay_t * replay,
+	size_t registration, size_t page,
+	struct _uffdw_fault_t * fault
+) {
+	size_t handler_offset = page * uffdw->pagesize;
+	struct uffdw_range_t * range = &fault->range;
+	bool found = (
+		fault->found && range->registration == registration &&
+		handler_offset >= range->handler_offset &&
+		_uffdw_lookup(uffdw, range->offset + (handler_offset - range->handler_offset), range) &&
+		_uffdw_range_holds(range, registration, handler_offset)
+	);
+	for (bool indexed = false; !found; indexed = true) {
+		if (indexed && !_uffdw_replay_index(uffdw, replay)) break;
+		// last entry at or below the offset
+		struct _uffdw_replay_entry_t key = {registration, handler_offset, 0, 0};
+		size_t low = 0;
+		size_t high = replay->index_count;
+		while (low < high) {
+			size_t middle = low + (high - low) / 2;
+			if (_uffdw_replay_entry_cmp(&replay->index[middle], &key) <= 0) {
+				low = middle + 1;
+			} else {
+				high = middle;
 			}
 		}
+		const struct _uffdw_replay_entry_t * e = low > 0 ? &replay->index[low - 1] : NULL;
+		found = (
+			e != NULL && e->registration == registration && handler_offset - e->handler_offset < e->size &&
+			_uffdw_lookup(uffdw, e->offset + (handler_offset - e->handler_offset), range) &&
+			_uffdw_range_holds(range, registration, handler_offset)
+		);
+		if (indexed) break;
+	}
+	fault->found = found;
+	if (!found) return false;
 
-		pthread_mutex_unlock(&uffdw->mutex);
+	fault->pagesize = range->options.pagesize;
+	fault->address = (range->offset + (handler_offset - range->handler_offset)) & ~(fault->pagesize - 1);
+	return true;
+}
+
+/**
+ * Wait while there are pagefaults to be read or resolved, or until
+ * `stop` is set.
+ */
+static void _uffdw_background_yield(struct uffdw_t * uffdw, bool _Atomic * stop) {
+	struct pollfd fds = {.fd = uffdw->uffd, .events = POLLIN};
+	while (
+		!atomic_load(stop) &&
+		(atomic_load(&uffdw->demand) > 0 || poll(&fds, 1, 0) > 0)
+	) usleep(UFFDW_REPLAY_BACKOFF_US);
+}
+
+/**
+ * Fill `size` bytes of missing pages from `fault->address` ahead of
+ * time. Handler fills them as if they were faulted in, only faults are
+ * not counted and nobody is woken - faults on them that come meanwhile
+ * are woken by whoever finds the page in place.
+ */
+static void _uffdw_background_fill(struct uffdw_t * uffdw, struct _uffdw_fault_t * fault, size_t size) {
+	_uffdw_counting = &_uffdw_slot(uffdw)->counters;
+	_uffdw_range_counting = fault->range.counters;
+	_uffdw_copy_dontwake = true;
+	_uffdw_handle_pagefault(uffdw, fault, size);
+	_uffdw_copy_dontwake = false;
+	_uffdw_counting = NULL;
+	_uffdw_range_counting = NULL;
+	// fault skipped as pending while the handler ran here is left to us
+	uffdw_wake(uffdw->uffd, fault->address, fault->pagesize);
+}
+
+static void * _uffdw_replay_run(void * _replay) {
+	struct _uffdw_replay_t * replay = _replay;
+	struct uffdw_t * uffdw = replay->uffdw;
+	_uffdw_handler_thread_init(&replay->reader);
+
+	// run only when nothing else wants the CPU
+	struct sched_param param = {0};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	struct _uffdw_fault_t fault;
+	fault.wp = false;
+	fault.found = false;
+	size_t at = sizeof(struct _uffdw_trace_header_t);
+	size_t page = 0;
+	uint64_t registration, delta;
+	while (
+		!atomic_load(&replay->stop) &&
+		_uffdw_trace_get(replay, &at, &registration) &&
+		_uffdw_trace_get(replay, &at, &delta)
+	) {
+		page += (size_t)((delta >> 1) ^ -(delta & 1));
+		_uffdw_background_yield(uffdw, &replay->stop);
+		if (!_uffdw_replay_find(uffdw, replay, registration, page, &fault)) continue;
+
+		// pages faulted in already are skipped without asking the handler
+		if (_uffdw_residency_find(uffdw, fault.address, fault.address + fault.pagesize, false) != fault.address) continue;
 
+		_uffdw_background_fill(uffdw, &fault, fault.pagesize);
 	}
+	LOG("uffd %d: replay done", uffdw->uffd);
+	free(replay->index);
+	replay->index = NULL;
+
+	_uffdw_rcu_unregister_thread();
+	return NULL;
 }
 
-struct uffdw_t * uffdw_create() {
-	struct uffdw_t * data = _uffdw_alloc();
-	if (data == NULL) {
-		warn("failed to allocate uffdw struture");
-		return NULL;
+bool uffdw_replay(struct uffdw_t * uffdw, int fd) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		warn("failed to stat fault trace");
+		return false;
+	}
+	struct _uffdw_trace_header_t header;
+	if (
+		(size_t)st.st_size < sizeof(header) ||
+		!_uffdw_pread_all(fd, &header, sizeof(header), 0) ||
+		memcmp(header.magic, UFFDW_TRACE_MAGIC, sizeof(header.magic)) != 0
+	) {
+		warnx("not a fault trace");
+		return false;
+	}
+	if (header.pagesize != (uint64_t)uffdw->pagesize) {
+		warnx("fault trace was recorded with %zu B pages", (size_t)header.pagesize);
+		return false;
 	}
 
-	data->pagesize = sysconf(_SC_PAGESIZE);
-	if (data->pagesize < 0) {
-		warn("failed to get pagesize");
-		_uffdw_cleanup(data);
-		return NULL;
+	struct _uffdw_replay_t * replay = malloc(sizeof(struct _uffdw_replay_t));
+	if (replay == NULL) return false;
+	replay->uffdw = uffdw;
+	atomic_init(&replay->stop, false);
+	replay->index = NULL;
+	replay->index_count = 0;
+	replay->index_capacity = 0;
+	replay->index_publishes = 0;
+	replay->size = st.st_size;
+	replay->data = malloc(replay->size);
+	if (replay->data == NULL || !_uffdw_pread_all(fd, replay->data, replay->size, 0)) {
+		warnx("failed to read fault trace");
+		free(replay->data);
+		free(replay);
+		return false;
 	}
 
-	data->uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
-	if (data->uffd < 0) {
-		warn("failed to open userfaultfd descriptor");
-		_uffdw_cleanup(data);
-		return NULL;
+	pthread_mutex_lock(&uffdw->mutex);
+	bool ok = uffdw->replay == NULL;
+	if (!ok) {
+		warnx("uffd %d: trace is being replayed already", uffdw->uffd);
+	} else if (pthread_create(&replay->thread, NULL, _uffdw_replay_run, replay) != 0) {
+		warnx("uffd %d: failed to create replay thread", uffdw->uffd);
+		ok = false;
+	} else {
+		uffdw->replay = replay;
 	}
+	pthread_mutex_unlock(&uffdw->mutex);
 
-	struct uffdio_api api_options;
-	api_options.api = UFFD_API;
-	api_options.features = (
-		UFFD_FEATURE_EVENT_FORK |
-		UFFD_FEATURE_EVENT_REMAP |
-		UFFD_FEATURE_EVENT_REMOVE |
-		UFFD_FEATURE_EVENT_UNMAP |
-		UFFD_FEATURE_MISSING_HUGETLBFS |
-		UFFD_FEATURE_MISSING_SHMEM
-	);
-	api_options.ioctls = 0;
+	if (!ok) {
+		free(replay->data);
+		free(replay);
+	}
+	return ok;
+}
 
-	if (ioctl(data->uffd, UFFDIO_API, &api_options) != 0) {
-		warn("failed to handshake with userfaultfd API");
-		_uffdw_cleanup(data);
+static void _uffdw_replay_end(struct uffdw_t * uffdw) {
+	struct _uffdw_replay_t * replay = uffdw->replay;
+	if (replay == NULL) return;
+	atomic_store(&replay->stop, true);
+	if (pthread_join(replay->thread, NULL) != 0) warn("failed to join replay thread");
+	uffdw->replay = NULL;
+	free(replay->data);
+	free(replay);
+}
+
+/**
+ * Copy range that holds `addr`, or the next one above it, into `range`.
+ */
+static bool _uffdw_lookup_next(struct uffdw_t * uffdw, size_t addr, struct uffdw_range_t * range) {
+	_uffdw_rcu_read_lock();
+	struct uffdw_range_t * found = _uffdw_range_find(atomic_load(&uffdw->published), addr);
+	if (found != NULL) *range = *found;
+	_uffdw_rcu_read_unlock();
+	return found != NULL;
+}
+
+/**
+ * Fill missing pages from `offset` to `end` that are registered, in
+ * runs of up to `UFFDW_PREFETCH_PAGES`.
+ */
+static void _uffdw_prefetch_span(struct uffdw_t * uffdw, struct _uffdw_prefetcher_t * prefetcher, size_t offset, size_t end) {
+	struct _uffdw_fault_t fault;
+	fault.wp = false;
+	fault.found = true;
+	struct uffdw_range_t * range = &fault.range;
+	size_t address = offset;
+	while (address < end && !atomic_load(&prefetcher->stop)) {
+		_uffdw_background_yield(uffdw, &prefetcher->stop);
+		if (!_uffdw_lookup_next(uffdw, address, range) || range->offset >= end) return;
+		size_t pagesize = range->options.pagesize;
+		address = _max(address, range->offset) & ~(pagesize - 1);
+		size_t pages = _min(((_min(end, range->end) - address) + pagesize - 1) / pagesize, UFFDW_PREFETCH_PAGES);
+
+		// pages faulted in already are skipped, larger ones have all their bits alike
+		size_t span_end = address + pages * pagesize;
+		size_t first = _uffdw_residency_find(uffdw, address, span_end, false);
+		size_t last = _uffdw_residency_find(uffdw, first, span_end, true);
+		if (first < last) {
+			fault.address = first;
+			fault.pagesize = pagesize;
+			_uffdw_background_fill(uffdw, &fault, last - first);
+		}
+		address = last;
+	}
+}
+
+static void * _uffdw_prefetch_run(void * _prefetcher) {
+	struct _uffdw_prefetcher_t * prefetcher = _prefetcher;
+	struct uffdw_t * uffdw = prefetcher->uffdw;
+	_uffdw_handler_thread_init(&prefetcher->reader);
+
+	// run only when nothing else wants the CPU
+	struct sched_param param = {0};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	pthread_mutex_lock(&prefetcher->mutex);
+	while (!atomic_load(&prefetcher->stop)) {
+		struct _uffdw_span_t * span = prefetcher->first;
+		if (span == NULL) {
+			pthread_cond_wait(&prefetcher->queued, &prefetcher->mutex);
+			continue;
+		}
+		prefetcher->first = span->next;
+		if (prefetcher->first == NULL) prefetcher->last = NULL;
+		pthread_mutex_unlock(&prefetcher->mutex);
+
+		LOG("uffd %d: prefetch %p - %p", uffdw->uffd, (void *)span->offset, (void *)span->end);
+		_uffdw_prefetch_span(uffdw, prefetcher, span->offset, span->end);
+		free(span);
+
+		pthread_mutex_lock(&prefetcher->mutex);
+	}
+	pthread_mutex_unlock(&prefetcher->mutex);
+
+	_uffdw_rcu_unregister_thread();
+	return NULL;
+}
+
+/**
+ * Get prefetch thread of `uffdw`, starting it if there is none. Must be
+ * called with `uffdw->mutex` held.
+ */
+static struct _uffdw_prefetcher_t * _uffdw_prefetcher(struct uffdw_t * uffdw) {
+	if (uffdw->prefetcher != NULL) return uffdw->prefetcher;
+	struct _uffdw_prefetcher_t * prefetcher = malloc(sizeof(struct _uffdw_prefetcher_t));
+	if (prefetcher == NULL) return NULL;
+	prefetcher->uffdw = uffdw;
+	atomic_init(&prefetcher->stop, false);
+	prefetcher->first = NULL;
+	prefetcher->last = NULL;
+	if (pthread_mutex_init(&prefetcher->mutex, NULL) != 0) {
+		free(prefetcher);
 		return NULL;
 	}
-	if (!(api_options.ioctls & (1 << _UFFDIO_REGISTER))) {
-		warnx("got invalid response to uffd handshake");
-		_uffdw_cleanup(data);
+	if (
+		pthread_cond_init(&prefetcher->queued, NULL) != 0 ||
+		pthread_create(&prefetcher->thread, NULL, _uffdw_prefetch_run, prefetcher) != 0
+	) {
+		warnx("uffd %d: failed to create prefetch thread", uffdw->uffd);
+		pthread_mutex_destroy(&prefetcher->mutex);
+		free(prefetcher);
 		return NULL;
 	}
+	uffdw->prefetcher = prefetcher;
+	return prefetcher;
+}
 
-	if(pthread_create(&(data->thread), NULL, _uffdw_run, data)) {
-		warnx("failed to create uffdw thread");
-		_uffdw_cleanup(data);
-		return NULL;
+bool uffdw_prefetch(struct uffdw_t * uffdw, size_t addr, size_t len) {
+	if (len == 0) return true;
+	struct _uffdw_span_t * span = malloc(sizeof(struct _uffdw_span_t));
+	if (span == NULL) return false;
+	span->offset = addr;
+	span->end = addr + len;
+	span->next = NULL;
+
+	pthread_mutex_lock(&uffdw->mutex);
+	struct _uffdw_prefetcher_t * prefetcher = _uffdw_prefetcher(uffdw);
+	pthread_mutex_unlock(&uffdw->mutex);
+	if (prefetcher == NULL) {
+		free(span);
+		return false;
 	}
 
-	return data;
+	pthread_mutex_lock(&prefetcher->mutex);
+	if (prefetcher->last != NULL) {
+		prefetcher->last->next = span;
+	} else {
+		prefetcher->first = span;
+	}
+	prefetcher->last = span;
+	pthread_cond_signal(&prefetcher->queued);
+	pthread_mutex_unlock(&prefetcher->mutex);
+	return true;
 }
 
-void uffdw_cancel(struct uffdw_t * data) {
-	LOG("uffd %d: canceling", data->uffd);
+size_t uffdw_resident(struct uffdw_t * uffdw, size_t addr, size_t len) {
+	return _min(_uffdw_residency_count(uffdw, addr, addr + len) * uffdw->pagesize, len);
+}
+
+size_t uffdw_first_missing(struct uffdw_t * uffdw, size_t addr, size_t len) {
+	return _uffdw_residency_find(uffdw, addr, addr + len, false);
+}
+
+static void _uffdw_prefetch_end(struct uffdw_t * uffdw) {
+	struct _uffdw_prefetcher_t * prefetcher = uffdw->prefetcher;
+	if (prefetcher == NULL) return;
+	pthread_mutex_lock(&prefetcher->mutex);
+	atomic_store(&prefetcher->stop, true);
+	pthread_cond_signal(&prefetcher->queued);
+	pthread_mutex_unlock(&prefetcher->mutex);
+	if (pthread_join(prefetcher->thread, NULL) != 0) warn("failed to join prefetch thread");
+	uffdw->prefetcher = NULL;
 
-	// cancel and wait for thread
-	if (pthread_cancel(data->thread) != 0) {
-		warn("failed to cancel uffdw thread");
+	while (prefetcher->first != NULL) {
+		struct _uffdw_span_t * next = prefetcher->first->next;
+		free(prefetcher->first);
+		prefetcher->first = next;
 	}
-	if (pthread_join(data->thread, NULL) != 0) {
-		warn("there was a problem during joining uffdw thread");
+	pthread_cond_destroy(&prefetcher->queued);
+	pthread_mutex_destroy(&prefetcher->mutex);
+	free(prefetcher);
+}
+
+/**
+ * Get `UFFDW_ZEROES_SIZE` bytes of zeroes. It's a read-only mapping that
+ * is never written, so it costs no memory, but it's there for good.
+ */
+static void * _uffdw_zeroes(void) {
+	void * zeroes = atomic_load(&_uffdw_zeroes_map);
+	if (zeroes != NULL) return zeroes;
+
+	zeroes = mmap(
+		NULL, UFFDW_ZEROES_SIZE,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0
+	);
+	if (zeroes == MAP_FAILED) return NULL;
+	void * expected = NULL;
+	if (!atomic_compare_exchange_strong(&_uffdw_zeroes_map, &expected, zeroes)) {
+		// someone was faster
+		munmap(zeroes, UFFDW_ZEROES_SIZE);
+		return expected;
 	}
+	return zeroes;
+}
 
-	// clean thread structure
-	_uffdw_cleanup(data);
+/**
+ * Note whether `size` bytes at `offset` of `uffd` are in place, if this
+ * thread fills pages of its instance. Pages are noted before they are
+ * filled, as filling wakes threads that may look at them, and taken
+ * back if it fails.
+ */
+static inline void _uffdw_installed(int uffd, size_t offset, size_t size, bool installed) {
+	struct uffdw_t * uffdw = _uffdw_installing;
+	if (uffdw != NULL && uffdw->uffd == uffd) _uffdw_residency_update(uffdw, offset, offset + size, installed);
 }
 
-int _uffdw_get_uffd(struct uffdw_t * data) {
-	return data->uffd;
+/**
+ * Get first page from `offset` to `end` of `uffd` that isn't known to
+ * be in place, and end of the run of such pages in `run_end`, so that
+ * batches leave out the rest. All of them are taken as missing unless
+ * this thread fills pages of its instance. Pages faulted on are taken
+ * as missing too - their bits may be set by another thread filling
+ * them ahead without waking anybody.
+ */
+static size_t _uffdw_next_missing(int uffd, size_t offset, size_t end, size_t * run_end) {
+	struct uffdw_t * uffdw = _uffdw_installing;
+	*run_end = end;
+	if (uffdw == NULL || uffdw->uffd != uffd) return offset;
+	size_t granule = _uffdw_granule != 0 ? _uffdw_granule : (size_t)uffdw->pagesize;
+	size_t first = _uffdw_residency_find(uffdw, offset, end, false);
+	if (_uffdw_faulting < end && offset < _uffdw_faulting_end) first = _min(first, _max(offset, _uffdw_faulting));
+	if (first >= end) return end;
+	first = _max(offset, first & ~(granule - 1));
+	size_t last = _uffdw_residency_find(uffdw, first, end, true);
+	if (_uffdw_faulting <= last && last < _uffdw_faulting_end) {
+		last = _uffdw_residency_find(uffdw, _min(end, _uffdw_faulting_end), end, true);
+	}
+	*run_end = _min(end, (last + granule - 1) & ~(granule - 1));
+	return first;
 }
 
-bool uffdw_register(
-	struct uffdw_t * uffdw,
-	size_t offset, size_t size, size_t handler_offset,
-	uffdw_handler_t handler, void * private_data
+/**
+ * Copy `size` bytes from `our_offset` to not present pages of size
+ * `pagesize`, counting them as zeroes if `zeroes` is set. Pages that
+ * are present already are skipped (and woken, unless `mode` says not
+ * to).
+ */
+static bool _uffdw_copy(
+	int uffd,
+	void * our_offset, size_t target_offset, size_t size,
+	uint64_t mode, size_t pagesize, bool zeroes
 ) {
-	LOG("uffd %d: register %p - %p", uffdw->uffd, (void *)offset, (void *)(offset + size));
+	_uffdw_installed(uffd, target_offset, size, true);
+	size_t done = 0;
+	while (done < size) {
+		struct uffdio_copy copy;
+		copy.dst = target_offset + done;
+		copy.src = (size_t)our_offset + done;
+		copy.len = size - done;
+		copy.mode = mode;
+		copy.copy = 0;
 
-	if (pthread_mutex_lock(&uffdw->mutex) != 0) {
-		warnx("failed to acquire lock");
-		return false;
+		if (ioctl(uffd, UFFDIO_COPY, &copy) == 0) {
+			copy.copy = size - done;
+		} else if (errno != EEXIST && errno != EAGAIN) {
+			if (DEBUG) warn("copy failed");
+			_uffdw_installed(uffd, target_offset + done, size - done, false);
+			return false;
+		}
+		if (copy.copy > 0) {
+			if (zeroes) {
+				_uffdw_count(bytes_zeroed, copy.copy);
+			} else {
+				_uffdw_count(bytes_copied, copy.copy);
+			}
+			done += copy.copy;
+			continue;
+		}
+		if (errno == EAGAIN) {
+			// mappings are changing and the event may be queued behind this
+			// very fault, so let the threads fault again instead of spinning
+			_uffdw_installed(uffd, target_offset + done, size - done, false);
+			return (mode & UFFDIO_COPY_MODE_DONTWAKE) || uffdw_wake(uffd, target_offset + done, size - done);
+		}
+		if (errno == EEXIST) {
+			// someone was faster, make sure the page isn't left asleep
+			_uffdw_count(eexist, 1);
+			if (!(mode & UFFDIO_COPY_MODE_DONTWAKE)) uffdw_wake(uffd, target_offset + done, pagesize);
+			done += pagesize;
+		}
 	}
+	return true;
+}
 
-	// alloc and attach range structure
-	if (!_uffdw_add_range(
-		uffdw,
-		offset, offset + size, handler_offset,
-		handler, private_data
-	)) {
-		warn("failed to store uffdw range data");
-		pthread_mutex_unlock(&uffdw->mutex);
-		return false;
+/**
+ * Fill `size` bytes at `offset` with zeroes. Zero page can't be mapped
+ * write-protected, and there is none for huge pages, so zeroes are
+ * copied then.
+ */
+static bool _uffdw_zeropage(int uffd, size_t offset, size_t size, bool wp, bool dontwake, size_t pagesize) {
+	if (wp || pagesize != (size_t)sysconf(_SC_PAGESIZE)) {
+		void * zeroes = _uffdw_zeroes();
+		if (zeroes == NULL) return false;
+		for (size_t done = 0; done < size; done += UFFDW_ZEROES_SIZE) {
+			if (!_uffdw_copy(
+				uffd,
+				zeroes, offset + done, _min(size - done, UFFDW_ZEROES_SIZE),
+				(wp ? UFFDIO_COPY_MODE_WP : 0) | (dontwake ? UFFDIO_COPY_MODE_DONTWAKE : 0),
+				pagesize, true
+			)) return false;
+		}
+		return true;
 	}
 
-	// prepare data for syscall
-	struct uffdio_register reg;
-	reg.range.start = offset;
-	reg.range.len = size;
-	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
-	reg.ioctls = 0;
+	_uffdw_installed(uffd, offset, size, true);
+	size_t done = 0;
+	while (done < size) {
+		struct uffdio_zeropage uffdio;
+		uffdio.range.start = offset + done;
+		uffdio.range.len = size - done;
+		uffdio.mode = dontwake ? UFFDIO_ZEROPAGE_MODE_DONTWAKE : 0;
+		uffdio.zeropage = 0;
 
-	// do syscall
-	if (ioctl(uffdw->uffd, UFFDIO_REGISTER, &reg) != 0) {
-		warn("uffd register syscall failed");
-		_uffdw_remove_range(uffdw, offset, offset + size);
-		pthread_mutex_unlock(&uffdw->mutex);
-		return false;
+		if (ioctl(uffd, UFFDIO_ZEROPAGE, &uffdio) == 0) {
+			uffdio.zeropage = size - done;
+		} else if (errno != EEXIST && errno != EAGAIN) {
+			if (DEBUG) warn("zeropage failed");
+			_uffdw_installed(uffd, offset + done, size - done, false);
+			return false;
+		}
+		if (uffdio.zeropage > 0) {
+			_uffdw_count(bytes_zeroed, uffdio.zeropage);
+			done += uffdio.zeropage;
+			continue;
+		}
+		if (errno == EAGAIN) {
+			// mappings are changing, see _uffdw_copy
+			_uffdw_installed(uffd, offset + done, size - done, false);
+			return dontwake || uffdw_wake(uffd, offset + done, size - done);
+		}
+		// someone was faster, make sure the page isn't left asleep
+		_uffdw_count(eexist, 1);
+		if (!dontwake) uffdw_wake(uffd, offset + done, pagesize);
+		done += pagesize;
 	}
+	return true;
+}
 
-	pthread_mutex_unlock(&uffdw->mutex);
+/**
+ * Tell if `size` bytes at `data`, a multiple of 64, are all zeroes.
+ * Words are or-ed in independent lanes, which compilers vectorize, and
+ * a cache line at a time, so that data goes out at its first one.
+ */
+static bool _uffdw_is_zero(const void * data, size_t size) {
+	const char * bytes = data;
+	for (size_t i = 0; i < size; i += 64) {
+		uint64_t words[8];
+		memcpy(words, bytes + i, sizeof(words));
+		uint64_t any = 0;
+		for (size_t j = 0; j < 8; j ++) any |= words[j];
+		if (any != 0) return false;
+	}
+	return true;
+}
+
+/**
+ * Like `_uffdw_copy()`, but runs of pages that are all zeroes get the
+ * shared zero page. Base pages only, and not write-protected - those
+ * are copied anyway.
+ */
+static bool _uffdw_copy_sparse(
+	int uffd,
+	void * our_offset, size_t target_offset, size_t size,
+	uint64_t mode, size_t pagesize
+) {
+	if (pagesize != (size_t)sysconf(_SC_PAGESIZE) || (mode & UFFDIO_COPY_MODE_WP) || size % pagesize != 0) {
+		return _uffdw_copy(uffd, our_offset, target_offset, size, mode, pagesize, false);
+	}
+	size_t done = 0;
+	while (done < size) {
+		bool zero = _uffdw_is_zero((char *)our_offset + done, pagesize);
+		size_t run = pagesize;
+		while (done + run < size && _uffdw_is_zero((char *)our_offset + done + run, pagesize) == zero) {
+			run += pagesize;
+		}
+		bool ok = zero ?
+			_uffdw_zeropage(uffd, target_offset + done, run, false, mode & UFFDIO_COPY_MODE_DONTWAKE, pagesize) :
+			_uffdw_copy(uffd, (char *)our_offset + done, target_offset + done, run, mode, pagesize, false);
+		if (!ok) return false;
+		done += run;
+	}
 	return true;
 }
 
 bool uffdw_copy(int uffd, void * our_offset, size_t target_offset, size_t size) {
-	struct uffdio_copy copy;
-	copy.dst = target_offset;
-	copy.src = (size_t)our_offset;
-	copy.len = size;
-	copy.mode = 0;
-	copy.copy = 0;
-
-	bool ret = ioctl(uffd, UFFDIO_COPY, &copy) == 0;
-	if (DEBUG && !ret) warn("copy failed");
-	return ret;
+	uint64_t mode = (_uffdw_copy_wp ? UFFDIO_COPY_MODE_WP : 0) | (_uffdw_copy_dontwake ? UFFDIO_COPY_MODE_DONTWAKE : 0);
+	size_t end = target_offset + size;
+	size_t run_end;
+	for (size_t at = target_offset; (at = _uffdw_next_missing(uffd, at, end, &run_end)) < end; at = run_end) {
+		void * from = (char *)our_offset + (at - target_offset);
+		if (!(_uffdw_copy_zeroes ?
+			_uffdw_copy_sparse(uffd, from, at, run_end - at, mode, _uffdw_page()) :
+			_uffdw_copy(uffd, from, at, run_end - at, mode, _uffdw_page(), false)
+		)) return false;
+	}
+	if (_uffdw_capture != NULL) _uffdw_cache_capture(_uffdw_capture, our_offset, target_offset, size);
+	return true;
 }
 
 bool uffdw_copy_from_fd(int uffd, int fd, size_t offset, size_t size) {
-	void * d = malloc(size);
+	void * d = uffdw_scratch(size);
 	if (d == NULL) return false;
-	if (_read_exact(fd, d, size) != size) {
-		free(d);
-		return false;
-	}
-	if (!uffdw_copy(uffd, d, offset, size)) {
-		free(d);
-		return false;
+	if (_read_exact(fd, d, size) != size) return false;
+	return uffdw_copy(uffd, d, offset, size);
+}
+
+bool uffdw_zeropage(int uffd, size_t offset, size_t size) {
+	size_t end = offset + size;
+	size_t run_end;
+	for (size_t at = offset; (at = _uffdw_next_missing(uffd, at, end, &run_end)) < end; at = run_end) {
+		if (!_uffdw_zeropage(uffd, at, run_end - at, _uffdw_copy_wp, _uffdw_copy_dontwake, _uffdw_page())) return false;
 	}
-	free(d);
 	return true;
 }
 
-bool uffdw_zeropage(int uffd, size_t offset, size_t size) {
-	struct uffdio_zeropage uffdio;
-	uffdio.range.start = offset;
-	uffdio.range.len = size;
-	uffdio.mode = 0;
-	uffdio.zeropage = 0;
+bool uffdw_complete(int uffd, void * our_offset, size_t target_offset, size_t size) {
+	size_t pagesize = sysconf(_SC_PAGESIZE);
 
-	if (ioctl(uffd, UFFDIO_ZEROPAGE, &uffdio) != 0) {
-		if (DEBUG) warn("copy failed");
-		return false;
+	// find out how the range is handled
+	struct uffdw_t * uffdw = _uffdw_acquire(uffd);
+	bool wp = false;
+	struct uffdw_range_t range;
+	range.options.cache = NULL;
+	range.options.detect_zeroes = false;
+	range.options.pagesize = pagesize;
+	range.counters = NULL;
+	// may be called by handler, whose faults are being counted
+	struct _uffdw_counters_t * counting = _uffdw_counting;
+	struct _uffdw_counters_t * range_counting = _uffdw_range_counting;
+	struct uffdw_t * installing = _uffdw_installing;
+	if (uffdw != NULL) {
+		wp = _uffdw_is_tracked(uffdw, target_offset);
+		pthread_mutex_lock(&uffdw->mutex);
+		struct uffdw_range_t * found = _uffdw_get_range(uffdw, target_offset, target_offset + size);
+		if (found != NULL && found->offset <= target_offset) range = *found;
+		pthread_mutex_unlock(&uffdw->mutex);
+		_uffdw_counting = &_uffdw_slot(uffdw)->counters;
+		_uffdw_range_counting = range.counters;
+		_uffdw_installing = uffdw;
 	}
-	if (uffdio.zeropage < 0) {
-		return false;
+
+	// fill everything first, so that the faulting threads are woken once
+	uint64_t mode = UFFDIO_COPY_MODE_DONTWAKE | (wp ? UFFDIO_COPY_MODE_WP : 0);
+	bool ok = our_offset == NULL ?
+		_uffdw_zeropage(uffd, target_offset, size, wp, true, range.options.pagesize) :
+		range.options.detect_zeroes ?
+		_uffdw_copy_sparse(uffd, our_offset, target_offset, size, mode, range.options.pagesize) :
+		_uffdw_copy(uffd, our_offset, target_offset, size, mode, range.options.pagesize, false);
+	_uffdw_counting = counting;
+	_uffdw_range_counting = range_counting;
+	_uffdw_installing = installing;
+	if (ok && our_offset != NULL && range.options.cache != NULL) {
+		_uffdw_cache_capture(&range, our_offset, target_offset, size);
+	}
+	if (uffdw != NULL) {
+		for (size_t done = 0; done < size; done += range.options.pagesize) {
+			_uffdw_pending_remove(uffdw, target_offset + done);
+		}
+		_uffdw_release(uffdw);
 	}
-	return (size_t)uffdio.zeropage == size;
+
+	return uffdw_wake(uffd, target_offset, size) && ok;
 }
 
 bool uffdw_wake(int uffd, size_t offset, size_t size) {
@@ -520,3 +5573,238 @@ bool uffdw_wake(int uffd, size_t offset, size_t size) {
 	if (DEBUG && !ret) warn("wake failed");
 	return ret;
 }
+
+bool uffdw_writeprotect(int uffd, size_t offset, size_t size, bool protect) {
+	struct uffdio_writeprotect wp;
+	wp.range.start = offset;
+	wp.range.len = size;
+	wp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+	bool ret = ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) == 0;
+	if (DEBUG && !ret && errno != EAGAIN) warn("writeprotect failed");
+	return ret;
+}
+
+struct uffdw_cache_t * uffdw_cache_create(size_t budget) {
+	struct uffdw_cache_t * cache = malloc(sizeof(struct uffdw_cache_t));
+	if (cache == NULL) return NULL;
+	cache->pagesize = sysconf(_SC_PAGESIZE);
+	cache->count = _max(budget / cache->pagesize, 1);
+	cache->used = 0;
+	cache->newest = UFFDW_CACHE_NONE;
+	cache->oldest = UFFDW_CACHE_NONE;
+
+	size_t buckets = 1;
+	while (buckets < cache->count) buckets *= 2;
+	cache->bucket_mask = buckets - 1;
+
+	cache->entries = malloc(sizeof(struct _uffdw_cache_entry_t) * cache->count);
+	cache->pages = malloc(cache->pagesize * cache->count);
+	cache->buckets = malloc(sizeof(size_t) * buckets);
+	if (
+		cache->entries == NULL || cache->pages == NULL || cache->buckets == NULL ||
+		pthread_mutex_init(&cache->mutex, NULL) != 0
+	) {
+		warn("failed to allocate page cache");
+		free(cache->entries);
+		free(cache->pages);
+		free(cache->buckets);
+		free(cache);
+		return NULL;
+	}
+	for (size_t i = 0; i < buckets; i ++) cache->buckets[i] = UFFDW_CACHE_NONE;
+
+	return cache;
+}
+
+void uffdw_cache_destroy(struct uffdw_cache_t * cache) {
+	if (cache == NULL) return;
+	if (pthread_mutex_destroy(&cache->mutex) != 0) warnx("failed to destroy mutex");
+	free(cache->entries);
+	free(cache->pages);
+	free(cache->buckets);
+	free(cache);
+}
+
+/**
+ * Find place in swap file for page of `victim`, keeping the one it has.
+ * Must be called with `budget->mutex` held.
+ */
+static bool _uffdw_budget_swap_slot(struct uffdw_budget_t * budget, struct _uffdw_resident_t * victim, size_t * offset) {
+	struct _uffdw_page_entry_t * entry = _uffdw_page_map_find(&budget->swapped, victim->uffdw, victim->address);
+	if (entry != NULL) {
+		*offset = entry->value;
+		return true;
+	}
+	if (!_uffdw_page_map_reserve(&budget->swapped, 1)) return false;
+	if (budget->swap_free_count > 0) {
+		*offset = budget->swap_free[-- budget->swap_free_count];
+	} else {
+		size_t * more = realloc(budget->swap_free, sizeof(size_t) * (budget->swap_end / budget->pagesize + 1));
+		if (more == NULL) return false;
+		budget->swap_free = more;
+		*offset = budget->swap_end;
+		budget->swap_end += budget->pagesize;
+	}
+	_uffdw_page_map_put(&budget->swapped, victim->uffdw, victim->address)->value = *offset;
+	return true;
+}
+
+/**
+ * Write page of `victim` out, keeping it if that fails. Page is
+ * protected first, so that no write gets lost while it's being copied.
+ */
+static bool _uffdw_budget_swap_out(struct uffdw_budget_t * budget, struct _uffdw_resident_t * victim) {
+	int uffd = victim->uffdw->uffd;
+	if (!uffdw_writeprotect(uffd, victim->address, budget->pagesize, true)) return false;
+
+	pthread_mutex_lock(&budget->mutex);
+	size_t offset;
+	bool ok = _uffdw_budget_swap_slot(budget, victim, &offset);
+	pthread_mutex_unlock(&budget->mutex);
+	if (!ok) {
+		warn("failed to find room in swap");
+	} else if (pwrite(budget->swap_fd, (void *)victim->address, budget->pagesize, offset) != (ssize_t)budget->pagesize) {
+		warn("failed to write page to swap");
+		ok = false;
+	}
+
+	if (!ok) uffdw_writeprotect(uffd, victim->address, budget->pagesize, false);
+	return ok;
+}
+
+/**
+ * Drop pages over budget, those not faulted in again since the clock
+ * hand passed them last. Dropping is left to this thread, as faults
+ * handlers would wait on their own REMOVE events.
+ */
+static void * _uffdw_budget_run(void * _budget) {
+	struct uffdw_budget_t * budget = _budget;
+	size_t victims[UFFDW_EVICT_BATCH];
+
+	pthread_mutex_lock(&budget->mutex);
+	while (true) {
+		size_t resident = budget->capacity - budget->free_count;
+		if (resident <= budget->pages && !budget->stop) {
+			pthread_cond_wait(&budget->over, &budget->mutex);
+			continue;
+		}
+		if (budget->stop) break;
+
+		size_t count = 0;
+		size_t want = _min(resident - budget->pages, UFFDW_EVICT_BATCH);
+		// two rounds at most, the first one clears the referenced bits
+		for (size_t step = 0; step < 2 * budget->capacity && count < want; step ++) {
+			struct _uffdw_resident_t * slot = &budget->slots[budget->hand];
+			size_t i = budget->hand;
+			budget->hand = (budget->hand + 1) % budget->capacity;
+			if (slot->uffdw == NULL || (slot->flags & UFFDW_RESIDENT_EVICTING)) continue;
+			if (slot->flags & UFFDW_RESIDENT_REFERENCED) {
+				slot->flags &= ~UFFDW_RESIDENT_REFERENCED;
+				continue;
+			}
+			slot->flags |= UFFDW_RESIDENT_EVICTING;
+			victims[count ++] = i;
+		}
+		pthread_mutex_unlock(&budget->mutex);
+
+		bool kept[UFFDW_EVICT_BATCH];
+		for (size_t v = 0; v < count; v ++) {
+			// slot stays put while it's being evicted
+			struct _uffdw_resident_t * victim = &budget->slots[victims[v]];
+			kept[v] = budget->swap_fd >= 0 && (victim->flags & UFFDW_RESIDENT_DIRTY) &&
+				!_uffdw_budget_swap_out(budget, victim);
+			if (kept[v]) continue;
+			if (madvise((void *)victim->address, budget->pagesize, MADV_DONTNEED) != 0) {
+				warn("failed to drop page");
+			}
+			// writers held up meanwhile fault it in again
+			uffdw_wake(victim->uffdw->uffd, victim->address, budget->pagesize);
+			// REMOVE event is read, but it may be handled still - it must
+			// find the page being dropped, or it would forget its swap copy
+			pthread_mutex_lock(&victim->uffdw->mutex);
+			pthread_mutex_unlock(&victim->uffdw->mutex);
+		}
+
+		pthread_mutex_lock(&budget->mutex);
+		for (size_t v = 0; v < count; v ++) {
+			struct _uffdw_resident_t * victim = &budget->slots[victims[v]];
+			victim->flags &= ~UFFDW_RESIDENT_EVICTING;
+			if (kept[v]) continue;
+			_uffdw_page_map_del(&budget->resident, _uffdw_page_map_find(&budget->resident, victim->uffdw, victim->address));
+			victim->uffdw = NULL;
+			budget->free_slots[budget->free_count ++] = victims[v];
+		}
+		pthread_cond_broadcast(&budget->evicted);
+		// nothing to pick, everything is being dropped by now
+		if (count == 0) pthread_cond_wait(&budget->over, &budget->mutex);
+	}
+	pthread_mutex_unlock(&budget->mutex);
+	return NULL;
+}
+
+struct uffdw_budget_t * uffdw_budget_create(size_t size, int swap_fd) {
+	struct uffdw_budget_t * budget = calloc(1, sizeof(struct uffdw_budget_t));
+	if (budget == NULL) return NULL;
+	budget->pagesize = sysconf(_SC_PAGESIZE);
+	budget->pages = _max(size / budget->pagesize, 1);
+	budget->capacity = budget->pages * 2;
+	budget->swap_fd = swap_fd;
+
+	budget->slots = calloc(budget->capacity, sizeof(struct _uffdw_resident_t));
+	budget->free_slots = malloc(sizeof(size_t) * budget->capacity);
+	bool ok = budget->slots != NULL && budget->free_slots != NULL;
+	ok = ok && _uffdw_page_map_init(&budget->resident, budget->capacity);
+	ok = ok && _uffdw_page_map_init(&budget->swapped, 0);
+	if (!ok) {
+		warn("failed to allocate budget");
+		goto fail;
+	}
+	for (size_t i = 0; i < budget->capacity; i ++) budget->free_slots[i] = budget->capacity - 1 - i;
+	budget->free_count = budget->capacity;
+
+	if (
+		pthread_mutex_init(&budget->mutex, NULL) != 0 ||
+		pthread_cond_init(&budget->over, NULL) != 0 ||
+		pthread_cond_init(&budget->evicted, NULL) != 0 ||
+		pthread_create(&budget->thread, NULL, _uffdw_budget_run, budget) != 0
+	) {
+		warnx("failed to start budget thread");
+		goto fail;
+	}
+	return budget;
+
+fail:
+	free(budget->slots);
+	free(budget->free_slots);
+	free(budget->resident.entries);
+	free(budget->swapped.entries);
+	free(budget);
+	return NULL;
+}
+
+void uffdw_budget_destroy(struct uffdw_budget_t * budget) {
+	if (budget == NULL) return;
+	pthread_mutex_lock(&budget->mutex);
+	budget->stop = true;
+	pthread_cond_signal(&budget->over);
+	pthread_mutex_unlock(&budget->mutex);
+	if (pthread_join(budget->thread, NULL) != 0) warnx("failed to join budget thread");
+
+	pthread_cond_destroy(&budget->over);
+	pthread_cond_destroy(&budget->evicted);
+	if (pthread_mutex_destroy(&budget->mutex) != 0) warnx("failed to destroy mutex");
+	free(budget->slots);
+	free(budget->free_slots);
+	free(budget->resident.entries);
+	free(budget->swapped.entries);
+	free(budget->swap_free);
+	free(budget);
+}
+
+size_t uffdw_budget_resident(struct uffdw_budget_t * budget) {
+	pthread_mutex_lock(&budget->mutex);
+	size_t resident = budget->capacity - budget->free_count;
+	pthread_mutex_unlock(&budget->mutex);
+	return resident * budget->pagesize;
+}
@@ -0,0 +1,106 @@
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 8
+#define THREADS 8
+
+static size_t page_size;
+static char * addr;
+
+// requests left for the worker
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static size_t requests[PAGES * 2];
+static size_t request_count = 0;
+static size_t calls[PAGES * 2];
+static int the_uffd;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	(void)size;
+	pthread_mutex_lock(&mutex);
+	the_uffd = uffd;
+	calls[page / page_size] ++;
+	requests[request_count ++] = page_original;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+	return UFFDW_PENDING;
+}
+
+static void complete(size_t page_original) {
+	size_t page = (page_original - (size_t)addr) / page_size;
+	if (page == PAGES - 1) {
+		if (!uffdw_complete(the_uffd, NULL, page_original, page_size)) abort();
+		return;
+	}
+	char buf[page_size];
+	memset(buf, (char)page, page_size);
+	if (!uffdw_complete(the_uffd, buf, page_original, page_size)) abort();
+}
+
+void * touch(void * _i) {
+	size_t i = (size_t)_i;
+	char expected = i == PAGES - 1 ? 0 : (char)i;
+	assert(addr[i * page_size] == expected);
+	return NULL;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	addr = mmap(
+		NULL, page_size * PAGES * 2,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, page_size * PAGES * 2, 0,
+		handler, NULL
+	)) abort();
+
+	// a single handling thread has all the faults in flight at once
+	pthread_t threads[THREADS];
+	for (size_t i = 0; i < PAGES; i ++) {
+		if (pthread_create(&threads[i], NULL, touch, (void *)i) != 0) abort();
+	}
+	pthread_mutex_lock(&mutex);
+	while (request_count < PAGES) pthread_cond_wait(&cond, &mutex);
+	pthread_mutex_unlock(&mutex);
+	for (size_t i = PAGES; i > 0; i --) complete(requests[i - 1]);
+	for (size_t i = 0; i < PAGES; i ++) {
+		if (pthread_join(threads[i], NULL) != 0) abort();
+	}
+
+	// faults on the same page ask for it once
+	for (size_t i = 0; i < THREADS; i ++) {
+		if (pthread_create(&threads[i], NULL, touch, (void *)PAGES) != 0) abort();
+	}
+	pthread_mutex_lock(&mutex);
+	while (request_count < PAGES + 1) pthread_cond_wait(&cond, &mutex);
+	pthread_mutex_unlock(&mutex);
+	usleep(100000);
+	complete(requests[PAGES]);
+	for (size_t i = 0; i < THREADS; i ++) {
+		if (pthread_join(threads[i], NULL) != 0) abort();
+	}
+
+	for (size_t i = 0; i <= PAGES; i ++) {
+		assert(calls[i] == 1);
+	}
+	assert(request_count == PAGES + 1);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
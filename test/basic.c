@@ -7,8 +7,9 @@
 #include <string.h>
 #include <stdio.h>
 
-bool handler(int uffd, size_t page, size_t page_original, void * the_page) {
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * the_page) {
 	(void)page;
+	(void)size;
 	bool result = uffdw_copy(uffd, the_page, page_original, sysconf(_SC_PAGESIZE));
 	((char *)the_page)[42] ++;
 	return result;
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 16
+#define THREADS_PER_PAGE 2
+
+static size_t page_size;
+static char * addr;
+static size_t _Atomic calls = 0;
+static size_t _Atomic last_size = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	// hold the first fault up, so that the others pile up meanwhile
+	if (atomic_fetch_add(&calls, 1) == 0) usleep(300000);
+	atomic_store(&last_size, size);
+
+	char buf[size];
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)((page + i) / page_size), page_size);
+	}
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+void * touch(void * _page) {
+	size_t page = (size_t)_page;
+	assert(addr[page * page_size] == (char)page);
+	return NULL;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL
+	)) abort();
+
+	pthread_t first;
+	if (pthread_create(&first, NULL, touch, (void *)0) != 0) abort();
+	while (atomic_load(&calls) == 0) usleep(1000);
+
+	// faults on the rest, each page more than once
+	pthread_t threads[PAGES * THREADS_PER_PAGE];
+	for (size_t i = 0; i < PAGES * THREADS_PER_PAGE; i ++) {
+		size_t page = 1 + i % (PAGES - 1);
+		if (pthread_create(&threads[i], NULL, touch, (void *)page) != 0) abort();
+	}
+	if (pthread_join(first, NULL) != 0) abort();
+	for (size_t i = 0; i < PAGES * THREADS_PER_PAGE; i ++) {
+		if (pthread_join(threads[i], NULL) != 0) abort();
+	}
+
+	// all of them came with a single handler call
+	assert(atomic_load(&calls) == 2);
+	assert(atomic_load(&last_size) == page_size * (PAGES - 1));
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
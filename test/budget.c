@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <err.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 64
+#define KEPT 8
+#define SWAP_PAGES 16
+#define SWAP_KEPT 4
+
+static size_t page_size;
+static size_t _Atomic calls = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	atomic_fetch_add(&calls, 1);
+	char buf[size];
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)((page + i) / page_size), page_size);
+	}
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+static char * map(struct uffdw_t * uffdw, size_t pages, struct uffdw_budget_t * budget) {
+	char * addr = mmap(
+		NULL, page_size * pages,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	struct uffdw_range_options_t options = {.budget = budget};
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)addr, page_size * pages, 0,
+		handler, NULL,
+		&options
+	)) abort();
+	return addr;
+}
+
+static void settle(struct uffdw_budget_t * budget, size_t pages) {
+	while (uffdw_budget_resident(budget) > pages * page_size) usleep(1000);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// dropped pages are asked for again
+	struct uffdw_budget_t * budget = uffdw_budget_create(page_size * KEPT, -1);
+	if (budget == NULL) abort();
+	char * addr = map(uffdw, PAGES, budget);
+	for (size_t p = 0; p < PAGES; p ++) assert(addr[p * page_size] == (char)p);
+	// pages faulted in while others are dropped may be asked for twice
+	size_t asked = atomic_load(&calls);
+	assert(asked >= PAGES);
+	settle(budget, KEPT);
+	assert(addr[0] == 0);
+	assert(atomic_load(&calls) > asked);
+
+	// written pages come back from swap
+	FILE * swap = tmpfile();
+	if (swap == NULL) err(EXIT_FAILURE, "failed to create swap file");
+	struct uffdw_budget_t * swapping = uffdw_budget_create(page_size * SWAP_KEPT, fileno(swap));
+	if (swapping == NULL) abort();
+	atomic_store(&calls, 0);
+	char * written = map(uffdw, SWAP_PAGES, swapping);
+	for (size_t p = 0; p < SWAP_PAGES; p ++) written[p * page_size + 1] = (char)(p + 100);
+	asked = atomic_load(&calls);
+	assert(asked >= SWAP_PAGES);
+	settle(swapping, SWAP_KEPT);
+	for (size_t round = 0; round < 2; round ++) {
+		for (size_t p = 0; p < SWAP_PAGES; p ++) {
+			assert(written[p * page_size] == (char)p);
+			assert(written[p * page_size + 1] == (char)(p + 100));
+		}
+	}
+	assert(atomic_load(&calls) == asked);
+
+	// unless they are dropped by someone else
+	settle(swapping, SWAP_KEPT);
+	if (madvise(written, page_size, MADV_DONTNEED) != 0) err(EXIT_FAILURE, "failed to drop page");
+	assert(written[1] == 0);
+	assert(atomic_load(&calls) > asked);
+
+	// and moved pages take their copies along
+	settle(swapping, SWAP_KEPT);
+	char * to = mmap(NULL, page_size * SWAP_PAGES, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (to == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	char * moved = mremap(written, page_size * SWAP_PAGES, page_size * SWAP_PAGES, MREMAP_MAYMOVE | MREMAP_FIXED, to);
+	if (moved == MAP_FAILED) err(EXIT_FAILURE, "failed to remap");
+	for (size_t p = 1; p < SWAP_PAGES; p ++) {
+		assert(moved[p * page_size] == (char)p);
+		assert(moved[p * page_size + 1] == (char)(p + 100));
+	}
+
+	uffdw_cancel(uffdw);
+	uffdw_budget_destroy(budget);
+	uffdw_budget_destroy(swapping);
+	fclose(swap);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 8
+#define CACHED 4
+
+static size_t page_size;
+static size_t calls = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	(void)size;
+	calls ++;
+	char buf[page_size];
+	memset(buf, (char)(page / page_size), page_size);
+	return uffdw_copy(uffd, buf, page_original, page_size);
+}
+
+static char * map(struct uffdw_t * uffdw, struct uffdw_range_options_t * options) {
+	char * addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL,
+		options
+	)) abort();
+	return addr;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_cache_t * cache = uffdw_cache_create(page_size * CACHED);
+	if (cache == NULL) abort();
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+	struct uffdw_range_options_t options = {.cache = cache};
+
+	char * addr = map(uffdw, &options);
+	for (size_t p = 0; p < CACHED; p ++) assert(addr[p * page_size] == (char)p);
+	assert(calls == CACHED);
+
+	// forked process gets the pages from the cache
+	int pid = fork();
+	if (pid == 0) {
+		for (size_t p = 0; p < CACHED; p ++) {
+			if (addr[p * page_size] != (char)p) return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+	int s;
+	if (waitpid(pid, &s, 0) != pid) abort();
+	assert(WIFEXITED(s) && WEXITSTATUS(s) == EXIT_SUCCESS);
+	assert(calls == CACHED);
+
+	// and so does another range with the same handler pages
+	char * alias = map(uffdw, &options);
+	for (size_t p = 0; p < CACHED; p ++) assert(alias[p * page_size] == (char)p);
+	assert(calls == CACHED);
+
+	// least recently used pages go first
+	char * other = map(uffdw, &options);
+	assert(other[0] == 0);
+	for (size_t p = CACHED; p < PAGES - 1; p ++) assert(addr[p * page_size] == (char)p);
+	assert(calls == PAGES - 1);
+	char * third = map(uffdw, &options);
+	assert(third[0] == 0);
+	assert(calls == PAGES - 1);
+	assert(third[page_size] == 1);
+	assert(calls == PAGES);
+
+	// uncached range always asks
+	struct uffdw_range_options_t no_cache = {0};
+	char * uncached = map(uffdw, &no_cache);
+	assert(uncached[0] == 0);
+	assert(calls == PAGES + 1);
+
+	uffdw_cancel(uffdw);
+	uffdw_cache_destroy(cache);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define RANGES 256
+#define CHILDREN 8
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	// no allocation, a fork may be waiting for this very thread
+	char buf[size];
+	memset(buf, (char)(page / page_size / 2), size);
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+static bool check(char * addr, size_t from, size_t step) {
+	for (size_t r = from; r < RANGES; r += step) {
+		if (addr[r * page_size] != (char)r) return false;
+	}
+	return true;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// ranges of a page each, their handler pages don't follow so they stay apart
+	char * addr = mmap(
+		NULL, page_size * RANGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	for (size_t r = 0; r < RANGES; r ++) {
+		if (!uffdw_register(
+			uffdw,
+			(size_t)addr + r * page_size, page_size, r * page_size * 2,
+			handler, NULL
+		)) abort();
+	}
+
+	// children start with the table of the parent and change their own
+	pid_t pids[CHILDREN];
+	for (size_t c = 0; c < CHILDREN; c ++) {
+		pids[c] = fork();
+		if (pids[c] < 0) err(EXIT_FAILURE, "failed to fork");
+		if (pids[c] == 0) {
+			if (munmap(addr + c * page_size, page_size) != 0) return EXIT_FAILURE;
+			size_t other = (c + 1) % CHILDREN;
+			bool ok = addr[other * page_size] == (char)other && check(addr, CHILDREN, 2);
+			return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+		// and parent changes its one meanwhile
+		if (munmap(addr + (CHILDREN + c * 2 + 1) * page_size, page_size) != 0) err(EXIT_FAILURE, "failed to unmap");
+	}
+	for (size_t c = 0; c < CHILDREN; c ++) {
+		int s;
+		if (waitpid(pids[c], &s, 0) != pids[c]) abort();
+		assert(WIFEXITED(s) && WEXITSTATUS(s) == EXIT_SUCCESS);
+	}
+	for (size_t r = 0; r < CHILDREN; r ++) assert(addr[r * page_size] == (char)r);
+	assert(check(addr, CHILDREN, 2));
+	assert(check(addr, CHILDREN * 3 + 1, 1));
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
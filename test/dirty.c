@@ -0,0 +1,92 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 64
+#define LAZY_PAGES 16
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	char buf[size];
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)((page + i) / page_size), page_size);
+	}
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+static void expect_dirty(struct uffdw_t * uffdw, char * addr, size_t pages, const size_t * expected, size_t n) {
+	unsigned long dirty[(pages + sizeof(unsigned long) * 8 - 1) / (sizeof(unsigned long) * 8)];
+	if (!uffdw_collect_dirty(uffdw, (size_t)addr, pages * page_size, dirty)) abort();
+	size_t count = 0;
+	for (size_t p = 0; p < pages; p ++) {
+		if (dirty[p / (sizeof(unsigned long) * 8)] & (1UL << (p % (sizeof(unsigned long) * 8)))) count ++;
+	}
+	assert(count == n);
+	for (size_t i = 0; i < n; i ++) {
+		size_t p = expected[i];
+		assert(dirty[p / (sizeof(unsigned long) * 8)] & (1UL << (p % (sizeof(unsigned long) * 8))));
+	}
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// populated memory
+	char * addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	memset(addr, 1, page_size * PAGES);
+	if (!uffdw_track_dirty(uffdw, (size_t)addr, page_size * PAGES)) abort();
+
+	expect_dirty(uffdw, addr, PAGES, NULL, 0);
+	addr[3 * page_size] = 2;
+	addr[10 * page_size + 5] = 2;
+	addr[63 * page_size] = 2;
+	expect_dirty(uffdw, addr, PAGES, (size_t[]){3, 10, 63}, 3);
+
+	// protection is back after collecting
+	addr[10 * page_size] = 3;
+	addr[20 * page_size] = 3;
+	expect_dirty(uffdw, addr, PAGES, (size_t[]){10, 20}, 2);
+	expect_dirty(uffdw, addr, PAGES, NULL, 0);
+	assert(addr[10 * page_size] == 3 && addr[10 * page_size + 5] == 2 && addr[11 * page_size] == 1);
+
+	// lazily filled memory, filled pages start clean
+	char * lazy = mmap(
+		NULL, page_size * LAZY_PAGES,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (lazy == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)lazy, page_size * LAZY_PAGES, 0,
+		handler, NULL
+	)) abort();
+	if (!uffdw_track_dirty(uffdw, (size_t)lazy, page_size * LAZY_PAGES)) abort();
+
+	for (size_t p = 0; p < LAZY_PAGES / 2; p ++) {
+		assert(lazy[p * page_size] == (char)p);
+	}
+	lazy[2 * page_size + 1] = 42;
+	lazy[12 * page_size + 1] = 42;
+	expect_dirty(uffdw, lazy, LAZY_PAGES, (size_t[]){2, 12}, 2);
+	assert(lazy[12 * page_size] == 12);
+	assert(lazy[12 * page_size + 1] == 42);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+#include <assert.h>
+#include <err.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+static size_t page_size;
+
+static void read_at(int fd, void * buf, size_t size, size_t offset) {
+	if (pread(fd, buf, size, offset) != (ssize_t)size) err(EXIT_FAILURE, "failed to read");
+}
+
+/**
+ * Get protection of mapping at `address` as in /proc/self/maps.
+ */
+static void protection(size_t address, char perms[5]) {
+	FILE * maps = fopen("/proc/self/maps", "r");
+	if (maps == NULL) err(EXIT_FAILURE, "failed to open maps");
+	size_t begin, end;
+	perms[0] = '\0';
+	while (fscanf(maps, "%zx-%zx %4s%*[^\n]", &begin, &end, perms) == 3) {
+		if (begin <= address && address < end) break;
+		perms[0] = '\0';
+	}
+	fclose(maps);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	// load the test itself
+	int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) err(EXIT_FAILURE, "failed to open executable");
+	ElfW(Ehdr) ehdr;
+	read_at(fd, &ehdr, sizeof(ehdr), 0);
+	ElfW(Phdr) phdrs[ehdr.e_phnum];
+	read_at(fd, phdrs, sizeof(phdrs), ehdr.e_phoff);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+	struct uffdw_elf_t elf;
+	if (!uffdw_load_elf(uffdw, fd, &elf)) abort();
+	close(fd);
+	assert(elf.entry == elf.bias + ehdr.e_entry);
+
+	// only touched pages are read
+	size_t first = 0;
+	while (phdrs[first].p_type != PT_LOAD) first ++;
+	assert(*(char *)(elf.bias + phdrs[first].p_vaddr) == ELFMAG0);
+	// counted just after the faulting thread is woken
+	struct uffdw_stats_t stats;
+	do {
+		usleep(1000);
+		uffdw_get_stats(uffdw, &stats, NULL, 0);
+	} while (stats.counters.faults == 0);
+	assert(stats.counters.faults == 1);
+	assert(stats.counters.bytes_copied == page_size);
+
+	fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) err(EXIT_FAILURE, "failed to open executable");
+	bool bss = false;
+	for (size_t i = 0; i < ehdr.e_phnum; i ++) {
+		ElfW(Phdr) * phdr = &phdrs[i];
+		if (phdr->p_type != PT_LOAD) continue;
+		char * segment = (char *)(elf.bias + phdr->p_vaddr);
+		assert((size_t)segment >= elf.base && (size_t)segment + phdr->p_memsz <= elf.base + elf.size);
+
+		char perms[5];
+		protection((size_t)segment, perms);
+		assert(perms[0] == (phdr->p_flags & PF_R ? 'r' : '-'));
+		assert(perms[1] == (phdr->p_flags & PF_W ? 'w' : '-'));
+		assert(perms[2] == (phdr->p_flags & PF_X ? 'x' : '-'));
+
+		// file data and zeroes after it, up to the end of the last page
+		char * data = malloc(phdr->p_filesz);
+		if (data == NULL) abort();
+		read_at(fd, data, phdr->p_filesz, phdr->p_offset);
+		assert(memcmp(segment, data, phdr->p_filesz) == 0);
+		free(data);
+		size_t end = (phdr->p_vaddr + phdr->p_memsz + page_size - 1) / page_size * page_size;
+		for (size_t a = phdr->p_vaddr + phdr->p_filesz; a < end; a ++) {
+			assert(*(char *)(elf.bias + a) == 0);
+			bss = true;
+		}
+	}
+	assert(bss);
+	close(fd);
+
+	// data is private to the loaded copy
+	for (size_t i = 0; i < ehdr.e_phnum; i ++) {
+		if (phdrs[i].p_type != PT_LOAD || !(phdrs[i].p_flags & PF_W)) continue;
+		char * segment = (char *)(elf.bias + phdrs[i].p_vaddr);
+		segment[0] ++;
+	}
+
+	// non ELF files are refused
+	char path[] = "/tmp/uffdw-elf-XXXXXX";
+	fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create file");
+	unlink(path);
+	if (write(fd, "#!/bin/sh\n", 10) != 10) err(EXIT_FAILURE, "failed to write");
+	struct uffdw_elf_t not_elf;
+	assert(!uffdw_load_elf(uffdw, fd, &not_elf));
+	close(fd);
+
+	munmap((void *)elf.base, elf.size);
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
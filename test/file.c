@@ -0,0 +1,72 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define FILE_PAGES 10
+
+int main() {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	// file with page number on each byte, last page is cut in half
+	char path[] = "/tmp/uffdw-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create file");
+	if (unlink(path) != 0) err(EXIT_FAILURE, "failed to unlink file");
+	char * page = malloc(page_size);
+	for (size_t p = 0; p < FILE_PAGES; p ++) {
+		for (size_t i = 0; i < page_size; i ++) page[i] = (char)(p + 1);
+		size_t size = p == FILE_PAGES - 1 ? page_size / 2 : page_size;
+		if (write(fd, page, size) != (ssize_t)size) err(EXIT_FAILURE, "failed to write file");
+	}
+	free(page);
+
+	// fd position must not matter
+	if (lseek(fd, 3, SEEK_SET) != 3) err(EXIT_FAILURE, "failed to seek");
+
+	struct uffdw_t * uffdw = uffdw_create_pool(2);
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	char * addr = mmap(
+		NULL, page_size * 12,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+
+	// skip first page of the file, cover its end and a bit more
+	if (!uffdw_register_file(
+		uffdw,
+		(size_t)addr, page_size * 6,
+		fd, page_size
+	)) abort();
+	struct uffdw_range_options_t options = {.readahead = 4};
+	if (!uffdw_register_file_opts(
+		uffdw,
+		(size_t)addr + page_size * 6, page_size * 6,
+		fd, page_size * 7,
+		&options
+	)) abort();
+	if (close(fd) != 0) err(EXIT_FAILURE, "failed to close file");
+
+	for (size_t p = 12; p > 0; p --) {
+		size_t file_page = p;
+		char * data = addr + (p - 1) * page_size;
+		if (file_page < FILE_PAGES - 1) {
+			assert(data[0] == (char)(file_page + 1));
+			assert(data[page_size - 1] == (char)(file_page + 1));
+		} else if (file_page == FILE_PAGES - 1) {
+			assert(data[0] == (char)FILE_PAGES);
+			assert(data[page_size / 2 - 1] == (char)FILE_PAGES);
+			assert(data[page_size / 2] == 0);
+		} else {
+			assert(data[0] == 0);
+		}
+	}
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
@@ -1,15 +1,20 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <uffdw.h>
 #include <unistd.h>
 
-bool handler(int uffd, size_t page, size_t page_original, void * the_page) {
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * the_page) {
 	(void)page;
-	bool r = uffdw_copy(uffd, the_page, page_original, sysconf(_SC_PAGESIZE));
+	(void)size;
+	// faulting process may run (and fork) as soon as the page is in
+	// place, so bump the counter before that and don't allocate
+	char copy[sysconf(_SC_PAGESIZE)];
+	memcpy(copy, the_page, sizeof(copy));
 	((char *)the_page)[0] ++;
-	return r;
+	return uffdw_copy(uffd, copy, page_original, sizeof(copy));
 }
 
 int main() {
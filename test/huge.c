@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define HUGE_PAGE (2UL << 20)
+#define PAGES 4
+
+static char * buf;
+static size_t calls = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	calls ++;
+	assert(page % HUGE_PAGE == 0 && page_original % HUGE_PAGE == 0);
+	assert(size == HUGE_PAGE);
+	memset(buf, (char)(1 + page / HUGE_PAGE), HUGE_PAGE);
+	return uffdw_copy(uffd, buf, page_original, HUGE_PAGE);
+}
+
+enum uffdw_status_t zero_handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	(void)page;
+	return uffdw_zeropage(uffd, page_original, size);
+}
+
+int main() {
+	char * addr = mmap(
+		NULL, HUGE_PAGE * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) {
+		printf("no huge pages available, skipping\n");
+		return EXIT_SUCCESS;
+	}
+	buf = malloc(HUGE_PAGE);
+	if (buf == NULL) abort();
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// page size is found out from the mapping
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, HUGE_PAGE * (PAGES - 1), 0,
+		handler, NULL
+	)) abort();
+	struct uffdw_range_options_t options = {.pagesize = HUGE_PAGE};
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)addr + HUGE_PAGE * (PAGES - 1), HUGE_PAGE, 0,
+		zero_handler, NULL,
+		&options
+	)) abort();
+
+	// a fault anywhere in a huge page brings the whole one
+	for (size_t p = 0; p < PAGES - 1; p ++) {
+		size_t inside = (p * 12345 * 4096) % HUGE_PAGE;
+		assert(addr[p * HUGE_PAGE + inside] == (char)(1 + p));
+		assert(addr[p * HUGE_PAGE] == (char)(1 + p));
+		assert(addr[p * HUGE_PAGE + HUGE_PAGE - 1] == (char)(1 + p));
+	}
+	assert(calls == PAGES - 1);
+	assert(addr[HUGE_PAGE * (PAGES - 1) + 4096 * 7] == 0);
+	assert(addr[HUGE_PAGE * PAGES - 1] == 0);
+
+	// ranges that are not made of whole huge pages are refused
+	assert(!uffdw_register_opts(
+		uffdw,
+		(size_t)addr + HUGE_PAGE * PAGES, 4096, 0,
+		handler, NULL,
+		&options
+	));
+
+	// file ending in the middle of a huge page has it padded whole
+	char path[] = "/tmp/uffdw-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create file");
+	unlink(path);
+	memset(buf, 9, HUGE_PAGE);
+	if (write(fd, buf, HUGE_PAGE) != (ssize_t)HUGE_PAGE || write(fd, buf, 100) != 100) {
+		err(EXIT_FAILURE, "failed to write file");
+	}
+	char * file_addr = mmap(
+		NULL, HUGE_PAGE * 2,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		-1, 0
+	);
+	if (file_addr != MAP_FAILED) {
+		if (!uffdw_register_file(uffdw, (size_t)file_addr, HUGE_PAGE * 2, fd, 0)) abort();
+		assert(file_addr[HUGE_PAGE + 99] == 9);
+		assert(file_addr[HUGE_PAGE + 100] == 0);
+		assert(file_addr[HUGE_PAGE * 2 - 1] == 0);
+		assert(file_addr[0] == 9);
+		munmap(file_addr, HUGE_PAGE * 2);
+	}
+	close(fd);
+
+	uffdw_cancel(uffdw);
+	munmap(addr, HUGE_PAGE * PAGES);
+	free(buf);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define DATA_PAGES 10
+#define BLOCK_PAGES 4
+
+static int temp_file(void) {
+	char path[] = "/tmp/uffdw-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create file");
+	if (unlink(path) != 0) err(EXIT_FAILURE, "failed to unlink file");
+	return fd;
+}
+
+int main() {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	// runs of page number on odd pages, noise on even ones, last page is cut in half
+	size_t size = page_size * DATA_PAGES - page_size / 2;
+	char * data = malloc(size);
+	unsigned int seed = 1;
+	for (size_t i = 0; i < size; i ++) {
+		size_t p = i / page_size;
+		data[i] = p % 2 ? (char)(p + i / 100) : (char)rand_r(&seed);
+	}
+	int fd = temp_file();
+	if (write(fd, data, size) != (ssize_t)size) err(EXIT_FAILURE, "failed to write file");
+
+	int packed_fd = temp_file();
+	if (!uffdw_pack(fd, packed_fd, page_size * BLOCK_PAGES)) abort();
+	struct stat st;
+	if (fstat(packed_fd, &st) != 0) err(EXIT_FAILURE, "failed to stat file");
+	assert((size_t)st.st_size < size);
+
+	struct uffdw_t * uffdw = uffdw_create_pool(2);
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	char * addr = mmap(
+		NULL, page_size * 12,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+
+	// skip first page of the data, cover its end and a bit more
+	if (!uffdw_register_packed(
+		uffdw,
+		(size_t)addr, page_size * 12,
+		packed_fd, page_size
+	)) abort();
+	if (close(packed_fd) != 0) err(EXIT_FAILURE, "failed to close file");
+
+	for (size_t p = 12; p > 0; p --) {
+		char * page = addr + (p - 1) * page_size;
+		size_t data_offset = p * page_size;
+		for (size_t i = 0; i < page_size; i ++) {
+			char expected = data_offset + i < size ? data[data_offset + i] : 0;
+			assert(page[i] == expected);
+		}
+	}
+
+	// not a packed image
+	assert(!uffdw_register_packed(
+		uffdw,
+		(size_t)addr + page_size * 12, page_size,
+		fd, 0
+	));
+
+	uffdw_cancel(uffdw);
+	close(fd);
+	free(data);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <err.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 256
+#define GAP 16
+
+static size_t page_size;
+static size_t _Atomic calls = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	atomic_fetch_add(&calls, 1);
+	char buf[size];
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)((page + i) / page_size), page_size);
+	}
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+static size_t resident(char * addr, size_t pages) {
+	unsigned char present[pages];
+	if (mincore(addr, pages * page_size, present) != 0) err(EXIT_FAILURE, "mincore failed");
+	size_t count = 0;
+	for (size_t p = 0; p < pages; p ++) count += present[p] & 1;
+	return count;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// two ranges with a gap left alone between them
+	char * addr = mmap(
+		NULL, page_size * (PAGES + GAP),
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, page_size * PAGES / 2, 0,
+		handler, NULL
+	)) abort();
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr + page_size * (PAGES / 2 + GAP), page_size * PAGES / 2, page_size * PAGES / 2,
+		handler, NULL
+	)) abort();
+
+	// page faulted in already is left as it is
+	assert(addr[page_size * 3] == 3);
+	assert(uffdw_prefetch(uffdw, (size_t)addr, page_size * (PAGES + GAP)));
+	while (resident(addr, PAGES / 2) + resident(addr + page_size * (PAGES / 2 + GAP), PAGES / 2) < PAGES) {
+		usleep(1000);
+	}
+	assert(resident(addr + page_size * PAGES / 2, GAP) == 0);
+	// pages come in runs, not one by one
+	assert(atomic_load(&calls) < PAGES / 2);
+
+	for (size_t p = 0; p < PAGES / 2; p ++) {
+		assert(addr[p * page_size] == (char)p);
+		assert(addr[(PAGES / 2 + GAP + p) * page_size] == (char)(PAGES / 2 + p));
+	}
+	struct uffdw_stats_t stats;
+	uffdw_get_stats(uffdw, &stats, NULL, 0);
+	assert(stats.counters.faults == 1);
+	assert(stats.counters.bytes_copied == page_size * PAGES);
+
+	// populated range fills itself
+	char * populated = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (populated == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	struct uffdw_range_options_t options = {.populate = true};
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)populated, page_size * PAGES, 0,
+		handler, NULL,
+		&options
+	)) abort();
+	while (resident(populated, PAGES) < PAGES) usleep(1000);
+	for (size_t p = 0; p < PAGES; p ++) assert(populated[p * page_size] == (char)p);
+	uffdw_get_stats(uffdw, &stats, NULL, 0);
+	assert(stats.counters.faults == 1);
+
+	// prefetch that is still going on is stopped
+	char * large = mmap(
+		NULL, page_size * PAGES * 64,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (large == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)large, page_size * PAGES * 64, 0,
+		handler, NULL,
+		&options
+	)) abort();
+	assert(large[page_size * PAGES * 32] == 0);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define LOW_THREADS 16
+#define URGENT_PAGE 64
+#define PAGES 80
+
+static size_t page_size;
+static char * addr;
+static size_t _Atomic calls = 0;
+static size_t served[PAGES];
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	size_t call = atomic_fetch_add(&calls, 1);
+	served[call] = page / page_size;
+	// hold the first fault up, so that the others pile up meanwhile
+	if (call == 0) usleep(300000);
+
+	char buf[size];
+	memset(buf, (char)(page / page_size), size);
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+void * touch(void * _page) {
+	size_t page = (size_t)_page;
+	assert(addr[page * page_size] == (char)page);
+	return NULL;
+}
+
+void * touch_urgent(void * _) {
+	(void)_;
+	if (!uffdw_set_thread_priority(gettid(), 10)) abort();
+	touch((void *)URGENT_PAGE);
+	if (!uffdw_set_thread_priority(gettid(), 0)) abort();
+	return NULL;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL
+	)) abort();
+
+	pthread_t first;
+	if (pthread_create(&first, NULL, touch, (void *)0) != 0) abort();
+	while (atomic_load(&calls) == 0) usleep(1000);
+
+	// storm of faults on pages apart, and the urgent one last
+	pthread_t low[LOW_THREADS];
+	for (size_t i = 0; i < LOW_THREADS; i ++) {
+		if (pthread_create(&low[i], NULL, touch, (void *)(2 + 2 * i)) != 0) abort();
+	}
+	usleep(50000);
+	pthread_t urgent;
+	if (pthread_create(&urgent, NULL, touch_urgent, NULL) != 0) abort();
+
+	if (pthread_join(first, NULL) != 0) abort();
+	if (pthread_join(urgent, NULL) != 0) abort();
+	for (size_t i = 0; i < LOW_THREADS; i ++) {
+		if (pthread_join(low[i], NULL) != 0) abort();
+	}
+
+	// it was served right after the one holding everything up
+	assert(atomic_load(&calls) == 2 + LOW_THREADS);
+	assert(served[1] == URGENT_PAGE);
+	// and the rest in order
+	for (size_t i = 0; i < LOW_THREADS; i ++) assert(served[2 + i] == 2 + 2 * i);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
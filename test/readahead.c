@@ -0,0 +1,82 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 64
+
+static size_t page_size;
+static size_t calls;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	char * buf = malloc(size);
+	if (buf == NULL) return false;
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)((page + i) / page_size), page_size);
+	}
+	bool result = uffdw_copy(uffd, buf, page_original, size);
+	free(buf);
+	calls ++;
+	return result;
+}
+
+static size_t scan(struct uffdw_t * uffdw, struct uffdw_range_options_t * options, size_t first) {
+	char * addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL,
+		options
+	)) abort();
+
+	calls = 0;
+	for (size_t p = first; p < PAGES; p ++) {
+		assert(addr[p * page_size] == (char)p);
+	}
+	for (size_t p = 0; p < first; p ++) {
+		assert(addr[p * page_size] == (char)p);
+	}
+
+	if (munmap(addr, page_size * PAGES) != 0) err(EXIT_FAILURE, "failed to unmap");
+	return calls;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// no readahead
+	struct uffdw_range_options_t options = {0};
+	assert(scan(uffdw, &options, 0) == PAGES);
+
+	// fixed window
+	options.readahead = 8;
+	assert(scan(uffdw, &options, 0) == PAGES / 8);
+
+	// window stops at pages that are already there
+	assert(scan(uffdw, &options, 4) == PAGES / 8 + 1);
+
+	// adaptive window: 1, 2, 4, 8, 16, 16, 16, 1
+	options.readahead = 16;
+	options.readahead_adaptive = true;
+	assert(scan(uffdw, &options, 0) == 8);
+
+	// with no bound given: 1, 2, 4, 8, 16, 32, 1
+	options.readahead = 0;
+	assert(scan(uffdw, &options, 0) == 7);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define DATA_PAGES 100
+#define PAGES 128
+#define THREADS 8
+
+static size_t page_size;
+static char * data;
+static size_t size;
+static char * addr;
+static int listen_fd;
+static int data_fd;
+
+static void * serve(void * _) {
+	(void)_;
+	if (!uffdw_serve_pages(listen_fd, data_fd)) abort();
+	return NULL;
+}
+
+static void check(size_t page) {
+	// data is served from its second page
+	size_t data_offset = (page + 1) * page_size;
+	for (size_t i = 0; i < page_size; i += 16) {
+		char expected = data_offset + i < size ? data[data_offset + i] : 0;
+		assert(addr[page * page_size + i] == expected);
+	}
+}
+
+static void * touch(void * _first) {
+	for (size_t p = (size_t)_first; p < PAGES; p += THREADS) check(p);
+	return NULL;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	size = page_size * DATA_PAGES - page_size / 2;
+	data = malloc(size);
+	if (data == NULL) abort();
+	for (size_t i = 0; i < size; i ++) data[i] = (char)(i / page_size + i / 77);
+	char data_path[] = "/tmp/uffdw-test-XXXXXX";
+	data_fd = mkstemp(data_path);
+	if (data_fd < 0) err(EXIT_FAILURE, "failed to create file");
+	if (unlink(data_path) != 0) err(EXIT_FAILURE, "failed to unlink file");
+	if (write(data_fd, data, size) != (ssize_t)size) err(EXIT_FAILURE, "failed to write file");
+
+	// server stands in for another process
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/uffdw-test-%d.sock", getpid());
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) err(EXIT_FAILURE, "failed to create socket");
+	if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0) err(EXIT_FAILURE, "failed to bind");
+	if (listen(listen_fd, 16) != 0) err(EXIT_FAILURE, "failed to listen");
+	pthread_t server;
+	if (pthread_create(&server, NULL, serve, NULL) != 0) abort();
+
+	struct uffdw_t * uffdw = uffdw_create_pool(4);
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+	addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register_remote(
+		uffdw,
+		(size_t)addr, page_size * PAGES,
+		address.sun_path, page_size
+	)) abort();
+
+	// predicted pages come along with the faulting one, right after it's woken
+	check(0);
+	unsigned char resident[UFFDW_REMOTE_PREDICT + 1];
+	for (size_t tries = 0; tries < 1000; tries ++) {
+		if (mincore(addr, page_size * (UFFDW_REMOTE_PREDICT + 1), resident) != 0) err(EXIT_FAILURE, "failed to get residency");
+		if (resident[UFFDW_REMOTE_PREDICT - 1] & 1) break;
+		usleep(1000);
+	}
+	for (size_t p = 0; p < UFFDW_REMOTE_PREDICT; p ++) assert(resident[p] & 1);
+	assert(!(resident[UFFDW_REMOTE_PREDICT] & 1));
+
+	// faults at once go over connections of their own
+	pthread_t threads[THREADS];
+	for (size_t i = 0; i < THREADS; i ++) {
+		if (pthread_create(&threads[i], NULL, touch, (void *)i) != 0) abort();
+	}
+	for (size_t i = 0; i < THREADS; i ++) {
+		if (pthread_join(threads[i], NULL) != 0) abort();
+	}
+
+	// nobody listens there
+	assert(!uffdw_register_remote(
+		uffdw,
+		(size_t)addr, page_size,
+		"/tmp/uffdw-test-nonexistent.sock", 0
+	));
+
+	uffdw_cancel(uffdw);
+	if (shutdown(listen_fd, SHUT_RDWR) != 0) err(EXIT_FAILURE, "failed to shut down socket");
+	if (pthread_join(server, NULL) != 0) abort();
+	close(listen_fd);
+	unlink(address.sun_path);
+	close(data_fd);
+	free(data);
+
+	return EXIT_SUCCESS;
+}
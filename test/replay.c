@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <err.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 16
+#define OTHER_PAGES 8
+#define OTHER_OFFSET 100
+#define TOUCHES 5
+/* trace of more than one chunk */
+#define LONG_PAGES 4096
+
+static size_t page_size;
+static size_t _Atomic calls = 0;
+static size_t asked[PAGES + OTHER_PAGES];
+static size_t _Atomic long_pages = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	(void)size;
+	asked[atomic_fetch_add(&calls, 1)] = page / page_size;
+	char buf[page_size];
+	memset(buf, (char)(page / page_size), page_size);
+	return uffdw_copy(uffd, buf, page_original, page_size);
+}
+
+enum uffdw_status_t long_handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)page;
+	(void)_;
+	atomic_fetch_add(&long_pages, size / page_size);
+	return uffdw_zeropage(uffd, page_original, size);
+}
+
+/**
+ * Map and register pages of the first registration and, if `other`,
+ * of the second one. If `failed`, a registration that fails comes in
+ * between.
+ */
+static struct uffdw_t * start(char * * addr, char * * other_addr, bool other, bool failed) {
+	atomic_store(&calls, 0);
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// at different addresses each time
+	*addr = mmap(NULL, page_size * (PAGES + OTHER_PAGES), PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (*addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	*other_addr = *addr + page_size * PAGES;
+	if (!uffdw_register(uffdw, (size_t)*addr, page_size * PAGES, 0, handler, NULL)) abort();
+	if (failed) {
+		// nothing is mapped there anymore
+		char * gone = mmap(NULL, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (gone == MAP_FAILED || munmap(gone, page_size) != 0) err(EXIT_FAILURE, "failed to map");
+		assert(!uffdw_register(uffdw, (size_t)gone, page_size, 0, handler, NULL));
+	}
+	if (other && !uffdw_register(
+		uffdw,
+		(size_t)*other_addr, page_size * OTHER_PAGES, OTHER_OFFSET * page_size,
+		handler, NULL
+	)) abort();
+	return uffdw;
+}
+
+static void wait_calls(size_t count) {
+	for (size_t i = 0; i < 5000 && atomic_load(&calls) < count; i ++) usleep(1000);
+	usleep(10000);
+	assert(atomic_load(&calls) == count);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+	char path[] = "/tmp/uffdw-trace-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create trace");
+	unlink(path);
+
+	// record, with a failed registration that takes no number
+	char * addr, * other;
+	struct uffdw_t * uffdw = start(&addr, &other, true, true);
+	if (!uffdw_record(uffdw, fd)) abort();
+	assert(addr[5 * page_size] == 5);
+	assert(addr[3 * page_size] == 3);
+	assert(addr[3 * page_size + 1] == 3);
+	assert(addr[12 * page_size] == 12);
+	assert(other[2 * page_size] == OTHER_OFFSET + 2);
+	assert(addr[7 * page_size] == 7);
+	assert(uffdw_record_stop(uffdw));
+	assert(!uffdw_record_stop(uffdw));
+	uffdw_cancel(uffdw);
+	size_t expected[TOUCHES] = {5, 3, 12, OTHER_OFFSET + 2, 7};
+	assert(memcmp(asked, expected, sizeof(expected)) == 0);
+
+	// replay brings the same pages in the same order before they are touched
+	uffdw = start(&addr, &other, true, false);
+	if (!uffdw_replay(uffdw, fd)) abort();
+	wait_calls(TOUCHES);
+	assert(memcmp(asked, expected, sizeof(expected)) == 0);
+	assert(addr[5 * page_size] == 5);
+	assert(other[2 * page_size] == OTHER_OFFSET + 2);
+	assert(addr[7 * page_size] == 7);
+	struct uffdw_stats_t stats;
+	uffdw_get_stats(uffdw, &stats, NULL, 0);
+	assert(stats.counters.faults == 0);
+	assert(stats.counters.bytes_copied == TOUCHES * page_size);
+	assert(atomic_load(&calls) == TOUCHES);
+	uffdw_cancel(uffdw);
+
+	// pages of registrations that aren't there are left out
+	uffdw = start(&addr, &other, false, false);
+	if (!uffdw_replay(uffdw, fd)) abort();
+	wait_calls(TOUCHES - 1);
+	assert(asked[TOUCHES - 2] == 7);
+	uffdw_cancel(uffdw);
+
+	// pages in place already are skipped
+	uffdw = start(&addr, &other, true, false);
+	assert(addr[12 * page_size] == 12);
+	if (!uffdw_replay(uffdw, fd)) abort();
+	wait_calls(TOUCHES);
+	uffdw_cancel(uffdw);
+
+	// other files are refused
+	char other_path[] = "/tmp/uffdw-trace-XXXXXX";
+	int not_trace = mkstemp(other_path);
+	if (not_trace < 0) err(EXIT_FAILURE, "failed to create file");
+	unlink(other_path);
+	uffdw = start(&addr, &other, true, false);
+	assert(!uffdw_replay(uffdw, not_trace));
+	uffdw_cancel(uffdw);
+	close(not_trace);
+
+	// long trace is written whole
+	char long_path[] = "/tmp/uffdw-trace-XXXXXX";
+	int long_fd = mkstemp(long_path);
+	if (long_fd < 0) err(EXIT_FAILURE, "failed to create trace");
+	unlink(long_path);
+	uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+	char * long_addr = mmap(NULL, page_size * LONG_PAGES, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (long_addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(uffdw, (size_t)long_addr, page_size * LONG_PAGES, 0, long_handler, NULL)) abort();
+	if (!uffdw_record(uffdw, long_fd)) abort();
+	for (size_t p = LONG_PAGES; p > 0; p --) assert(long_addr[(p - 1) * page_size] == 0);
+	assert(uffdw_record_stop(uffdw));
+	uffdw_cancel(uffdw);
+	munmap(long_addr, page_size * LONG_PAGES);
+
+	atomic_store(&long_pages, 0);
+	uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+	long_addr = mmap(NULL, page_size * LONG_PAGES, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (long_addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(uffdw, (size_t)long_addr, page_size * LONG_PAGES, 0, long_handler, NULL)) abort();
+	if (!uffdw_replay(uffdw, long_fd)) abort();
+	for (size_t i = 0; i < 5000 && atomic_load(&long_pages) < LONG_PAGES; i ++) usleep(1000);
+	assert(atomic_load(&long_pages) == LONG_PAGES);
+	uffdw_cancel(uffdw);
+	close(long_fd);
+
+	close(fd);
+	return EXIT_SUCCESS;
+}
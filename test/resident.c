@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <err.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 64
+#define READAHEAD 4
+/* more than a block of residency bits, whatever the alignment */
+#define LARGE_PAGES 40000
+
+static size_t page_size;
+static char * addr;
+static size_t _Atomic last_size = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	atomic_store(&last_size, size);
+	char * buf = uffdw_scratch(size);
+	for (size_t i = 0; i < size; i += page_size) memset(buf + i, (char)((page + i) / page_size), page_size);
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+enum uffdw_status_t zero_handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)page;
+	(void)_;
+	return uffdw_zeropage(uffd, page_original, size);
+}
+
+static char * page_at(size_t p) {
+	return addr + p * page_size;
+}
+
+static void wait_resident(struct uffdw_t * uffdw, char * at, size_t len, size_t expected) {
+	for (size_t tries = 0; tries < 1000 && uffdw_resident(uffdw, (size_t)at, len) != expected; tries ++) {
+		usleep(1000);
+	}
+	assert(uffdw_resident(uffdw, (size_t)at, len) == expected);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	addr = mmap(
+		NULL, page_size * PAGES * 2,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+
+	// pages there before registration are known
+	memset(page_at(0), 100, page_size);
+	memset(page_at(20), 120, page_size);
+	struct uffdw_range_options_t options = {.readahead = READAHEAD};
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL,
+		&options
+	)) abort();
+	assert(uffdw_resident(uffdw, (size_t)addr, page_size * PAGES) == 2 * page_size);
+	assert(uffdw_first_missing(uffdw, (size_t)addr, page_size * PAGES) == (size_t)page_at(1));
+
+	// faulting page brings the window along
+	assert(*page_at(5) == 5);
+	assert(atomic_load(&last_size) == READAHEAD * page_size);
+	assert(uffdw_resident(uffdw, (size_t)page_at(5), page_size * READAHEAD) == page_size * READAHEAD);
+	assert(uffdw_first_missing(uffdw, (size_t)page_at(5), page_size * PAGES / 2) == (size_t)page_at(5 + READAHEAD));
+	assert(uffdw_resident(uffdw, (size_t)addr, page_size * PAGES) == (2 + READAHEAD) * page_size);
+
+	// window ends before a page that is there, which isn't asked for again
+	assert(*page_at(18) == 18);
+	assert(atomic_load(&last_size) == 2 * page_size);
+	assert(*page_at(20) == 120);
+
+	// dropped pages are missing again
+	if (madvise(page_at(6), page_size * 2, MADV_DONTNEED) != 0) err(EXIT_FAILURE, "failed to drop pages");
+	wait_resident(uffdw, page_at(5), page_size * READAHEAD, page_size * 2);
+	assert(uffdw_first_missing(uffdw, (size_t)page_at(5), page_size * READAHEAD) == (size_t)page_at(6));
+	assert(*page_at(6) == 6);
+
+	// and moved pages take their bits along
+	char * moved = mremap(page_at(16), page_size * 8, page_size * 8, MREMAP_MAYMOVE | MREMAP_FIXED, page_at(PAGES + 16));
+	if (moved == MAP_FAILED) err(EXIT_FAILURE, "failed to remap");
+	wait_resident(uffdw, page_at(16), page_size * 8, 0);
+	wait_resident(uffdw, moved, page_size * 8, page_size * 3);
+	assert(uffdw_first_missing(uffdw, (size_t)moved + page_size * 2, page_size * 6) == (size_t)moved + page_size * 5);
+	assert(moved[page_size * 4] == 120);
+
+	// unmapped ones are gone
+	if (munmap(addr, page_size * 8) != 0) err(EXIT_FAILURE, "failed to unmap");
+	wait_resident(uffdw, addr, page_size * 8, 0);
+
+	// bits of a large range are scanned across blocks
+	char * large = mmap(
+		NULL, page_size * LARGE_PAGES * 2,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (large == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(uffdw, (size_t)large, page_size * LARGE_PAGES * 2, 0, zero_handler, NULL)) abort();
+	if (!uffdw_prefetch(uffdw, (size_t)large + page_size, page_size * LARGE_PAGES)) abort();
+	wait_resident(uffdw, large, page_size * LARGE_PAGES * 2, page_size * LARGE_PAGES);
+	assert(uffdw_first_missing(uffdw, (size_t)large, page_size * LARGE_PAGES * 2) == (size_t)large);
+	assert(uffdw_first_missing(uffdw, (size_t)large + page_size, page_size * LARGE_PAGES * 2 - page_size) == (size_t)large + page_size * (LARGE_PAGES + 1));
+	assert(large[page_size * LARGE_PAGES] == 0);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
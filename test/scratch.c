@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 16
+
+static size_t page_size;
+static int fd;
+static void * first_scratch = NULL;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	// the same memory every time, ready for the copy
+	char * scratch = uffdw_scratch(size);
+	assert(scratch != NULL && (uintptr_t)scratch % page_size == 0);
+	if (first_scratch == NULL) first_scratch = scratch;
+	assert(scratch == first_scratch);
+
+	// odd pages come from the file, even ones are made here
+	if (page / page_size % 2) {
+		if (lseek(fd, page, SEEK_SET) != (off_t)page) return UFFDW_FAILED;
+		return uffdw_copy_from_fd(uffd, fd, page_original, size);
+	}
+	memset(scratch, (char)(page / page_size), size);
+	return uffdw_copy(uffd, scratch, page_original, size);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	char path[] = "/tmp/uffdw-test-XXXXXX";
+	fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create file");
+	if (unlink(path) != 0) err(EXIT_FAILURE, "failed to unlink file");
+	char * data = malloc(page_size * PAGES);
+	if (data == NULL) abort();
+	memset(data, 0, page_size * PAGES);
+	for (size_t p = 1; p < PAGES; p += 2) memset(data + p * page_size, (char)(100 + p), page_size);
+	if (write(fd, data, page_size * PAGES) != (ssize_t)(page_size * PAGES)) err(EXIT_FAILURE, "failed to write file");
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+	char * addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(uffdw, (size_t)addr, page_size * PAGES, 0, handler, NULL)) abort();
+
+	for (size_t p = 0; p < PAGES; p ++) {
+		assert(addr[p * page_size] == (char)(p % 2 ? 100 + p : p));
+		assert(addr[p * page_size + page_size - 1] == (char)(p % 2 ? 100 + p : p));
+	}
+
+	// other threads have their own, mapped again when more is asked for
+	char * small = uffdw_scratch(page_size);
+	assert(small != NULL && (void *)small != first_scratch);
+	assert(uffdw_scratch(1) == small);
+	size_t big = 16 << 20;
+	char * larger = uffdw_scratch(big);
+	assert(larger != NULL && (uintptr_t)larger % page_size == 0);
+	memset(larger, 1, big);
+	assert(uffdw_scratch(page_size) == larger);
+
+	uffdw_cancel(uffdw);
+	close(fd);
+	free(data);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <dirent.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define INSTANCES 4
+#define CHILDREN 16
+#define PAGES 4
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	// no allocation, a fork may be waiting for this very thread
+	char buf[size];
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)((page + i) / page_size), page_size);
+	}
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+static size_t count_threads(void) {
+	DIR * dir = opendir("/proc/self/task");
+	if (dir == NULL) err(EXIT_FAILURE, "failed to list threads");
+	size_t count = 0;
+	struct dirent * entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.') count ++;
+	}
+	closedir(dir);
+	return count;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdws[INSTANCES];
+	char * addrs[INSTANCES];
+	for (size_t i = 0; i < INSTANCES; i ++) {
+		uffdws[i] = uffdw_create_shared();
+		if (uffdws[i] == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+		addrs[i] = mmap(
+			NULL, page_size * PAGES,
+			PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0
+		);
+		if (addrs[i] == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+		if (!uffdw_register(
+			uffdws[i],
+			(size_t)addrs[i], page_size * PAGES, i * page_size * PAGES,
+			handler, NULL
+		)) abort();
+	}
+	size_t threads = count_threads();
+	// reactor threads and one setting up forks
+	assert(threads == 1 + UFFDW_REACTOR_THREADS + 1);
+
+	for (size_t i = 0; i < INSTANCES; i ++) {
+		assert(addrs[i][0] == (char)(i * PAGES));
+	}
+
+	// children are served by the same threads
+	pid_t pids[CHILDREN];
+	for (size_t c = 0; c < CHILDREN; c ++) {
+		pids[c] = fork();
+		if (pids[c] < 0) err(EXIT_FAILURE, "failed to fork");
+		if (pids[c] == 0) {
+			for (size_t i = 0; i < INSTANCES; i ++) {
+				size_t p = 1 + c % (PAGES - 1);
+				if (addrs[i][p * page_size] != (char)(i * PAGES + p)) return EXIT_FAILURE;
+			}
+			return EXIT_SUCCESS;
+		}
+		assert(count_threads() == threads);
+	}
+	for (size_t c = 0; c < CHILDREN; c ++) {
+		int s;
+		if (waitpid(pids[c], &s, 0) != pids[c]) abort();
+		assert(WIFEXITED(s) && WEXITSTATUS(s) == EXIT_SUCCESS);
+	}
+
+	for (size_t i = 0; i < INSTANCES; i ++) {
+		for (size_t p = 0; p < PAGES; p ++) {
+			assert(addrs[i][p * page_size] == (char)(i * PAGES + p));
+		}
+		uffdw_cancel(uffdws[i]);
+	}
+	assert(count_threads() == threads);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define FILE_PAGES 64
+#define MAPPED_PAGES 70
+#define READAHEAD 8
+
+static int probe_uffd = -1;
+
+enum uffdw_status_t probe_handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)page;
+	(void)_;
+	probe_uffd = uffd;
+	return uffdw_zeropage(uffd, page_original, size);
+}
+
+static int temp_file(void) {
+	char path[] = "/tmp/uffdw-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "failed to create file");
+	if (unlink(path) != 0) err(EXIT_FAILURE, "failed to unlink file");
+	return fd;
+}
+
+static void write_pages(int fd, const char * data, size_t size, size_t from, size_t to) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t start = from * page_size;
+	size_t end = to * page_size < size ? to * page_size : size;
+	if (pwrite(fd, data + start, end - start, start) != (ssize_t)(end - start)) {
+		err(EXIT_FAILURE, "failed to write file");
+	}
+}
+
+static void check(const char * addr, const char * data, size_t size, size_t data_offset, size_t pages) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < pages * page_size; i += 8) {
+		char expected = data_offset + i < size ? data[data_offset + i] : 0;
+		assert(addr[i] == expected);
+	}
+}
+
+int main() {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	// holes, data on pages 3 - 5 and 20, zeroes written on 10 - 12, last page cut in half
+	size_t size = page_size * FILE_PAGES - page_size / 2;
+	char * data = calloc(1, size);
+	if (data == NULL) abort();
+	for (size_t i = 0; i < size; i ++) {
+		size_t p = i / page_size;
+		if ((p >= 3 && p <= 5) || p == 20 || p == FILE_PAGES - 1) data[i] = (char)(1 + p + i / 100);
+	}
+	int fd = temp_file();
+	if (ftruncate(fd, size) != 0) err(EXIT_FAILURE, "failed to resize file");
+	write_pages(fd, data, size, 3, 6);
+	write_pages(fd, data, size, 10, 13);
+	write_pages(fd, data, size, 20, 21);
+	write_pages(fd, data, size, FILE_PAGES - 1, FILE_PAGES);
+
+	// image holds just the data pages
+	int image_fd = temp_file();
+	if (!uffdw_make_sparse(fd, image_fd)) abort();
+	struct stat st;
+	if (fstat(image_fd, &st) != 0) err(EXIT_FAILURE, "failed to stat file");
+	assert((size_t)st.st_size <= page_size * (1 + 5));
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	char * addr = mmap(
+		NULL, page_size * MAPPED_PAGES * 2,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+
+	// page by page, skipping the first two pages of the data and going past its end
+	if (!uffdw_register_sparse(
+		uffdw,
+		(size_t)addr, page_size * MAPPED_PAGES,
+		image_fd, page_size * 2
+	)) abort();
+	for (size_t p = MAPPED_PAGES; p > 0; p --) {
+		check(addr + (p - 1) * page_size, data, size, (p + 1) * page_size, 1);
+	}
+
+	// and in windows crossing extents
+	char * window = addr + page_size * MAPPED_PAGES;
+	struct uffdw_range_options_t options = {.readahead = READAHEAD};
+	if (!uffdw_register_sparse_opts(
+		uffdw,
+		(size_t)window, page_size * MAPPED_PAGES,
+		image_fd, 0,
+		&options
+	)) abort();
+	if (close(image_fd) != 0) err(EXIT_FAILURE, "failed to close file");
+	check(window, data, size, 0, MAPPED_PAGES);
+
+	// not a sparse image
+	assert(!uffdw_register_sparse(
+		uffdw,
+		(size_t)addr + page_size * MAPPED_PAGES * 2, page_size,
+		fd, 0
+	));
+
+	// hole whose first page is there already, unknown to uffdw
+	char * filled = mmap(
+		NULL, page_size * (MAPPED_PAGES + 1),
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (filled == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	char * probe = filled + page_size * MAPPED_PAGES;
+	if (!uffdw_register(uffdw, (size_t)probe, page_size, 0, probe_handler, NULL)) abort();
+	assert(*probe == 0);
+	image_fd = temp_file();
+	if (!uffdw_make_sparse(fd, image_fd)) abort();
+	if (!uffdw_register_sparse_opts(
+		uffdw,
+		(size_t)filled, page_size * MAPPED_PAGES,
+		image_fd, 0,
+		&options
+	)) abort();
+	if (close(image_fd) != 0) err(EXIT_FAILURE, "failed to close file");
+	if (!uffdw_zeropage(probe_uffd, (size_t)filled + page_size * 6, page_size)) abort();
+	// window of page 5 runs into the hole from page 6 on
+	check(filled + page_size * 5, data, size, page_size * 5, 1);
+	// and the rest of the hole is filled around it
+	char * hole = filled + page_size * 6;
+	size_t hole_size = page_size * (READAHEAD - 1);
+	for (size_t tries = 0; tries < 1000 && uffdw_resident(uffdw, (size_t)hole, hole_size) != hole_size; tries ++) {
+		usleep(1000);
+	}
+	assert(uffdw_resident(uffdw, (size_t)hole, hole_size) == hole_size);
+	check(filled, data, size, 0, MAPPED_PAGES);
+
+	uffdw_cancel(uffdw);
+	close(fd);
+	free(data);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 4
+
+static size_t page_size;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	(void)size;
+	char buf[page_size];
+	memset(buf, (char)(page / page_size), page_size);
+	return uffdw_copy(uffd, buf, page_original, page_size);
+}
+
+enum uffdw_status_t zero_handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	(void)page;
+	(void)size;
+	// the second time the page is there already
+	return uffdw_zeropage(uffd, page_original, page_size) && uffdw_zeropage(uffd, page_original, page_size);
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	char * addr = mmap(
+		NULL, page_size * PAGES * 2,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL
+	)) abort();
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr + page_size * PAGES, page_size * PAGES, 0,
+		zero_handler, NULL
+	)) abort();
+
+	for (size_t p = 0; p < 3; p ++) assert(addr[p * page_size] == (char)p);
+	for (size_t p = 0; p < 2; p ++) assert(addr[(PAGES + p) * page_size] == 0);
+
+	// faults are counted just after waking the threads, timing comes last
+	struct uffdw_stats_t stats;
+	struct uffdw_range_stats_t ranges[4];
+	size_t timed = 0;
+	while (timed < 5) {
+		usleep(1000);
+		assert(uffdw_get_stats(uffdw, &stats, ranges, 4) == 2);
+		timed = 0;
+		for (size_t b = 0; b < UFFDW_LATENCY_BUCKETS; b ++) timed += stats.latency[b];
+	}
+	assert(timed == 5);
+	assert(stats.counters.faults == 5);
+	assert(stats.counters.bytes_copied == 3 * page_size);
+	assert(stats.counters.bytes_zeroed == 2 * page_size);
+	assert(stats.counters.eexist == 2);
+	assert(stats.counters.failures == 0);
+
+	assert(ranges[0].offset == (size_t)addr && ranges[0].size == page_size * PAGES);
+	assert(ranges[0].counters.faults == 3);
+	assert(ranges[0].counters.bytes_copied == 3 * page_size);
+	assert(ranges[1].offset == (size_t)addr + page_size * PAGES);
+	assert(ranges[1].counters.faults == 2);
+	assert(ranges[1].counters.bytes_zeroed == 2 * page_size);
+
+	// events, parts of a range share its counters
+	int pid = fork();
+	if (pid == 0) return EXIT_SUCCESS;
+	int s;
+	if (waitpid(pid, &s, 0) != pid) abort();
+	if (munmap(addr + page_size, page_size) != 0) err(EXIT_FAILURE, "failed to unmap");
+	assert(uffdw_get_stats(uffdw, &stats, ranges, 1) == 3);
+	assert(ranges[0].size == page_size && ranges[0].counters.faults == 3);
+	assert(stats.unmaps == 1);
+	assert(stats.forks == 1);
+	assert(stats.remaps == 0);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 256
+#define THREADS 8
+
+static size_t page_size;
+static char * addr;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	char * buf = malloc(size);
+	if (buf == NULL) return false;
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)((page + i) / page_size), page_size);
+	}
+	bool result = uffdw_copy(uffd, buf, page_original, size);
+	free(buf);
+	return result;
+}
+
+void * touch(void * _i) {
+	size_t i = (size_t)_i;
+	for (size_t p = 0; p < PAGES; p ++) {
+		size_t page = (p * 7 + i) % PAGES;
+		assert(addr[page * page_size + i] == (char)page);
+	}
+	return NULL;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create_pool(4);
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	addr = mmap(
+		NULL, page_size * PAGES * 2,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	if (!uffdw_register(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL
+	)) abort();
+
+	// fault from many threads while registering more ranges
+	pthread_t threads[THREADS];
+	for (size_t i = 0; i < THREADS; i ++) {
+		if (pthread_create(&threads[i], NULL, touch, (void *)i) != 0) abort();
+	}
+	for (size_t p = PAGES; p < PAGES * 2; p ++) {
+		if (!uffdw_register(
+			uffdw,
+			(size_t)addr + p * page_size, page_size, (p % 2) * page_size,
+			handler, NULL
+		)) abort();
+	}
+	for (size_t i = 0; i < THREADS; i ++) {
+		if (pthread_join(threads[i], NULL) != 0) abort();
+	}
+
+	for (size_t p = PAGES; p < PAGES * 2; p ++) {
+		assert(addr[p * page_size] == (char)(p % 2));
+	}
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define SEGMENTS 64
+#define PAGES 16
+
+static size_t page_size;
+static size_t calls = 0;
+
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	calls ++;
+	char buf[size];
+	for (size_t i = 0; i < size; i += page_size) {
+		memset(buf + i, (char)(1 + (page + i) / page_size), page_size);
+	}
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+static char * map(size_t pages) {
+	char * addr = mmap(
+		NULL, page_size * pages,
+		PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	return addr;
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// segments given out of order, each with handler pages of its own
+	char * segments = map(SEGMENTS);
+	struct uffdw_registration_t registrations[SEGMENTS];
+	for (size_t i = 0; i < SEGMENTS; i ++) {
+		size_t s = (i * 7) % SEGMENTS;
+		registrations[i] = (struct uffdw_registration_t){
+			(size_t)segments + s * page_size, page_size, (SEGMENTS - s) * page_size,
+			handler, NULL,
+			NULL
+		};
+	}
+	if (!uffdw_register_many(uffdw, registrations, SEGMENTS)) abort();
+	for (size_t s = 0; s < SEGMENTS; s += 2) {
+		assert(segments[s * page_size] == (char)(1 + SEGMENTS - s));
+	}
+	assert(calls == SEGMENTS / 2);
+
+	// pages that were there stay, the rest are plain zeroes
+	if (!uffdw_unregister_many(uffdw, registrations, SEGMENTS)) abort();
+	for (size_t s = 0; s < SEGMENTS; s ++) {
+		assert(segments[s * page_size] == (s % 2 == 0 ? (char)(1 + SEGMENTS - s) : 0));
+	}
+	assert(calls == SEGMENTS / 2);
+
+	// unregistering the middle splits the range
+	char * addr = map(PAGES);
+	if (!uffdw_register(uffdw, (size_t)addr, page_size * PAGES, 0, handler, NULL)) abort();
+	if (!uffdw_unregister(uffdw, (size_t)addr + page_size * 4, page_size * 4)) abort();
+	for (size_t p = 0; p < PAGES; p ++) {
+		assert(addr[p * page_size] == (p >= 4 && p < 8 ? 0 : (char)(1 + p)));
+	}
+	assert(calls == SEGMENTS / 2 + PAGES - 4);
+
+	// and it can be registered again
+	if (!uffdw_unregister(uffdw, (size_t)addr, page_size * PAGES)) abort();
+	if (madvise(addr, page_size * PAGES, MADV_DONTNEED) != 0) err(EXIT_FAILURE, "failed to drop pages");
+	if (!uffdw_register(uffdw, (size_t)addr, page_size * PAGES, page_size, handler, NULL)) abort();
+	assert(addr[0] == 2);
+
+	// one range that can't be registered fails all of them
+	char * holed = map(5);
+	if (munmap(holed + page_size, page_size * 3) != 0) err(EXIT_FAILURE, "failed to unmap");
+	struct uffdw_registration_t some[] = {
+		{(size_t)holed, page_size, 0, handler, NULL, NULL},
+		{(size_t)holed + page_size * 2, page_size, page_size * 2, handler, NULL, NULL},
+		{(size_t)holed + page_size * 4, page_size, page_size * 4, handler, NULL, NULL},
+	};
+	assert(!uffdw_register_many(uffdw, some, 3));
+	assert(holed[0] == 0);
+	some[1] = some[2];
+	if (!uffdw_register_many(uffdw, some, 2)) abort();
+	if (madvise(holed, page_size, MADV_DONTNEED) != 0) err(EXIT_FAILURE, "failed to drop page");
+	assert(holed[0] == 1);
+	assert(holed[page_size * 4] == 5);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
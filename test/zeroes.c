@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+#define PAGES 16
+
+static size_t page_size;
+
+// pages 0, 1, 4, 5, 8, ... have data, the rest are zeroes but for a byte of page 3
+enum uffdw_status_t handler(int uffd, size_t page, size_t page_original, size_t size, void * _) {
+	(void)_;
+	char buf[size];
+	memset(buf, 0, size);
+	for (size_t i = 0; i < size; i += page_size) {
+		size_t p = (page + i) / page_size;
+		if (p % 4 < 2) memset(buf + i, (char)(p + 1), page_size);
+		if (p == 3) buf[i + page_size - 1] = 1;
+	}
+	return uffdw_copy(uffd, buf, page_original, size);
+}
+
+static char * map(struct uffdw_t * uffdw, bool detect) {
+	char * addr = mmap(
+		NULL, page_size * PAGES,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (addr == MAP_FAILED) err(EXIT_FAILURE, "failed to map");
+	struct uffdw_range_options_t options = {.readahead = PAGES, .detect_zeroes = detect};
+	if (!uffdw_register_opts(
+		uffdw,
+		(size_t)addr, page_size * PAGES, 0,
+		handler, NULL,
+		&options
+	)) abort();
+	return addr;
+}
+
+static void check(char * addr) {
+	for (size_t p = 0; p < PAGES; p ++) {
+		char value = p % 4 < 2 ? (char)(p + 1) : 0;
+		assert(addr[p * page_size] == value);
+		assert(addr[p * page_size + page_size - 1] == (p == 3 ? 1 : value));
+	}
+}
+
+int main() {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct uffdw_t * uffdw = uffdw_create();
+	if (uffdw == NULL) errx(EXIT_FAILURE, "failed to create uffdw");
+
+	// all pages come with one handler call, zeroes are not copied
+	char * sparse = map(uffdw, true);
+	check(sparse);
+	char * dense = map(uffdw, false);
+	check(dense);
+
+	struct uffdw_stats_t stats;
+	struct uffdw_range_stats_t ranges[2];
+	// bytes are counted just after the threads are woken
+	size_t filled = 0;
+	while (filled < page_size * PAGES * 2) {
+		uffdw_get_stats(uffdw, &stats, ranges, 2);
+		filled = stats.counters.bytes_copied + stats.counters.bytes_zeroed;
+		usleep(1000);
+	}
+	struct uffdw_range_stats_t * of_sparse = ranges[0].offset == (size_t)sparse ? &ranges[0] : &ranges[1];
+	struct uffdw_range_stats_t * of_dense = ranges[0].offset == (size_t)dense ? &ranges[0] : &ranges[1];
+	assert(of_sparse->counters.bytes_copied == page_size * (PAGES / 2 + 1));
+	assert(of_sparse->counters.bytes_zeroed == page_size * (PAGES / 2 - 1));
+	assert(of_dense->counters.bytes_copied == page_size * PAGES);
+	assert(of_dense->counters.bytes_zeroed == 0);
+
+	// zero page is copied on write like any other
+	sparse[page_size * 2] = 42;
+	assert(sparse[page_size * 2] == 42);
+	assert(sparse[page_size * 6] == 0);
+
+	uffdw_cancel(uffdw);
+
+	return EXIT_SUCCESS;
+}
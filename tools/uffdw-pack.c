@@ -0,0 +1,38 @@
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+int main(int argc, char ** argv) {
+	size_t block_size = UFFDW_PACK_BLOCK_MAX;
+	bool sparse = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:s")) != -1) {
+		if (opt == 'b') {
+			block_size = strtoul(optarg, NULL, 0);
+		} else if (opt == 's') {
+			sparse = true;
+		} else {
+			goto usage;
+		}
+	}
+	if (argc - optind != 2) goto usage;
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) err(EXIT_FAILURE, "failed to open %s", argv[optind]);
+	int packed_fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (packed_fd < 0) err(EXIT_FAILURE, "failed to open %s", argv[optind + 1]);
+	if (sparse ? !uffdw_make_sparse(fd, packed_fd) : !uffdw_pack(fd, packed_fd, block_size)) {
+		errx(EXIT_FAILURE, "failed to pack %s", argv[optind]);
+	}
+	if (close(packed_fd) != 0) err(EXIT_FAILURE, "failed to close %s", argv[optind + 1]);
+	close(fd);
+
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: %s [-b block_size | -s] file packed_file\n", argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,31 @@
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <uffdw.h>
+#include <unistd.h>
+
+int main(int argc, char ** argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s socket file\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int fd = open(argv[2], O_RDONLY);
+	if (fd < 0) err(EXIT_FAILURE, "failed to open %s", argv[2]);
+
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	if (strlen(argv[1]) >= sizeof(address.sun_path)) errx(EXIT_FAILURE, "socket path %s is too long", argv[1]);
+	strcpy(address.sun_path, argv[1]);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) err(EXIT_FAILURE, "failed to create socket");
+	unlink(argv[1]);
+	if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0) err(EXIT_FAILURE, "failed to bind %s", argv[1]);
+	if (listen(listen_fd, SOMAXCONN) != 0) err(EXIT_FAILURE, "failed to listen on %s", argv[1]);
+
+	if (!uffdw_serve_pages(listen_fd, fd)) errx(EXIT_FAILURE, "failed to serve %s", argv[2]);
+	return EXIT_SUCCESS;
+}